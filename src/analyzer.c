@@ -1,109 +1,2147 @@
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "analyzer.h"
+#include "compiler.h"
 #include "table.h"
 #include "vm.h"
 
-Analyzer analyzer = {0};
+void analyzer_ir_load(Analyzer *analyzer, Ir *ir) { analyzer->ir = ir; }
 
-void analyzer_ir_load(const Inst *insts) { analyzer.ir = insts; }
+void analyzer_fns_load(Analyzer *analyzer, Fn *fns, uint8_t fns_count) {
+  analyzer->fns = fns;
+  analyzer->fns_count = fns_count;
+}
 
-__attribute__((unused)) static void analyzer_basic_blocks_dump(void) {
-  printf("Basic blocks: \n");
-  for (size_t i = 0; i < analyzer.blocks_count; i++) {
-    Basic_block *block = &analyzer.blocks[i];
-    printf("B%d\n", block->block_no);
+__attribute__((unused)) static void
+analyzer_basic_blocks_dump(Analyzer *analyzer) {
+  fprintf(analyzer->out, "Basic blocks: \n");
+  for (size_t i = 0; i < analyzer->blocks_count; i++) {
+    Basic_block *block = &analyzer->blocks[i];
+    fprintf(analyzer->out, "B%d\n", block->block_no);
     for (size_t j = 0; j < block->len; j++) {
-      printf("\t");
-      vm_inst_dump(&analyzer.ir[block->start + j]);
+      fprintf(analyzer->out, "\t");
+      vm_inst_dump(analyzer->out, &analyzer->ir->insts[block->start + j]);
     }
   }
 }
 
-#define BLOCKS_PUSH(block) analyzer.blocks[analyzer.blocks_count++] = block;
+#define BLOCKS_PUSH(block) analyzer->blocks[analyzer->blocks_count++] = block;
 #define BLOCK_IS_END(type)                                                     \
   (type == INST_JMPA || type == INST_JMPT || type == INST_JMPNT ||             \
-   type == INST_RET)
+   type == INST_FORLOOP || type == INST_RET || type == INST_TAILCALL ||        \
+   type == INST_MEMOCALL || type == INST_MEMORET)
+
+#define NEXT_INST &analyzer->ir->insts[insts_pos++]
+#define CUR_INST &analyzer->ir->insts[insts_pos - 1]
+#define PREV_INST &analyzer->ir->insts[insts_pos - 2]
+
+static void analyzer_dse_local(Analyzer *analyzer, Basic_block *block) {
+  Hash_Table dse = hash_table_new();
+  size_t insts_pos = block->start;
+
+  while (insts_pos < block->start + block->len) {
+    const Inst *next_inst = NEXT_INST;
+
+    if (next_inst->type == INST_EOF) {
+      return;
+    }
+
+    if (next_inst->type == INST_DEFG) {
+      Sv name = next_inst->operand.as_sv;
+      Word *maybe_used = hash_table_get(&dse, name);
+      if (maybe_used && maybe_used->as_u64 == next_inst->type) {
+        fprintf(analyzer->out, "Remove useless code: %zu ~ %zu\n",
+                insts_pos - 1, insts_pos + 1);
+      };
+
+      hash_table_insert(&dse, name, (Word){.as_u64 = next_inst->type});
+    }
+
+    if (next_inst->type == INST_VARG || next_inst->type == INST_INCG) {
+      Sv name = next_inst->operand.as_sv;
+      hash_table_delete(&dse, name);
+    }
+  }
+
+  hash_table_destruct(&dse);
+}
+
+// Call sites end in `push ra; str ra; jmpa label`
+static int analyzer_inst_is_call(const Inst *insts, size_t pos) {
+  return (insts[pos].type == INST_JMPA || insts[pos].type == INST_MEMOCALL) &&
+         pos >= 2 &&
+         insts[pos - 1].type == INST_STR &&
+         insts[pos - 1].operand.as_u64 == REG_RA &&
+         insts[pos - 2].type == INST_PUSH;
+}
+
+int analyzer_inst_is_addr(const Inst *insts, size_t count, size_t pos) {
+  switch (insts[pos].type) {
+  case INST_JMPA:
+  case INST_JMPT:
+  case INST_JMPNT:
+  case INST_FORLOOP:
+  case INST_TAILCALL:
+  case INST_MEMOCALL:
+  case INST_MEMORET:
+  case INST_SPAWN:
+  case INST_PMAP:
+  case INST_PREDUCE:
+    return 1;
+  case INST_PUSH:
+    return pos + 1 < count && insts[pos + 1].type == INST_STR &&
+           insts[pos + 1].operand.as_u64 == REG_RA;
+  default:
+    return 0;
+  }
+}
+
+// Marks every inst a jump, call or return can land on
+static void analyzer_targets_mark(Analyzer *analyzer, uint8_t *targets) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  memset(targets, 0, count + 1);
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    targets[analyzer->fns[i].label_pos] = 1;
+  }
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if (analyzer_inst_is_addr(insts, count, pos) &&
+        insts[pos].operand.as_u64 <= count)
+      targets[insts[pos].operand.as_u64] = 1;
+  }
+}
+
+// Leaders are the entry, every jump target, return address and Fn label,
+// and the inst after each block end
+static void analyzer_basic_blocks_dismember(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint8_t leaders[INSTS_CAP + 1];
 
-#define NEXT_INST &analyzer.ir[insts_pos++]
-#define CUR_INST &analyzer.ir[insts_pos - 1]
-#define PREV_INST &analyzer.ir[insts_pos - 2]
+  analyzer_targets_mark(analyzer, leaders);
+  leaders[0] = 1;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if (BLOCK_IS_END(insts[pos].type))
+      leaders[pos + 1] = 1;
+  }
 
-static void analyzer_basic_blocks_dismember(void) {
+  analyzer->blocks_count = 0;
   size_t insts_pos = 0;
 
-  while (1) {
+  while (insts_pos < count) {
     Basic_block block = {
-        .block_no = analyzer.blocks_count,
+        .block_no = analyzer->blocks_count,
         .start = insts_pos,
         .len = 0,
     };
-    uint8_t block_len = 1;
 
-    while (1) {
+    do {
       const Inst *next_inst = NEXT_INST;
+      block.len++;
 
       if (next_inst->type == INST_EOF) {
-        block.len = block_len;
         BLOCKS_PUSH(block);
         return;
       }
+    } while (insts_pos < count && !leaders[insts_pos]);
 
-      if (BLOCK_IS_END(next_inst->type)) {
-        block.len = block_len;
-        BLOCKS_PUSH(block);
-        break;
+    BLOCKS_PUSH(block);
+  }
+}
+
+#undef BLOCKS_PUSH
+#undef BLOCK_IS_END
+
+static int analyzer_inst_stack_effect(const Inst_t type) {
+  switch (type) {
+  case INST_PUSH:
+  case INST_DUP:
+  case INST_PICK:
+  case INST_DEFL:
+  case INST_VARG:
+  case INST_VARL:
+  case INST_LDR:
+  case INST_YIELD:
+    return 1;
+  case INST_POP:
+  case INST_PLUS:
+  case INST_PLUSF:
+  case INST_MINUS:
+  case INST_MULT:
+  case INST_DIV:
+  case INST_EQ:
+  case INST_NE:
+  case INST_GT:
+  case INST_LT:
+  case INST_JMPT:
+  case INST_JMPNT:
+  case INST_STR:
+  case INST_MOV:
+  case INST_INCG:
+  case INST_ALOAD:
+  case INST_ADOT:
+  case INST_SPAWN:
+  case INST_SEND:
+  case INST_PREDUCE:
+    return -1;
+  case INST_AADD:
+  case INST_ASCALE:
+  case INST_AMASK:
+    return -2;
+  case INST_ASTORE:
+    return -3;
+  default:
+    return 0;
+  }
+}
+
+// Values an inst consumes; it pushes back pops plus its stack effect
+static int analyzer_inst_stack_pops(const Inst_t type) {
+  switch (type) {
+  case INST_ASTORE:
+  case INST_AADD:
+  case INST_ASCALE:
+  case INST_AMASK:
+    return 3;
+  case INST_ALOAD:
+  case INST_ADOT:
+  case INST_SEND:
+  case INST_PREDUCE:
+    return 2;
+  case INST_ANEW:
+  case INST_ALEN:
+  case INST_ASUM:
+  case INST_JOIN:
+  case INST_CHAN:
+  case INST_RECV:
+  case INST_PMAP:
+    return 1;
+  default:
+    return analyzer_inst_stack_effect(type) < 0 ? 1 : 0;
+  }
+}
+
+#define DEPTH_FLOW(pos, depth)                                                 \
+  do {                                                                         \
+    if ((pos) >= count)                                                        \
+      return 0;                                                                \
+    if (analyzer->depths[pos] == -1) {                                         \
+      analyzer->depths[pos] = depth;                                           \
+      worklist[worklist_count++] = pos;                                        \
+    } else if (analyzer->depths[pos] != (depth)) {                             \
+      return 0;                                                                \
+    }                                                                          \
+  } while (0)
+
+// Returns 0 if some inst is reached with two different depths
+static int analyzer_depths_compute(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  uint64_t worklist[INSTS_CAP];
+  size_t worklist_count = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    analyzer->depths[i] = -1;
+  }
+
+  DEPTH_FLOW(0, 0);
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    Fn *fn = &analyzer->fns[i];
+    DEPTH_FLOW(fn->label_pos, fn->arity);
+  }
+
+  while (worklist_count) {
+    uint64_t pos = worklist[--worklist_count];
+    const Inst *inst = &insts[pos];
+
+    int64_t depth =
+        analyzer->depths[pos] + analyzer_inst_stack_effect(inst->type);
+    if (depth < 0)
+      return 0;
+
+    switch (inst->type) {
+    case INST_JMPA:
+    case INST_MEMOCALL:
+      // The callee returns to ra with the frame as it left it
+      if (analyzer_inst_is_call(insts, pos)) {
+        DEPTH_FLOW(insts[pos - 2].operand.as_u64, depth);
+      } else {
+        DEPTH_FLOW(inst->operand.as_u64, depth);
       }
+      break;
+
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+      DEPTH_FLOW(inst->operand.as_u64, depth);
+      DEPTH_FLOW(pos + 1, depth);
+      break;
+
+    case INST_RET:
+    case INST_TAILCALL:
+    case INST_MEMORET:
+    case INST_EOF:
+      break;
 
-      block_len++;
+    default:
+      DEPTH_FLOW(pos + 1, depth);
     }
   }
+
+  return 1;
 }
 
-#undef BLOCKS_PUSH
-#undef BLOCKS_IS_END
+#undef DEPTH_FLOW
 
-static void analyzer_dse_local(Basic_block *block) {
-  Hash_Table dse = hash_table_new();
-  size_t insts_pos = block->start;
+// Passes that change code size rebuild the ir in rewritten, recording where
+// every old inst landed so jump targets, return addresses and Fn labels can
+// be relocated afterwards. Insts emitted with `pending` still hold old
+// targets.
+static void analyzer_rewrite_emit(Analyzer *analyzer, const Inst inst,
+                                  const uint8_t pending) {
+  assert(analyzer->rewritten_count < INSTS_CAP && "Rewrite overflow");
 
-  while (insts_pos < block->start + block->len) {
-    const Inst *next_inst = NEXT_INST;
+  analyzer->rewritten_pending[analyzer->rewritten_count] = pending;
+  analyzer->rewritten[analyzer->rewritten_count++] = inst;
+}
 
-    if (next_inst->type == INST_EOF) {
-      return;
+static void analyzer_rewrite_commit(Analyzer *analyzer) {
+  uint64_t count = analyzer->ir->insts_count;
+  analyzer->relocs[count] = analyzer->rewritten_count;
+
+  for (size_t i = 0; i < analyzer->rewritten_count; i++) {
+    if (!analyzer->rewritten_pending[i] ||
+        !analyzer_inst_is_addr(analyzer->rewritten, analyzer->rewritten_count,
+                               i))
+      continue;
+
+    uint64_t target = analyzer->rewritten[i].operand.as_u64;
+    assert(target <= count && "Relocation out of range");
+    analyzer->rewritten[i].operand.as_u64 = analyzer->relocs[target];
+  }
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    Fn *fn = &analyzer->fns[i];
+    fn->label_pos = analyzer->relocs[fn->label_pos];
+  }
+
+  memcpy(analyzer->ir->insts, analyzer->rewritten,
+         analyzer->rewritten_count * sizeof(Inst));
+  analyzer->ir->insts_count = analyzer->rewritten_count;
+  analyzer->rewritten_count = 0;
+}
+
+// Overhead of the call protocol an inlined site no longer executes:
+// ldr fp, ldr ra, mov cpsr, mov fp, str ra, jmpa, mov sp, str ra, str fp,
+// their operand pushes and the callee's ret
+#define INLINE_CALL_OVERHEAD 13
+
+#define FN_BODY_END(fn) analyzer->ir->insts[(fn)->label_pos - 1].operand.as_u64
+
+static int analyzer_fn_is_inlinable(Analyzer *analyzer, const Fn *fn) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t start = fn->label_pos;
+  uint64_t end = FN_BODY_END(fn);
+
+  if (fn->noinline || end <= start ||
+      end - start > ANALYZER_INLINE_THRESHOLD)
+    return 0;
+
+  if (insts[end - 1].type != INST_RET ||
+      analyzer->depths[start] != fn->arity)
+    return 0;
+
+  // Nested Fn labels would point into a copy nobody relocates
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    uint64_t label_pos = analyzer->fns[i].label_pos;
+    if (label_pos > start && label_pos < end)
+      return 0;
+  }
+
+  for (size_t pos = start; pos < end; pos++) {
+    const Inst *inst = &insts[pos];
+
+    switch (inst->type) {
+    case INST_JMPA:
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+      if (inst->operand.as_u64 < start || inst->operand.as_u64 >= end)
+        return 0;
+      break;
+
+    case INST_RET:
+      if (analyzer->depths[pos] != fn->arity)
+        return 0;
+      break;
+
+    case INST_STR:
+      // Only `str rax` of a return; anything else is a nested call
+      if (inst->operand.as_u64 != REG_RAX)
+        return 0;
+      break;
+
+    case INST_DEFL:
+    case INST_LDR:
+    case INST_MOV:
+    case INST_TAILCALL:
+    case INST_EOF:
+      return 0;
+
+    default:
+      break;
     }
+  }
 
-    if (next_inst->type == INST_DEFG) {
-      Sv name = next_inst->operand.as_sv;
-      Word *maybe_used = hash_table_get(&dse, name);
-      if (maybe_used && maybe_used->as_u64 == next_inst->type) {
-        printf("Remove useless code: %zu ~ %zu\n", insts_pos - 1,
-               insts_pos + 1);
-      };
+  return 1;
+}
 
-      hash_table_insert(&dse, name, (Word){.as_u64 = next_inst->type});
+// Copies the body without its final ret; every ret jumps past the copy
+static void analyzer_inline_body(Analyzer *analyzer, const Fn *fn,
+                                 const uint64_t depth) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t start = fn->label_pos;
+  uint64_t end = FN_BODY_END(fn) - 1;
+
+  uint64_t base = analyzer->rewritten_count;
+  uint64_t cont = base + (end - start);
+
+  for (size_t pos = start; pos < end; pos++) {
+    Inst inst = insts[pos];
+
+    switch (inst.type) {
+    case INST_VARL:
+      // Args already sit in the caller's frame at `depth`
+      inst.operand.as_u64 += depth;
+      break;
+
+    case INST_RET:
+      inst = MAKE_JMPA(cont);
+      break;
+
+    case INST_JMPA:
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+      inst.operand.as_u64 = base + (inst.operand.as_u64 - start);
+      break;
+
+    default:
+      break;
     }
 
-    if (next_inst->type == INST_VARG) {
-      Sv name = next_inst->operand.as_sv;
-      hash_table_delete(&dse, name);
+    analyzer_rewrite_emit(analyzer, inst, 0);
+  }
+}
+
+typedef enum {
+  INLINE_COPY,
+  INLINE_SKIP,
+  INLINE_BODY,
+} Inline_action;
+
+// Matches the sequence from compiler_expr_call around the jmpa at `pos`
+// and returns the position of its leading `ldr fp`, or -1
+static int64_t analyzer_call_site_start(Analyzer *analyzer, const Fn *fn,
+                                        const size_t pos) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  if (pos < 8 || insts[pos - 3].type != INST_MOV ||
+      insts[pos - 3].operand.as_u64 != REG_FP ||
+      insts[pos - 4].type != INST_PUSH ||
+      insts[pos - 4].operand.as_u64 != REG_CPSR)
+    return -1;
+
+  uint64_t post = pos + 1 + fn->arity;
+  if (post + 4 >= count)
+    return -1;
+
+  for (size_t i = pos + 1; i < post; i++) {
+    if (insts[i].type != INST_POP)
+      return -1;
+  }
+
+  if (insts[post].type != INST_PUSH ||
+      insts[post].operand.as_u64 != REG_FP ||
+      insts[post + 1].type != INST_MOV || insts[post + 2].type != INST_STR ||
+      insts[post + 3].type != INST_STR || insts[post + 4].type != INST_LDR ||
+      insts[post + 4].operand.as_u64 != REG_RAX)
+    return -1;
+
+  int64_t depth = analyzer->depths[pos - 4] - 2 - fn->arity;
+  if (analyzer->depths[pos - 4] == -1 || depth < 0)
+    return -1;
+
+  for (int64_t start = pos - 5; start >= 0; start--) {
+    if (insts[start].type == INST_LDR &&
+        insts[start].operand.as_u64 == REG_FP &&
+        insts[start + 1].type == INST_LDR &&
+        insts[start + 1].operand.as_u64 == REG_RA &&
+        insts[start + 3].type == INST_MOV &&
+        insts[start + 3].operand.as_u64 == REG_CPSR &&
+        analyzer->depths[start] == depth)
+      return start;
+  }
+
+  return -1;
+}
+
+void analyzer_analyze_inline(Analyzer *analyzer) {
+  if (!analyzer_depths_compute(analyzer))
+    return;
+
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  uint8_t inlinable[FN_CAP] = {0};
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    inlinable[i] = analyzer_fn_is_inlinable(analyzer, &analyzer->fns[i]);
+  }
+
+  Inline_action actions[INSTS_CAP] = {0};
+  const Fn *callees[INSTS_CAP];
+  uint64_t callee_depths[INSTS_CAP];
+  int64_t size = count;
+  int inlined = 0;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if (!analyzer_inst_is_call(insts, pos))
+      continue;
+
+    const Fn *fn = NULL;
+    for (size_t i = 0; i < analyzer->fns_count; i++) {
+      if (inlinable[i] &&
+          analyzer->fns[i].label_pos == insts[pos].operand.as_u64)
+        fn = &analyzer->fns[i];
+    }
+    if (fn == NULL)
+      continue;
+
+    int64_t start = analyzer_call_site_start(analyzer, fn, pos);
+    if (start == -1)
+      continue;
+
+    // Cost model: copied body against the protocol it replaces, bounded by
+    // what the program buffer can hold
+    int64_t growth =
+        (int64_t)(FN_BODY_END(fn) - fn->label_pos - 1) - INLINE_CALL_OVERHEAD;
+    if (size + growth >= INSTS_CAP)
+      continue;
+    size += growth;
+
+    for (size_t i = start; i < (size_t)start + 4; i++) {
+      actions[i] = INLINE_SKIP;
+    }
+    actions[pos - 4] = INLINE_BODY;
+    for (size_t i = pos - 3; i <= pos; i++) {
+      actions[i] = INLINE_SKIP;
+    }
+    uint64_t post = pos + 1 + fn->arity;
+    for (size_t i = post; i < post + 4; i++) {
+      actions[i] = INLINE_SKIP;
     }
+
+    callees[pos - 4] = fn;
+    callee_depths[pos - 4] = analyzer->depths[start];
+    inlined = 1;
   }
 
-  hash_table_destruct(&dse);
+  if (!inlined)
+    return;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    switch (actions[pos]) {
+    case INLINE_SKIP:
+      break;
+    case INLINE_BODY:
+      analyzer_inline_body(analyzer, callees[pos], callee_depths[pos]);
+      break;
+    case INLINE_COPY:
+      analyzer_rewrite_emit(analyzer, insts[pos], 1);
+      break;
+    }
+  }
+
+  analyzer_rewrite_commit(analyzer);
+}
+
+static Fn *analyzer_fn_at(Analyzer *analyzer, const uint64_t label_pos) {
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    if (analyzer->fns[i].label_pos == label_pos)
+      return &analyzer->fns[i];
+  }
+
+  return NULL;
+}
+
+// Pure in isolation: no globals, no output, no frame-absolute stores
+static int analyzer_fn_body_is_pure(Analyzer *analyzer, const Fn *fn) {
+  const Inst *insts = analyzer->ir->insts;
+
+  // Still being compiled, the jmpa over its body is not patched yet
+  if (FN_BODY_END(fn) > analyzer->ir->insts_count)
+    return 0;
+
+  for (size_t pos = fn->label_pos; pos < FN_BODY_END(fn); pos++) {
+    switch (insts[pos].type) {
+    case INST_PUSH:
+    case INST_POP:
+    case INST_DUP:
+    case INST_PICK:
+    case INST_PLUS:
+    case INST_PLUSF:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_SHL:
+    case INST_SHR:
+    case INST_EQ:
+    case INST_NE:
+    case INST_GT:
+    case INST_LT:
+    case INST_NEG:
+    case INST_VARL:
+    case INST_JMPA:
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+    case INST_RET:
+    case INST_LDR:
+    case INST_STR:
+    case INST_MOV:
+    case INST_TAILCALL:
+    case INST_MEMOCALL:
+    case INST_MEMORET:
+    case INST_LABEL:
+      continue;
+    default:
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Callees of a pure Fn must be pure as well; iterate to a fixed point
+// starting from every Fn that is pure in isolation
+void analyzer_analyze_purity(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    Fn *fn = &analyzer->fns[i];
+    fn->pure = analyzer_fn_body_is_pure(analyzer, fn);
+  }
+
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+
+    for (size_t i = 0; i < analyzer->fns_count; i++) {
+      Fn *fn = &analyzer->fns[i];
+      if (!fn->pure)
+        continue;
+
+      for (size_t pos = fn->label_pos; pos < FN_BODY_END(fn); pos++) {
+        if (!analyzer_inst_is_call(insts, pos) &&
+            insts[pos].type != INST_TAILCALL)
+          continue;
+
+        Fn *callee = analyzer_fn_at(analyzer, insts[pos].operand.as_u64);
+        if (callee == NULL || !callee->pure) {
+          fn->pure = 0;
+          changed = 1;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Calls to a pure Fn check its result cache first, its rets fill it
+void analyzer_analyze_memo(Analyzer *analyzer) {
+  Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  analyzer_analyze_purity(analyzer);
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    Fn *fn = &analyzer->fns[i];
+    if (!fn->pure || fn->arity > MEMO_ARITY_CAP)
+      continue;
+
+    // Rets of nested Fns would fill the wrong cache
+    int nested = 0;
+    for (size_t j = 0; j < analyzer->fns_count; j++) {
+      uint64_t label_pos = analyzer->fns[j].label_pos;
+      nested |= label_pos > fn->label_pos && label_pos < FN_BODY_END(fn);
+    }
+    if (nested)
+      continue;
+
+    for (size_t pos = fn->label_pos; pos < FN_BODY_END(fn); pos++) {
+      if (insts[pos].type == INST_RET)
+        insts[pos] = MAKE_MEMORET(fn->label_pos);
+    }
+
+    for (size_t pos = 0; pos < count; pos++) {
+      if (insts[pos].type == INST_JMPA && analyzer_inst_is_call(insts, pos) &&
+          insts[pos].operand.as_u64 == fn->label_pos)
+        insts[pos] = MAKE_MEMOCALL(fn->label_pos);
+    }
+  }
+}
+
+#undef FN_BODY_END
+
+// Natural loops as structured code produces them: a backward jmpa at
+// `latch` closing a contiguous body only entered at `head` and only left
+// for the inst after `latch`
+typedef struct {
+  uint64_t head;
+  uint64_t latch;
+} Loop;
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+} Hoist;
+
+#define LOOPS_CAP 32
+
+// Invariants kept on the stack across a single loop
+#define LICM_CAP 8
+
+static int analyzer_loop_is_simple(Analyzer *analyzer, const Loop *loop) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    uint64_t label_pos = analyzer->fns[i].label_pos;
+    if (label_pos > loop->head && label_pos <= loop->latch + 1)
+      return 0;
+  }
+
+  for (size_t pos = 0; pos < count; pos++) {
+    uint64_t target = insts[pos].operand.as_u64;
+
+    if (pos < loop->head || pos > loop->latch) {
+      if (analyzer_inst_is_addr(insts, count, pos) && target > loop->head &&
+          target <= loop->latch + 1)
+        return 0;
+      continue;
+    }
+
+    if (pos == loop->latch)
+      continue;
+
+    switch (insts[pos].type) {
+    case INST_JMPA:
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+      // Inner back edges make it an outer loop
+      if (target <= pos || target > loop->latch + 1)
+        return 0;
+      break;
+
+    case INST_RET:
+    case INST_TAILCALL:
+    case INST_MEMOCALL:
+    case INST_MEMORET:
+    case INST_DEFL:
+    case INST_LDR:
+    case INST_STR:
+    case INST_MOV:
+    case INST_EOF:
+      return 0;
+
+    default:
+      break;
+    }
+  }
+
+  return 1;
+}
+
+// Innermost simple loops only
+static size_t analyzer_loops_find(Analyzer *analyzer, Loop *loops) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  size_t loops_count = 0;
+
+  for (size_t pos = 0; pos < count && loops_count < LOOPS_CAP; pos++) {
+    if (insts[pos].type != INST_JMPA || analyzer_inst_is_call(insts, pos) ||
+        insts[pos].operand.as_u64 >= pos)
+      continue;
+
+    Loop loop = {.head = insts[pos].operand.as_u64, .latch = pos};
+    if (analyzer_loop_is_simple(analyzer, &loop))
+      loops[loops_count++] = loop;
+  }
+
+  return loops_count;
+}
+
+static int analyzer_sv_eq(const Sv a, const Sv b) {
+  return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+}
+
+static int analyzer_u64_log2(const uint64_t n) {
+  if (n == 0 || (n & (n - 1)) != 0)
+    return -1;
+
+  return __builtin_ctzll(n);
+}
+
+// `push 2^k; mult` is `shl k` and `push 2^k; div` is `shr k`
+static void analyzer_strength_reduce(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint8_t targets[INSTS_CAP + 1];
+  int reduced = 0;
+
+  analyzer_targets_mark(analyzer, targets);
+
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    int shift = insts[pos].type == INST_PUSH
+                    ? analyzer_u64_log2(insts[pos].operand.as_u64)
+                    : -1;
+    if (shift != -1 && pos + 1 < count && !targets[pos + 1] &&
+        (insts[pos + 1].type == INST_MULT ||
+         insts[pos + 1].type == INST_DIV)) {
+      analyzer_rewrite_emit(analyzer,
+                            insts[pos + 1].type == INST_MULT
+                                ? MAKE_SHL((uint64_t)shift)
+                                : MAKE_SHR((uint64_t)shift),
+                            0);
+      analyzer->relocs[++pos] = analyzer->rewritten_count - 1;
+      reduced = 1;
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  if (reduced) {
+    analyzer_rewrite_commit(analyzer);
+  } else {
+    analyzer->rewritten_count = 0;
+  }
+}
+
+// `varg i; push c; plus; defg i; pop` inside a loop is `push c; incg i`
+static void analyzer_induction_simplify(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint8_t targets[INSTS_CAP + 1];
+  uint8_t in_loop[INSTS_CAP] = {0};
+  Loop loops[LOOPS_CAP];
+  int simplified = 0;
+
+  analyzer_targets_mark(analyzer, targets);
+
+  size_t loops_count = analyzer_loops_find(analyzer, loops);
+  for (size_t i = 0; i < loops_count; i++) {
+    for (size_t pos = loops[i].head; pos < loops[i].latch; pos++) {
+      in_loop[pos] = 1;
+    }
+  }
+
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    const Inst *update = &insts[pos];
+    if (in_loop[pos] && pos + 5 <= count && update[0].type == INST_VARG &&
+        update[1].type == INST_PUSH &&
+        (update[2].type == INST_PLUS || update[2].type == INST_MINUS) &&
+        update[3].type == INST_DEFG && update[4].type == INST_POP &&
+        analyzer_sv_eq(update[0].operand.as_sv, update[3].operand.as_sv) &&
+        !targets[pos + 1] && !targets[pos + 2] && !targets[pos + 3] &&
+        !targets[pos + 4]) {
+      uint64_t step = update[1].operand.as_u64;
+      if (update[2].type == INST_MINUS)
+        step = -step;
+
+      analyzer_rewrite_emit(analyzer, MAKE_PUSH(((Word){.as_u64 = step})), 0);
+      analyzer_rewrite_emit(analyzer, MAKE_INCG(update[0].operand.as_sv), 0);
+      for (size_t i = 1; i < 5; i++) {
+        analyzer->relocs[pos + i] = analyzer->rewritten_count - 1;
+      }
+      pos += 4;
+      simplified = 1;
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  if (simplified) {
+    analyzer_rewrite_commit(analyzer);
+  } else {
+    analyzer->rewritten_count = 0;
+  }
+}
+
+// Invariant when the loop never writes it and it was defined on the way
+// in, so a hoisted load cannot fail where the loop would not have run. A
+// definition only counts if every way in runs it: no jump from outside
+// the loop lands between it and the head, which also rules out one in a
+// skipped branch or Fn body.
+static int analyzer_global_is_invariant(Analyzer *analyzer, const Loop *loop,
+                                        const Sv name) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  int64_t defined = -1;
+
+  // Once tasks exist, any back-edge may let another one store to it
+  for (size_t pos = 0; pos < analyzer->ir->insts_count; pos++) {
+    if (insts[pos].type == INST_SPAWN)
+      return 0;
+  }
+
+  for (size_t pos = 0; pos <= loop->latch; pos++) {
+    if ((insts[pos].type != INST_DEFG && insts[pos].type != INST_INCG) ||
+        !analyzer_sv_eq(insts[pos].operand.as_sv, name))
+      continue;
+
+    if (pos >= loop->head)
+      return 0;
+    defined = pos;
+  }
+
+  if (defined == -1)
+    return 0;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    uint64_t target = insts[pos].operand.as_u64;
+    if ((pos < loop->head || pos > loop->latch) &&
+        analyzer_inst_is_addr(insts, count, pos) &&
+        target > (uint64_t)defined && target <= loop->head)
+      return 0;
+  }
+
+  return 1;
 }
 
-void analyzer_analyze_dse(void) {
-  analyzer_basic_blocks_dismember();
-  analyzer_basic_blocks_dump();
+// Invariant when the slot was already on the stack on the way in and no
+// counted loop inside steps it; slots the body pushes itself are fresh on
+// every iteration, and may not exist yet where the preheader would run
+static int analyzer_local_is_invariant(Analyzer *analyzer, const Loop *loop,
+                                       const uint64_t offset) {
+  const Inst *insts = analyzer->ir->insts;
 
-  for (size_t i = 0; i < analyzer.blocks_count; i++) {
-    analyzer_dse_local(&analyzer.blocks[i]);
+  if (offset >= (uint64_t)analyzer->depths[loop->head])
+    return 0;
+
+  for (size_t pos = loop->head; pos < loop->latch; pos++) {
+    if (insts[pos].type == INST_FORLOOP && analyzer->depths[pos] >= 3 &&
+        (uint64_t)analyzer->depths[pos] - 3 == offset)
+      return 0;
   }
+
+  return 1;
 }
 
+#define STARTS_PUSH(start)                                                     \
+  do {                                                                         \
+    assert(starts_count < INSTS_CAP && "Symbolic stack overflow");             \
+    starts[starts_count++] = start;                                            \
+  } while (0)
+#define STARTS_POP (starts_count ? starts[--starts_count] : -1)
+
+// Maximal invariant expressions of the loop, outermost first. Stack
+// entries carry the inst their invariant expression starts at, or -1.
+static size_t analyzer_loop_invariants(Analyzer *analyzer, const Loop *loop,
+                                       const uint8_t *targets, Hoist *hoists) {
+  const Inst *insts = analyzer->ir->insts;
+
+  int64_t starts[INSTS_CAP];
+  size_t starts_count = 0;
+  int64_t barrier = (int64_t)loop->head - 1;
+  size_t hoists_count = 0;
+
+  for (size_t pos = loop->head; pos < loop->latch; pos++) {
+    const Inst *inst = &insts[pos];
+    int64_t start = -1;
+    int64_t lhs, rhs;
+
+    // Merging paths may bring anything
+    if (targets[pos]) {
+      starts_count = 0;
+      barrier = pos - 1;
+    }
+
+    switch (inst->type) {
+    case INST_PUSH:
+      start = pos;
+      break;
+
+    case INST_VARL:
+      if (analyzer_local_is_invariant(analyzer, loop, inst->operand.as_u64))
+        start = pos;
+      break;
+
+    case INST_VARG:
+      if (analyzer_global_is_invariant(analyzer, loop, inst->operand.as_sv))
+        start = pos;
+      break;
+
+    case INST_NEG:
+    case INST_SHL:
+    case INST_SHR:
+      start = STARTS_POP;
+      break;
+
+    case INST_PLUS:
+    case INST_PLUSF:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_EQ:
+    case INST_NE:
+    case INST_GT:
+    case INST_LT:
+      rhs = STARTS_POP;
+      lhs = STARTS_POP;
+      start = lhs == -1 || rhs == -1 ? -1 : lhs;
+      break;
+
+    case INST_DIV:
+      // May trap, so it stays where the loop guards it
+      (void)STARTS_POP;
+      (void)STARTS_POP;
+      break;
+
+    default: {
+      barrier = pos;
+
+      int pops = analyzer_inst_stack_pops(inst->type);
+      int pushes = pops + analyzer_inst_stack_effect(inst->type);
+      for (int i = 0; i < pops; i++)
+        (void)STARTS_POP;
+      for (int i = 0; i < pushes; i++)
+        STARTS_PUSH(-1);
+      continue;
+    }
+    }
+
+    STARTS_PUSH(start);
+
+    if (start <= barrier || (start == (int64_t)pos && inst->type != INST_VARG))
+      continue;
+
+    while (hoists_count && hoists[hoists_count - 1].start >= (uint64_t)start)
+      hoists_count--;
+
+    if (hoists_count < LICM_CAP)
+      hoists[hoists_count++] = (Hoist){.start = start, .end = pos};
+  }
+
+  return hoists_count;
+}
+
+#undef STARTS_PUSH
+#undef STARTS_POP
+
+// Invariants are computed once in a preheader and stay on the stack below
+// the loop's own values, where the body picks them; the exit pops them.
+// Slots the body pushes itself sit above them, so its loads of those move
+// up by as many.
+static void analyzer_licm(Analyzer *analyzer) {
+  if (!analyzer_depths_compute(analyzer))
+    return;
+
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint8_t targets[INSTS_CAP + 1];
+  Loop loops[LOOPS_CAP];
+  Hoist hoists[LOOPS_CAP][LICM_CAP];
+  size_t hoists_count[LOOPS_CAP] = {0};
+
+  int16_t loop_head[INSTS_CAP + 1];
+  int16_t loop_exit[INSTS_CAP + 1];
+  int16_t loop_latch[INSTS_CAP + 1];
+  int16_t loop_body[INSTS_CAP];
+  int64_t picks[INSTS_CAP];
+  uint64_t pick_ends[INSTS_CAP];
+  uint64_t header_pos[LOOPS_CAP];
+  int64_t size = count;
+  int hoisted = 0;
+
+  for (size_t pos = 0; pos <= count; pos++) {
+    loop_head[pos] = loop_exit[pos] = loop_latch[pos] = -1;
+    if (pos < count)
+      picks[pos] = loop_body[pos] = -1;
+  }
+
+  analyzer_targets_mark(analyzer, targets);
+
+  size_t loops_count = analyzer_loops_find(analyzer, loops);
+  for (size_t i = 0; i < loops_count; i++) {
+    const Loop *loop = &loops[i];
+    int64_t depth = analyzer->depths[loop->head];
+
+    if (depth == -1 || analyzer->depths[loop->latch + 1] != depth)
+      continue;
+
+    size_t n = analyzer_loop_invariants(analyzer, loop, targets, hoists[i]);
+    int reachable = 1;
+    for (size_t j = 0; j < n; j++) {
+      reachable &= analyzer->depths[hoists[i][j].start] != -1;
+    }
+
+    // A push in the preheader, a pick in the body and a pop on exit each
+    if (!reachable || n == 0 || size + 2 * (int64_t)n >= INSTS_CAP)
+      continue;
+    size += 2 * n;
+
+    for (size_t j = 0; j < n; j++) {
+      const Hoist *hoist = &hoists[i][j];
+      picks[hoist->start] =
+          analyzer->depths[hoist->start] + n - 1 - (depth + j);
+      pick_ends[hoist->start] = hoist->end;
+    }
+
+    hoists_count[i] = n;
+    for (size_t pos = loop->head; pos < loop->latch; pos++) {
+      loop_body[pos] = i;
+    }
+    loop_head[loop->head] = i;
+    loop_exit[loop->latch + 1] = i;
+    loop_latch[loop->latch] = i;
+    hoisted = 1;
+  }
+
+  if (!hoisted)
+    return;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    if (loop_exit[pos] != -1) {
+      for (size_t j = 0; j < hoists_count[loop_exit[pos]]; j++) {
+        analyzer_rewrite_emit(analyzer, MAKE_POP, 0);
+      }
+    }
+
+    if (loop_head[pos] != -1) {
+      int16_t i = loop_head[pos];
+      for (size_t j = 0; j < hoists_count[i]; j++) {
+        for (size_t p = hoists[i][j].start; p <= hoists[i][j].end; p++) {
+          analyzer_rewrite_emit(analyzer, insts[p], 0);
+        }
+      }
+      header_pos[i] = analyzer->rewritten_count;
+    }
+
+    if (picks[pos] != -1) {
+      analyzer_rewrite_emit(
+          analyzer, picks[pos] ? MAKE_PICK((uint64_t)picks[pos]) : MAKE_DUP, 0);
+      uint64_t end = pick_ends[pos];
+      for (; pos < end; pos++) {
+        analyzer->relocs[pos + 1] = analyzer->relocs[pos];
+      }
+      continue;
+    }
+
+    if (loop_latch[pos] != -1) {
+      analyzer_rewrite_emit(analyzer, MAKE_JMPA(header_pos[loop_latch[pos]]),
+                            0);
+      continue;
+    }
+
+    int16_t i = loop_body[pos];
+    if (i != -1 && insts[pos].type == INST_VARL &&
+        insts[pos].operand.as_u64 >=
+            (uint64_t)analyzer->depths[loops[i].head]) {
+      analyzer_rewrite_emit(
+          analyzer, MAKE_VARL(insts[pos].operand.as_u64 + hoists_count[i]),
+          0);
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  analyzer_rewrite_commit(analyzer);
+}
+
+// Counted loops as compiler_stmt_for_counted emits them with constant
+// bounds: `push start; push limit; push step; varl c; varl c+1; lt;
+// jmpnt exit; body; forloop body; pop; pop; pop`
+typedef struct {
+  uint64_t entry;
+  uint64_t body;
+  uint64_t latch;
+  uint64_t counter;
+
+  uint64_t start;
+  uint64_t step;
+  uint64_t trips;
+} Counted_loop;
+
+static int analyzer_counted_loop_match(Analyzer *analyzer, const uint64_t latch,
+                                       Counted_loop *loop) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint64_t body = insts[latch].operand.as_u64;
+
+  if (body < 7 || body > latch || latch + 4 > count)
+    return 0;
+
+  const Inst *head = &insts[body - 7];
+  uint64_t counter = head[3].operand.as_u64;
+  if (head[0].type != INST_PUSH || head[1].type != INST_PUSH ||
+      head[2].type != INST_PUSH || head[3].type != INST_VARL ||
+      head[4].type != INST_VARL || head[4].operand.as_u64 != counter + 1 ||
+      head[5].type != INST_LT || head[6].type != INST_JMPNT ||
+      head[6].operand.as_u64 != latch + 1)
+    return 0;
+
+  for (size_t pos = latch + 1; pos < latch + 4; pos++) {
+    if (insts[pos].type != INST_POP)
+      return 0;
+  }
+
+  uint64_t start = head[0].operand.as_u64;
+  uint64_t limit = head[1].operand.as_u64;
+  uint64_t step = head[2].operand.as_u64;
+  if (step == 0 || start >= limit)
+    return 0;
+
+  // Innermost, entered only at the top and no Fn defined inside
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    uint64_t label_pos = analyzer->fns[i].label_pos;
+    if (label_pos > body - 7 && label_pos < latch + 4)
+      return 0;
+  }
+
+  for (size_t pos = body; pos < latch; pos++) {
+    uint64_t target = insts[pos].operand.as_u64;
+
+    switch (insts[pos].type) {
+    case INST_JMPA:
+      if (analyzer_inst_is_call(insts, pos))
+        break;
+      // fallthrough
+    case INST_JMPT:
+    case INST_JMPNT:
+      if (target <= pos || target > latch)
+        return 0;
+      break;
+
+    case INST_FORLOOP:
+    case INST_DEFL:
+    case INST_EOF:
+      return 0;
+
+    default:
+      break;
+    }
+  }
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if ((pos < body - 7 || pos > latch + 3) &&
+        analyzer_inst_is_addr(insts, count, pos) &&
+        insts[pos].operand.as_u64 > body - 7 &&
+        insts[pos].operand.as_u64 <= latch + 3)
+      return 0;
+  }
+
+  *loop = (Counted_loop){
+      .entry = body - 7,
+      .body = body,
+      .latch = latch,
+      .counter = counter,
+      .start = start,
+      .step = step,
+      .trips = (limit - start - 1) / step + 1,
+  };
+  return 1;
+}
+
+static uint64_t analyzer_unroll_copy_len(Analyzer *analyzer,
+                                         const Counted_loop *loop) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t len = 0;
+
+  for (size_t pos = loop->body; pos < loop->latch; pos++) {
+    len += insts[pos].type == INST_VARL &&
+                   insts[pos].operand.as_u64 == loop->counter
+               ? 3
+               : 1;
+  }
+
+  return len;
+}
+
+// One iteration with the counter read as `counter + offset`; jumps within
+// the body, including to the latch, stay inside this copy
+static void analyzer_unroll_copy(Analyzer *analyzer, const Counted_loop *loop,
+                                 const uint64_t offset) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint64_t map[INSTS_CAP];
+
+  uint64_t at = analyzer->rewritten_count;
+  for (size_t pos = loop->body; pos <= loop->latch; pos++) {
+    map[pos] = at;
+    at += insts[pos].type == INST_VARL &&
+                  insts[pos].operand.as_u64 == loop->counter && offset
+              ? 3
+              : 1;
+  }
+
+  for (size_t pos = loop->body; pos < loop->latch; pos++) {
+    Inst inst = insts[pos];
+    uint64_t target = inst.operand.as_u64;
+
+    if (inst.type == INST_VARL && target == loop->counter && offset) {
+      analyzer_rewrite_emit(analyzer, inst, 0);
+      analyzer_rewrite_emit(analyzer, MAKE_PUSH(((Word){.as_u64 = offset})), 0);
+      analyzer_rewrite_emit(analyzer, MAKE_PLUS, 0);
+      continue;
+    }
+
+    if (analyzer_inst_is_addr(insts, count, pos) && target >= loop->body &&
+        target <= loop->latch) {
+      inst.operand.as_u64 = map[target];
+      analyzer_rewrite_emit(analyzer, inst, 0);
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, inst, 1);
+  }
+}
+
+// Loops of at most the unroll factor are unrolled completely. Longer ones
+// run `factor` copies per forloop up to the last multiple of the factor,
+// and the remaining iterations follow as straight copies. The counter
+// after the loop is known either way, since the trip count is.
+static void analyzer_unroll_emit(Analyzer *analyzer, const Counted_loop *loop) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t factor = ANALYZER_UNROLL_FACTOR;
+  uint64_t main_trips = loop->trips > factor ? loop->trips / factor : 0;
+  uint64_t rest = loop->trips - main_trips * factor;
+  uint64_t rest_start = loop->start + main_trips * factor * loop->step;
+
+  analyzer_rewrite_emit(analyzer, insts[loop->entry], 0);
+
+  if (main_trips) {
+    // push limit; push step
+    analyzer_rewrite_emit(analyzer, MAKE_PUSH(((Word){.as_u64 = rest_start})),
+                          0);
+    analyzer_rewrite_emit(analyzer, 
+        MAKE_PUSH(((Word){.as_u64 = factor * loop->step})), 0);
+
+    // varl c; varl c+1; lt; jmpnt
+    for (size_t pos = loop->body - 4; pos < loop->body - 1; pos++) {
+      analyzer_rewrite_emit(analyzer, insts[pos], 0);
+    }
+    uint64_t jmpnt_pos = analyzer->rewritten_count;
+    analyzer_rewrite_emit(analyzer, insts[loop->body - 1], 0);
+
+    uint64_t body_pos = analyzer->rewritten_count;
+    for (size_t k = 0; k < factor; k++) {
+      analyzer_unroll_copy(analyzer, loop, k * loop->step);
+    }
+    analyzer_rewrite_emit(analyzer, MAKE_FORLOOP(body_pos), 0);
+    analyzer->rewritten[jmpnt_pos].operand.as_u64 = analyzer->rewritten_count;
+  } else {
+    analyzer_rewrite_emit(analyzer, insts[loop->entry + 1], 0);
+    analyzer_rewrite_emit(analyzer, insts[loop->entry + 2], 0);
+  }
+
+  // The counter sits at rest_start whether or not the loop above ran
+  for (size_t k = 0; k < rest; k++) {
+    analyzer_unroll_copy(analyzer, loop, k * loop->step);
+  }
+
+  for (size_t i = 0; i < 3; i++) {
+    analyzer_rewrite_emit(analyzer, MAKE_POP, 0);
+  }
+}
+
+void analyzer_analyze_unroll(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  Counted_loop loops[LOOPS_CAP];
+  size_t loops_count = 0;
+  int64_t size = count;
+
+  for (size_t pos = 0; pos < count && loops_count < LOOPS_CAP; pos++) {
+    Counted_loop loop;
+    if (insts[pos].type != INST_FORLOOP ||
+        !analyzer_counted_loop_match(analyzer, pos, &loop))
+      continue;
+
+    uint64_t factor = ANALYZER_UNROLL_FACTOR;
+    uint64_t copies = loop.trips > factor
+                          ? factor + loop.trips % factor
+                          : loop.trips;
+    int64_t old_len = loop.latch + 4 - loop.entry;
+    int64_t new_len = 3 + (loop.trips > factor ? 5 : 0) +
+                      copies * analyzer_unroll_copy_len(analyzer, &loop) + 3;
+
+    if (new_len - old_len > ANALYZER_UNROLL_BUDGET ||
+        size + new_len - old_len >= INSTS_CAP)
+      continue;
+    size += new_len - old_len;
+
+    loops[loops_count++] = loop;
+  }
+
+  if (!loops_count)
+    return;
+
+  size_t next = 0;
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    if (next < loops_count && loops[next].entry == pos) {
+      for (size_t i = pos + 1; i < loops[next].latch + 4; i++) {
+        analyzer->relocs[i] = analyzer->rewritten_count;
+      }
+
+      analyzer_unroll_emit(analyzer, &loops[next]);
+      pos = loops[next++].latch + 3;
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  analyzer_rewrite_commit(analyzer);
+}
+
+// Counted loops with a step of 1 whose body is a single element-wise
+// store, `c[i] = e;` with e built from a[i], i, invariants, +, - and *.
+// The body and forloop become `varx c; <operands of e>; vexpr e; pop...`,
+// leaving the guard and the exit pops as they were.
+typedef struct {
+  uint64_t body;
+  uint64_t latch;
+
+  uint64_t prog;
+  uint64_t operands[VEXPR_OPS_CAP];
+  uint8_t operands_count;
+} Vector_loop;
+
+static int analyzer_vector_loop_match(Analyzer *analyzer, const uint64_t latch,
+                                      Vector_loop *loop) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint64_t body = insts[latch].operand.as_u64;
+
+  if (body < 5 || body + 3 > latch || latch + 4 > count)
+    return 0;
+
+  // push 1; varl c; varl c+1; lt; jmpnt exit
+  const Inst *head = &insts[body - 5];
+  uint64_t counter = head[1].operand.as_u64;
+  if (head[0].type != INST_PUSH || head[0].operand.as_u64 != 1 ||
+      head[1].type != INST_VARL || head[2].type != INST_VARL ||
+      head[2].operand.as_u64 != counter + 1 || head[3].type != INST_LT ||
+      head[4].type != INST_JMPNT || head[4].operand.as_u64 != latch + 1)
+    return 0;
+
+  for (size_t pos = latch + 1; pos < latch + 4; pos++) {
+    if (insts[pos].type != INST_POP)
+      return 0;
+  }
+
+  // varx c; varl i; e; astore
+  const Inst *dst = &insts[body];
+  if ((dst->type != INST_VARG &&
+       (dst->type != INST_VARL || dst->operand.as_u64 == counter)) ||
+      insts[body + 1].type != INST_VARL ||
+      insts[body + 1].operand.as_u64 != counter ||
+      insts[latch - 1].type != INST_ASTORE)
+    return 0;
+
+  Vexpr_op ops[VEXPR_OPS_CAP];
+  size_t ops_count = 0;
+  size_t depth = 0;
+  loop->operands_count = 0;
+
+  for (size_t pos = body + 2; pos < latch - 1; pos++) {
+    const Inst *inst = &insts[pos];
+    Vexpr_op op;
+
+    if (ops_count == VEXPR_OPS_CAP)
+      return 0;
+
+    switch (inst->type) {
+    case INST_VARL:
+      if (inst->operand.as_u64 == counter) {
+        op = VEXPR_INDEX;
+        break;
+      }
+      // fallthrough
+    case INST_PUSH:
+    case INST_VARG:
+      // Nothing in the body writes a local or global
+      op = VEXPR_SCALAR;
+      loop->operands[loop->operands_count++] = pos;
+      break;
+    case INST_ALOAD:
+      // Only a[i], with the handle read by a single inst
+      if (ops_count < 2 || ops[ops_count - 2] != VEXPR_SCALAR ||
+          ops[ops_count - 1] != VEXPR_INDEX)
+        return 0;
+      ops_count -= 2;
+      depth -= 2;
+      op = VEXPR_ELEM;
+      break;
+    case INST_PLUS:
+      op = VEXPR_PLUS;
+      break;
+    case INST_MINUS:
+      op = VEXPR_MINUS;
+      break;
+    case INST_MULT:
+      op = VEXPR_MULT;
+      break;
+    case INST_NEG:
+      op = VEXPR_NEG;
+      break;
+    default:
+      return 0;
+    }
+
+    if (op == VEXPR_PLUS || op == VEXPR_MINUS || op == VEXPR_MULT) {
+      if (depth-- < 2)
+        return 0;
+    } else if (op != VEXPR_NEG) {
+      depth++;
+    }
+
+    if (depth > VEXPR_DEPTH_CAP)
+      return 0;
+    ops[ops_count++] = op;
+  }
+
+  if (depth != 1)
+    return 0;
+
+  for (size_t i = 0; i < analyzer->fns_count; i++) {
+    uint64_t label_pos = analyzer->fns[i].label_pos;
+    if (label_pos > body - 5 && label_pos < latch + 4)
+      return 0;
+  }
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if ((pos < body - 5 || pos > latch) &&
+        analyzer_inst_is_addr(insts, count, pos) &&
+        insts[pos].operand.as_u64 > body - 5 &&
+        insts[pos].operand.as_u64 <= latch + 3)
+      return 0;
+  }
+
+  loop->body = body;
+  loop->latch = latch;
+  loop->prog = 0;
+  for (size_t i = 0; i < ops_count; i++) {
+    loop->prog |= (uint64_t)ops[i] << (4 * i);
+  }
+  return 1;
+}
+
+void analyzer_analyze_vectorize(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  Vector_loop loops[LOOPS_CAP];
+  size_t loops_count = 0;
+
+  for (size_t pos = 0; pos < count && loops_count < LOOPS_CAP; pos++) {
+    if (insts[pos].type == INST_FORLOOP &&
+        analyzer_vector_loop_match(analyzer, pos, &loops[loops_count]))
+      loops_count++;
+  }
+
+  if (!loops_count)
+    return;
+
+  size_t next = 0;
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    if (next < loops_count && loops[next].body == pos) {
+      const Vector_loop *loop = &loops[next++];
+
+      for (size_t i = pos + 1; i <= loop->latch; i++) {
+        analyzer->relocs[i] = analyzer->rewritten_count;
+      }
+
+      analyzer_rewrite_emit(analyzer, insts[loop->body], 0);
+      for (size_t i = 0; i < loop->operands_count; i++) {
+        analyzer_rewrite_emit(analyzer, insts[loop->operands[i]], 0);
+      }
+      analyzer_rewrite_emit(analyzer, MAKE_VEXPR(loop->prog), 0);
+      for (size_t i = 0; i <= loop->operands_count; i++) {
+        analyzer_rewrite_emit(analyzer, MAKE_POP, 0);
+      }
+
+      pos = loop->latch;
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  analyzer_rewrite_commit(analyzer);
+}
+
+void analyzer_analyze_loops(Analyzer *analyzer) {
+  analyzer_strength_reduce(analyzer);
+  analyzer_induction_simplify(analyzer);
+  analyzer_licm(analyzer);
+}
+
+// Local value numbering: each block is run over a symbolic stack whose
+// entries carry the value number of what they hold and, for results of a
+// pure expression, the inst that expression starts at. A value already
+// sitting deeper in the stack is picked instead of being recomputed.
+typedef struct {
+  uint64_t vn;
+  int64_t start;
+} Value_slot;
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  uint64_t depth;
+} Cse_reuse;
+
+static int analyzer_value_eq(const Value *a, const Value *b) {
+  if (a->type != b->type || a->epoch != b->epoch || a->lhs != b->lhs ||
+      a->rhs != b->rhs)
+    return 0;
+
+  if (a->type == INST_VARG)
+    return a->operand.as_sv.len == b->operand.as_sv.len &&
+           memcmp(a->operand.as_sv.str, b->operand.as_sv.str,
+                  a->operand.as_sv.len) == 0;
+
+  return a->operand.as_u64 == b->operand.as_u64;
+}
+
+static uint64_t analyzer_value_number(Analyzer *analyzer, const Value value) {
+  for (size_t i = 0; i < analyzer->values_count; i++) {
+    const Value *known = &analyzer->values[i];
+    if (known->type != INST_EOF && analyzer_value_eq(known, &value))
+      return i;
+  }
+
+  assert(analyzer->values_count < VALUES_CAP && "Value numbers overflow");
+  analyzer->values[analyzer->values_count] = value;
+  return analyzer->values_count++;
+}
+
+// Some value nothing else can be proven equal to
+static uint64_t analyzer_value_unknown(Analyzer *analyzer) {
+  assert(analyzer->values_count < VALUES_CAP && "Value numbers overflow");
+  analyzer->values[analyzer->values_count] = (Value){.type = INST_EOF};
+  return analyzer->values_count++;
+}
+
+static int analyzer_inst_is_binary(const Inst_t type) {
+  switch (type) {
+  case INST_PLUS:
+  case INST_PLUSF:
+  case INST_MINUS:
+  case INST_MULT:
+  case INST_DIV:
+  case INST_EQ:
+  case INST_NE:
+  case INST_GT:
+  case INST_LT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int analyzer_inst_is_commutative(const Inst_t type) {
+  return type == INST_PLUS || type == INST_PLUSF || type == INST_MULT ||
+         type == INST_EQ || type == INST_NE;
+}
+
+#define SLOTS_PUSH(vn_, start_)                                                \
+  do {                                                                         \
+    assert(slots_count < INSTS_CAP && "Symbolic stack overflow");              \
+    slots[slots_count++] = (Value_slot){.vn = vn_, .start = start_};           \
+  } while (0)
+#define SLOTS_POP                                                              \
+  (slots_count                                                                 \
+       ? slots[--slots_count]                                                  \
+       : (Value_slot){.vn = analyzer_value_unknown(analyzer), .start = -1})
+
+static void analyzer_cse_local(Analyzer *analyzer, const Basic_block *block,
+                               Cse_reuse *reuses, size_t *reuses_count) {
+  const Inst *insts = analyzer->ir->insts;
+
+  Value_slot slots[INSTS_CAP];
+  size_t slots_count = 0;
+  int64_t barrier = (int64_t)block->start - 1;
+  uint64_t globals_epoch = 0;
+  uint64_t locals_epoch = 0;
+
+  analyzer->values_count = 0;
+
+  for (size_t pos = block->start; pos < block->start + block->len; pos++) {
+    const Inst *inst = &insts[pos];
+    Value_slot lhs, rhs;
+    Value value = {.type = inst->type};
+
+    switch (inst->type) {
+    case INST_PUSH:
+      value.operand = inst->operand;
+      SLOTS_PUSH(analyzer_value_number(analyzer, value), pos);
+      break;
+
+    case INST_VARL:
+      value.operand = inst->operand;
+      value.epoch = locals_epoch;
+      SLOTS_PUSH(analyzer_value_number(analyzer, value), pos);
+      break;
+
+    case INST_VARG:
+      value.operand = inst->operand;
+      value.epoch = globals_epoch;
+      SLOTS_PUSH(analyzer_value_number(analyzer, value), pos);
+      break;
+
+    case INST_NEG:
+    case INST_SHL:
+    case INST_SHR:
+      lhs = SLOTS_POP;
+      value.operand = inst->operand;
+      value.lhs = lhs.vn;
+      SLOTS_PUSH(analyzer_value_number(analyzer, value), lhs.start);
+      break;
+
+    case INST_DUP:
+    case INST_PICK: {
+      uint64_t depth = inst->type == INST_DUP ? 0 : inst->operand.as_u64;
+      uint64_t vn = depth < slots_count ? slots[slots_count - 1 - depth].vn
+                                        : analyzer_value_unknown(analyzer);
+      SLOTS_PUSH(vn, -1);
+      break;
+    }
+
+    default:
+      if (analyzer_inst_is_binary(inst->type)) {
+        rhs = SLOTS_POP;
+        lhs = SLOTS_POP;
+        if (analyzer_inst_is_commutative(inst->type) && rhs.vn < lhs.vn) {
+          value.lhs = rhs.vn;
+          value.rhs = lhs.vn;
+        } else {
+          value.lhs = lhs.vn;
+          value.rhs = rhs.vn;
+        }
+        SLOTS_PUSH(analyzer_value_number(analyzer, value),
+                   lhs.start == -1 || rhs.start == -1 ? -1 : lhs.start);
+        break;
+      }
+
+      // Anything else splits expressions and may have side effects
+      barrier = pos;
+
+      // Other tasks may store while this one waits
+      if (inst->type == INST_DEFG || inst->type == INST_INCG ||
+          inst->type == INST_YIELD || inst->type == INST_JOIN ||
+          inst->type == INST_SEND || inst->type == INST_RECV)
+        globals_epoch++;
+      if (inst->type == INST_DEFL)
+        locals_epoch++;
+
+      if (inst->type == INST_STR || inst->type == INST_MOV) {
+        // May move fp or sp under our feet
+        slots_count = 0;
+        locals_epoch++;
+      }
+
+      int pops = analyzer_inst_stack_pops(inst->type);
+      int pushes = pops + analyzer_inst_stack_effect(inst->type);
+      for (int i = 0; i < pops; i++)
+        (void)SLOTS_POP;
+      for (int i = 0; i < pushes; i++)
+        SLOTS_PUSH(analyzer_value_unknown(analyzer), -1);
+      continue;
+    }
+
+    Value_slot *top = &slots[slots_count - 1];
+    if (top->start <= barrier)
+      continue;
+
+    // Recomputing a single inst only pays off for a global lookup
+    if ((uint64_t)top->start == pos && inst->type != INST_VARG)
+      continue;
+
+    for (int64_t m = (int64_t)slots_count - 2; m >= 0; m--) {
+      if (slots[m].vn != top->vn)
+        continue;
+
+      // Enclosing expressions replace the reuses nested in them
+      while (*reuses_count &&
+             reuses[*reuses_count - 1].start >= (uint64_t)top->start)
+        (*reuses_count)--;
+
+      reuses[(*reuses_count)++] = (Cse_reuse){
+          .start = top->start,
+          .end = pos,
+          .depth = slots_count - 2 - m,
+      };
+      break;
+    }
+  }
+}
+
+#undef SLOTS_PUSH
+#undef SLOTS_POP
+
+void analyzer_analyze_cse(Analyzer *analyzer) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  Cse_reuse reuses[INSTS_CAP];
+  size_t reuses_count = 0;
+
+  analyzer_basic_blocks_dismember(analyzer);
+  for (size_t i = 0; i < analyzer->blocks_count; i++) {
+    analyzer_cse_local(analyzer, &analyzer->blocks[i], reuses, &reuses_count);
+  }
+
+  if (!reuses_count)
+    return;
+
+  size_t next = 0;
+  for (size_t pos = 0; pos < count; pos++) {
+    analyzer->relocs[pos] = analyzer->rewritten_count;
+
+    if (next < reuses_count && reuses[next].start == pos) {
+      uint64_t depth = reuses[next].depth;
+      analyzer_rewrite_emit(analyzer, depth ? MAKE_PICK(depth) : MAKE_DUP, 0);
+
+      // Nothing jumps into the middle of a block
+      for (; pos < reuses[next].end; pos++) {
+        analyzer->relocs[pos + 1] = analyzer->relocs[pos];
+      }
+      next++;
+      continue;
+    }
+
+    analyzer_rewrite_emit(analyzer, insts[pos], 1);
+  }
+
+  analyzer_rewrite_commit(analyzer);
+}
+
+void analyzer_analyze_dse(Analyzer *analyzer) {
+  analyzer_basic_blocks_dismember(analyzer);
+  analyzer_basic_blocks_dump(analyzer);
+
+  for (size_t i = 0; i < analyzer->blocks_count; i++) {
+    analyzer_dse_local(analyzer, &analyzer->blocks[i]);
+  }
+}
+
+// What the stack holds, as far as a block can tell: a value within
+// [lo, hi], and for handles the least length of the arrays they refer to
+typedef struct {
+  uint8_t known;
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t len;
+} Range;
+
+typedef struct {
+  uint64_t body;
+  uint64_t latch;
+  uint64_t counter;
+  uint64_t lo;
+  uint64_t hi;
+} Counter_range;
+
+#define RANGES_PUSH(range)                                                     \
+  do {                                                                         \
+    assert(ranges_count < INSTS_CAP && "Symbolic stack overflow");             \
+    ranges[ranges_count++] = range;                                            \
+  } while (0)
+#define RANGES_POP (ranges_count ? ranges[--ranges_count] : (Range){0})
+#define RANGES_PEEK(k)                                                         \
+  ((k) < ranges_count ? ranges[ranges_count - 1 - (k)] : (Range){0})
+
+// Least length of the arrays each global is bound to: only globals every
+// `defg` of which is `push n; anew; defg` qualify
+static void analyzer_array_lens_compute(Analyzer *analyzer, Hash_Table *lens) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+
+  for (size_t pos = 0; pos < count; pos++) {
+    if (insts[pos].type != INST_DEFG && insts[pos].type != INST_INCG)
+      continue;
+
+    uint64_t len = 0;
+    if (insts[pos].type == INST_DEFG && pos >= 2 &&
+        insts[pos - 1].type == INST_ANEW && insts[pos - 2].type == INST_PUSH)
+      len = insts[pos - 2].operand.as_u64;
+
+    Word *prev = hash_table_get(lens, insts[pos].operand.as_sv);
+    if (prev != NULL && prev->as_u64 < len)
+      len = prev->as_u64;
+
+    hash_table_insert(lens, insts[pos].operand.as_sv, (Word){.as_u64 = len});
+  }
+}
+
+// Counters of forloops with constant bounds, as compiler_stmt_for_counted
+// and unrolling emit them. Inside the body only the forloop itself writes
+// the counter; inner loops keep theirs in deeper slots.
+static size_t analyzer_counter_ranges_find(Analyzer *analyzer,
+                                           Counter_range *counters) {
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  size_t counters_count = 0;
+
+  for (size_t latch = 0; latch < count && counters_count < LOOPS_CAP;
+       latch++) {
+    uint64_t body = insts[latch].operand.as_u64;
+    if (insts[latch].type != INST_FORLOOP || body < 7 || body > latch)
+      continue;
+
+    // push start; push limit; push step; varl c; varl c+1; lt; jmpnt
+    const Inst *head = &insts[body - 7];
+    uint64_t counter = head[3].operand.as_u64;
+    if (head[0].type != INST_PUSH || head[1].type != INST_PUSH ||
+        head[2].type != INST_PUSH || head[3].type != INST_VARL ||
+        head[4].type != INST_VARL || head[4].operand.as_u64 != counter + 1 ||
+        head[5].type != INST_LT || head[6].type != INST_JMPNT)
+      continue;
+
+    uint64_t start = head[0].operand.as_u64;
+    uint64_t limit = head[1].operand.as_u64;
+    uint64_t step = head[2].operand.as_u64;
+    if (step == 0 || start >= limit)
+      continue;
+
+    int entered = 0;
+    for (size_t i = 0; i < analyzer->fns_count; i++) {
+      uint64_t label_pos = analyzer->fns[i].label_pos;
+      entered |= label_pos > body - 7 && label_pos <= latch;
+    }
+
+    for (size_t pos = 0; pos < count; pos++) {
+      entered |= (pos < body - 7 || pos > latch) &&
+                 analyzer_inst_is_addr(insts, count, pos) &&
+                 insts[pos].operand.as_u64 > body - 7 &&
+                 insts[pos].operand.as_u64 <= latch;
+    }
+
+    if (entered)
+      continue;
+
+    counters[counters_count++] = (Counter_range){
+        .body = body,
+        .latch = latch,
+        .counter = counter,
+        .lo = start,
+        .hi = start + (limit - start - 1) / step * step,
+    };
+  }
+
+  return counters_count;
+}
+
+static Range analyzer_range_varl(const Counter_range *counters,
+                                 const size_t counters_count,
+                                 const uint64_t pos, const uint64_t local) {
+  for (size_t i = 0; i < counters_count; i++) {
+    const Counter_range *counter = &counters[i];
+
+    if (counter->counter == local && pos >= counter->body &&
+        pos < counter->latch)
+      return (Range){.known = 1, .lo = counter->lo, .hi = counter->hi};
+  }
+
+  return (Range){0};
+}
+
+static Range analyzer_range_binary(const Inst_t type, const Range lhs,
+                                   const Range rhs) {
+  if (!lhs.known || !rhs.known)
+    return (Range){0};
+
+  if (type == INST_PLUS && lhs.hi <= UINT64_MAX - rhs.hi)
+    return (Range){.known = 1, .lo = lhs.lo + rhs.lo, .hi = lhs.hi + rhs.hi};
+
+  if (type == INST_MULT && (rhs.hi == 0 || lhs.hi <= UINT64_MAX / rhs.hi))
+    return (Range){.known = 1, .lo = lhs.lo * rhs.lo, .hi = lhs.hi * rhs.hi};
+
+  return (Range){0};
+}
+
+// Whether the checks of the inst at pos hold whenever it runs. Depths are
+// a lower bound on what the frame holds; pushes are bounded by the stack's
+// guard page.
+static int analyzer_inst_is_safe(Analyzer *analyzer, const uint64_t pos,
+                                 const Range *ranges,
+                                 const size_t ranges_count) {
+  const Inst *inst = &analyzer->ir->insts[pos];
+  int64_t depth = analyzer->depths[pos];
+  uint64_t count = analyzer->ir->insts_count;
+
+  if (depth == -1)
+    return 0;
+
+  switch (inst->type) {
+  case INST_PUSH:
+    return 1;
+  case INST_DUP:
+    return depth >= 1;
+  case INST_PICK:
+  case INST_VARL:
+    return inst->operand.as_u64 < (uint64_t)depth;
+
+  case INST_POP:
+  case INST_NEG:
+  case INST_SHL:
+  case INST_SHR:
+    return depth >= 1;
+  case INST_PLUS:
+  case INST_PLUSF:
+  case INST_MINUS:
+  case INST_MULT:
+  case INST_DIV:
+  case INST_EQ:
+  case INST_NE:
+  case INST_GT:
+  case INST_LT:
+    return depth >= 2;
+
+  case INST_JMPA:
+    return inst->operand.as_u64 < count;
+  case INST_JMPT:
+  case INST_JMPNT:
+    return depth >= 1 && inst->operand.as_u64 < count;
+  case INST_FORLOOP:
+    return depth >= 3 && inst->operand.as_u64 < count;
+
+  case INST_ALOAD:
+  case INST_ASTORE: {
+    // handle, index on top for aload, then the value for astore
+    uint64_t k = inst->type == INST_ASTORE;
+    Range handle = RANGES_PEEK(k + 1);
+    Range index = RANGES_PEEK(k);
+
+    return depth >= (int64_t)k + 2 && handle.len && index.known &&
+           index.hi < handle.len;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+void analyzer_analyze_ranges(Analyzer *analyzer) {
+  if (!analyzer_depths_compute(analyzer))
+    return;
+
+  const Inst *insts = analyzer->ir->insts;
+  uint64_t count = analyzer->ir->insts_count;
+  uint8_t safe[INSTS_CAP] = {0};
+  Counter_range counters[LOOPS_CAP];
+  Hash_Table lens = hash_table_new();
+  Range ranges[INSTS_CAP];
+
+  analyzer_array_lens_compute(analyzer, &lens);
+  size_t counters_count = analyzer_counter_ranges_find(analyzer, counters);
+
+  analyzer_basic_blocks_dismember(analyzer);
+
+  for (size_t i = 0; i < analyzer->blocks_count; i++) {
+    const Basic_block *block = &analyzer->blocks[i];
+    size_t ranges_count = 0;
+
+    for (size_t pos = block->start; pos < block->start + block->len; pos++) {
+      const Inst *inst = &insts[pos];
+      Range lhs, rhs, range = {0};
+
+      safe[pos] = analyzer_inst_is_safe(analyzer, pos, ranges, ranges_count);
+
+      switch (inst->type) {
+      case INST_PUSH:
+        range = (Range){
+            .known = 1,
+            .lo = inst->operand.as_u64,
+            .hi = inst->operand.as_u64,
+        };
+        break;
+
+      case INST_VARL:
+        range = analyzer_range_varl(counters, counters_count, pos,
+                                    inst->operand.as_u64);
+        break;
+
+      case INST_VARG: {
+        Word *len = hash_table_get(&lens, inst->operand.as_sv);
+        range.len = len != NULL ? len->as_u64 : 0;
+        break;
+      }
+
+      case INST_DUP:
+      case INST_PICK:
+        range = RANGES_PEEK(inst->type == INST_DUP ? 0 : inst->operand.as_u64);
+        break;
+
+      case INST_PLUS:
+      case INST_MULT:
+        rhs = RANGES_POP;
+        lhs = RANGES_POP;
+        range = analyzer_range_binary(inst->type, lhs, rhs);
+        break;
+
+      default: {
+        int pops = analyzer_inst_stack_pops(inst->type);
+        int pushes = pops + analyzer_inst_stack_effect(inst->type);
+        for (int k = 0; k < pops; k++)
+          (void)RANGES_POP;
+        for (int k = 0; k < pushes; k++)
+          RANGES_PUSH((Range){0});
+        continue;
+      }
+      }
+
+      RANGES_PUSH(range);
+    }
+  }
+
+  // Last, as no pass knows the unchecked twins
+  for (size_t pos = 0; pos < count; pos++) {
+    if (safe[pos])
+      analyzer->ir->insts[pos].type = INST_UNCHECKED(insts[pos].type);
+  }
+
+  hash_table_destruct(&lens);
+}
+
+#undef RANGES_PUSH
+#undef RANGES_POP
+#undef RANGES_PEEK
+
 #undef NEXT_INST
 #undef CUR_INST
 #undef PREV_INST
@@ -1,8 +1,24 @@
 #ifndef ANALYZER_H
 #define ANALYZER_H
 
+#include "compiler.h"
 #include "vm.h"
 
+// Max callee body length (in insts) considered for inlining
+#ifndef ANALYZER_INLINE_THRESHOLD
+#define ANALYZER_INLINE_THRESHOLD 16
+#endif
+
+// Body copies per iteration of an unrolled counted loop
+#ifndef ANALYZER_UNROLL_FACTOR
+#define ANALYZER_UNROLL_FACTOR 4
+#endif
+
+// Max insts unrolling a single loop may add
+#ifndef ANALYZER_UNROLL_BUDGET
+#define ANALYZER_UNROLL_BUDGET 96
+#endif
+
 typedef struct {
   uint16_t block_no;
 
@@ -10,14 +26,59 @@ typedef struct {
   uint8_t start;
 } Basic_block;
 
+// A value number's defining inst and operand numbers; epochs tell loads
+// of the same variable apart across stores
+#define VALUES_CAP (INSTS_CAP * 3)
+
 typedef struct {
-  const Inst *ir;
+  Inst_t type;
+  Word operand;
+  uint64_t lhs;
+  uint64_t rhs;
+  uint64_t epoch;
+} Value;
+
+typedef struct {
+  Ir *ir;
+
+  Fn *fns;
+  uint8_t fns_count;
+
+  // Stack depth relative to fp before each inst, -1 if unreachable
+  int64_t depths[INSTS_CAP];
 
   Basic_block blocks[INSTS_CAP];
   uint64_t blocks_count;
+
+  // The ir being rebuilt by a pass that changes code size, and where
+  // every old inst landed in it
+  Inst rewritten[INSTS_CAP];
+  uint8_t rewritten_pending[INSTS_CAP];
+  uint64_t rewritten_count;
+  uint64_t relocs[INSTS_CAP + 1];
+
+  // Value numbers of the block under CSE
+  Value values[VALUES_CAP];
+  uint64_t values_count;
+
+  // Where the block and DSE dumps write
+  FILE *out;
 } Analyzer;
 
-void analyzer_ir_load(const Inst *insts);
-void analyzer_analyze_dse(void);
+// Whether the operand of insts[pos] is an address in the ir: a jump or
+// call target, or a return address being pushed
+int analyzer_inst_is_addr(const Inst *insts, size_t count, size_t pos);
+
+void analyzer_ir_load(Analyzer *analyzer, Ir *ir);
+void analyzer_fns_load(Analyzer *analyzer, Fn *fns, uint8_t fns_count);
+void analyzer_analyze_inline(Analyzer *analyzer);
+void analyzer_analyze_purity(Analyzer *analyzer);
+void analyzer_analyze_memo(Analyzer *analyzer);
+void analyzer_analyze_vectorize(Analyzer *analyzer);
+void analyzer_analyze_unroll(Analyzer *analyzer);
+void analyzer_analyze_loops(Analyzer *analyzer);
+void analyzer_analyze_cse(Analyzer *analyzer);
+void analyzer_analyze_dse(Analyzer *analyzer);
+void analyzer_analyze_ranges(Analyzer *analyzer);
 
 #endif
@@ -5,22 +5,35 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "analyzer.h"
 #include "compiler.h"
 #include "lexer.h"
 #include "table.h"
 #include "vm.h"
 
-static uint64_t tokens_pos = 0;
-static Ir ir = {0};
-
 void compiler_init(Compiler *compiler) {
-  compiler->ir = &ir;
+  compiler->ir = (Ir *)calloc(1, sizeof(Ir));
+  compiler->tokens_pos = 0;
+  compiler->returned = 0;
+  compiler->fn_enclosing = NULL;
   compiler->name = (Sv){
       .len = 4,
       .str = "main",
   };
   compiler->depth = 0;
   compiler->enclosing = NULL;
+  compiler->locals_count = 0;
+  compiler->fn_count = 0;
+  compiler->imports_count = 0;
+  compiler->import = NULL;
+  compiler->import_ctx = NULL;
+  compiler->error = NULL;
+  compiler->passes = COMPILER_PASSES;
+}
+
+void compiler_destruct(Compiler *compiler) {
+  free(compiler->ir);
+  compiler->ir = NULL;
 }
 
 __attribute__((unused)) static void compiler_locals_dump(Compiler *compiler) {
@@ -81,7 +94,8 @@ inline static int compiler_token_is_pre_op(const Token_t type) {
   return 0;
 }
 
-static Inst compiler_translate_op(const Token_t lhs_type, const Token_t type) {
+static Inst compiler_translate_op(Compiler *compiler, const Token_t lhs_type,
+                                  const Token_t type) {
   int as_f = lhs_type == Token_Float ? 1 : 0;
 
   switch (type) {
@@ -102,8 +116,7 @@ static Inst compiler_translate_op(const Token_t lhs_type, const Token_t type) {
   case Token_Div:
     return MAKE_DIV;
   default:
-    fprintf(stderr, "Expected op");
-    exit(5);
+    compile_error_raise(compiler->error, 5, "Expected op");
   };
 }
 
@@ -113,19 +126,23 @@ inline static uint64_t compiler_sv_to_u64(const char *str, const int len) {
   return strtol(buf, NULL, 10);
 }
 
-inline static uint64_t compiler_sv_to_f64(const char *str, const int len) {
+inline static double compiler_sv_to_f64(const char *str, const int len) {
   char buf[len + 1];
   snprintf(buf, len + 1, "%.*s", len, str);
-  return strtof(buf, NULL);
+  return strtod(buf, NULL);
 }
 
-#define NEXT_TOKEN &tokens[tokens_pos++]
-#define PEEK_TOKEN &tokens[tokens_pos]
-#define PEEK_TOKEN_TYPE tokens[tokens_pos].type
-#define PEEK_PEEK_TOKEN &tokens[tokens_pos + 1]
+#define NEXT_TOKEN &tokens[compiler->tokens_pos++]
+#define PEEK_TOKEN &tokens[compiler->tokens_pos]
+#define PEEK_TOKEN_TYPE tokens[compiler->tokens_pos].type
+#define PEEK_PEEK_TOKEN &tokens[compiler->tokens_pos + 1]
 #define LOC_INST compiler->ir->insts_count
 #define PUSH_INST(inst)                                                        \
   do {                                                                         \
+    if (LOC_INST >= INSTS_CAP - 1) {                                           \
+      compile_error_raise(compiler->error, 10, "Program is over %d insts",     \
+                          INSTS_CAP - 1);                                      \
+    }                                                                          \
     compiler->ir->insts[LOC_INST++] = inst;                                    \
   } while (0)
 #define ALTER_INST(offset, inst)                                               \
@@ -135,11 +152,10 @@ inline static uint64_t compiler_sv_to_f64(const char *str, const int len) {
 #define MUNCH_TOKEN(token_type)                                                \
   do {                                                                         \
     if (PEEK_TOKEN_TYPE == token_type) {                                       \
-      tokens_pos++;                                                            \
+      compiler->tokens_pos++;                                                  \
     } else {                                                                   \
-      fprintf(stderr, "Expected token type %s",                                \
-              lexer_token_t_to_str(token_type));                               \
-      exit(6);                                                                 \
+      compile_error_raise(compiler->error, 6, "Expected token type %s",        \
+                          lexer_token_t_to_str(token_type));                   \
     }                                                                          \
   } while (0)
 
@@ -188,6 +204,9 @@ static void compiler_emit_ir(Compiler *compiler, const Token *lhs) {
 
 static void compiler_expr_call(Compiler *compiler, Token *tokens,
                                const Sv label);
+static int compiler_expr_builtin(Compiler *compiler, Token *tokens,
+                                 const Sv label);
+static void compiler_expr_spawn(Compiler *compiler, Token *tokens);
 static void compiler_expr_bp(Compiler *compiler, Token *tokens,
                              const uint8_t min_bp) {
   Token *lhs = NEXT_TOKEN;
@@ -196,16 +215,28 @@ static void compiler_expr_bp(Compiler *compiler, Token *tokens,
     MUNCH_TOKEN(Token_Quote);
   }
 
-  if (PEEK_TOKEN_TYPE == Token_LParen) {
+  int lhs_is_pre_op = compiler_token_is_pre_op(lhs->type);
+  if (lhs->type == Token_Identifier && PEEK_TOKEN_TYPE == Token_LParen) {
     Sv label = {.len = lhs->len, .str = lhs->start};
 
-    compiler_expr_call(compiler, tokens, label);
+    if (!compiler_expr_builtin(compiler, tokens, label))
+      compiler_expr_call(compiler, tokens, label);
 
-    lhs = PEEK_TOKEN;
-  }
+  } else if (lhs->type == Token_Identifier &&
+             PEEK_TOKEN_TYPE == Token_LBracket) {
+    // varx #array, index, aload
+    compiler_emit_ir(compiler, lhs);
 
-  int lhs_is_pre_op = compiler_token_is_pre_op(lhs->type);
-  if (lhs_is_pre_op) {
+    MUNCH_TOKEN(Token_LBracket);
+    compiler_expr_bp(compiler, tokens, 0);
+    MUNCH_TOKEN(Token_RBracket);
+
+    PUSH_INST(MAKE_ALOAD);
+
+  } else if (lhs->type == Token_Spawn) {
+    compiler_expr_spawn(compiler, tokens);
+
+  } else if (lhs_is_pre_op) {
     uint8_t pre_bp = PRED_TABLE[lhs->type].pre_power;
     compiler_expr_bp(compiler, tokens, pre_bp);
 
@@ -214,10 +245,10 @@ static void compiler_expr_bp(Compiler *compiler, Token *tokens,
     compiler_expr_bp(compiler, tokens, 0);
 
     MUNCH_TOKEN(Token_RParen);
+  } else {
+    compiler_emit_ir(compiler, lhs);
   }
 
-  compiler_emit_ir(compiler, lhs);
-
   while (1) {
     Token *op = PEEK_TOKEN;
     if (op->type == Token_EOF)
@@ -229,10 +260,10 @@ static void compiler_expr_bp(Compiler *compiler, Token *tokens,
       break;
     }
 
-    tokens_pos++;
+    compiler->tokens_pos++;
     compiler_expr_bp(compiler, tokens, in_bp);
 
-    PUSH_INST(compiler_translate_op(lhs->type, op->type));
+    PUSH_INST(compiler_translate_op(compiler, lhs->type, op->type));
   }
 }
 
@@ -265,13 +296,12 @@ static void compiler_expr_stmt(Compiler *compiler, Token *tokens) {
 #define EXPECT_TOKEN(expected_type)                                            \
   do {                                                                         \
     if (PEEK_TOKEN_TYPE != expected_type) {                                    \
-      fprintf(stderr, "Expected type %s",                                      \
-              lexer_token_t_to_str(expected_type));                            \
-      exit(7);                                                                 \
+      compile_error_raise(compiler->error, 7, "Expected type %s",              \
+                          lexer_token_t_to_str(expected_type));                \
     }                                                                          \
   } while (0)
 
-static void compiler_stmt_assign(Compiler *compiler, Token *tokens) {
+static void compiler_assign(Compiler *compiler, Token *tokens) {
   EXPECT_TOKEN(Token_Identifier);
   Token *identifier = NEXT_TOKEN;
   Sv name = (Sv){
@@ -294,13 +324,91 @@ static void compiler_stmt_assign(Compiler *compiler, Token *tokens) {
   }
 
   PUSH_INST(MAKE_POP);
+}
+
+static void compiler_stmt_assign(Compiler *compiler, Token *tokens) {
+  compiler_assign(compiler, tokens);
+
+  MUNCH_TOKEN(Token_Semicolon);
+}
+
+// `int a[n];` allocates n zeroed elements and binds a to the handle
+static void compiler_stmt_array(Compiler *compiler, Token *tokens,
+                                const Token *type) {
+  Token *identifier = NEXT_TOKEN;
+  Sv name = (Sv){
+      .str = identifier->start,
+      .len = identifier->len,
+  };
+
+  MUNCH_TOKEN(Token_LBracket);
+  compiler_expr(compiler, tokens);
+  MUNCH_TOKEN(Token_RBracket);
+
+  // anew #type
+  Word_t elem_type = type->type == Token_FloatType ? WORD_F64 : WORD_I64;
+  PUSH_INST(MAKE_ANEW(elem_type));
+
+  int offset = compiler_var_resolve(compiler, &name);
+  if (offset == -1) {
+    PUSH_INST(MAKE_DEFG(name));
+  } else {
+    PUSH_INST(MAKE_DEFL(compiler->locals_count - 1));
+    LOCAL_ADD(name, compiler->depth);
+  }
+
+  PUSH_INST(MAKE_POP);
+  MUNCH_TOKEN(Token_Semicolon);
+}
+
+// `a[i] = v;`, told apart from an index expr by the `=` after the `]`
+static int compiler_stmt_is_store(Compiler *compiler, Token *tokens) {
+  if (PEEK_TOKEN_TYPE != Token_Identifier ||
+      tokens[compiler->tokens_pos + 1].type != Token_LBracket)
+    return 0;
+
+  uint64_t pos = compiler->tokens_pos + 2;
+  int depth = 1;
+
+  while (depth) {
+    Token_t type = tokens[pos++].type;
+
+    if (type == Token_EOF)
+      return 0;
+
+    if (type == Token_LBracket)
+      depth++;
+    else if (type == Token_RBracket)
+      depth--;
+  }
+
+  return tokens[pos].type == Token_Equal;
+}
+
+static void compiler_stmt_store(Compiler *compiler, Token *tokens) {
+  // varx #array, index, value, astore
+  compiler_emit_ir(compiler, NEXT_TOKEN);
+
+  MUNCH_TOKEN(Token_LBracket);
+  compiler_expr(compiler, tokens);
+  MUNCH_TOKEN(Token_RBracket);
+
+  MUNCH_TOKEN(Token_Equal);
+  compiler_expr(compiler, tokens);
+
+  PUSH_INST(MAKE_ASTORE);
   MUNCH_TOKEN(Token_Semicolon);
 }
 
 static void compiler_stmt_define(Compiler *compiler, Token *tokens) {
   // TODO: Type checking
   Token *type = NEXT_TOKEN;
-  (void)type;
+
+  if (PEEK_TOKEN_TYPE == Token_Identifier &&
+      tokens[compiler->tokens_pos + 1].type == Token_LBracket) {
+    compiler_stmt_array(compiler, tokens, type);
+    return;
+  }
 
   compiler_stmt_assign(compiler, tokens);
 }
@@ -373,9 +481,6 @@ static void compiler_stmt_while(Compiler *compiler, Token *tokens) {
   MUNCH_TOKEN(Token_LParen);
   uint64_t while_pred_start_pos = LOC_INST;
   compiler_expr(compiler, tokens);
-
-  printf("Then what is it? %.*s\n", *PEEK_TOKEN.len, *PEEK_TOKEN.start);
-
   MUNCH_TOKEN(Token_RParen);
 
   // jmpnt #offset
@@ -391,24 +496,222 @@ static void compiler_stmt_while(Compiler *compiler, Token *tokens) {
   ALTER_INST(while_start_pos - 1, MAKE_JMPNT(while_end_pos));
 }
 
-static Compiler *compiler_call_new(Compiler *compiler, Sv name) {
-  Compiler *new_fn = (Compiler *)malloc(sizeof(Compiler));
-  new_fn->depth = compiler->depth + 1;
-  new_fn->name = name;
-  new_fn->locals_count = 0;
-  new_fn->enclosing = compiler;
-  new_fn->ir = compiler->ir;
+static int compiler_token_is_name(const Token *token, const Token *name) {
+  return token->type == Token_Identifier && token->len == name->len &&
+         memcmp(token->start, name->start, name->len) == 0;
+}
+
+// Position past the block opening at `pos`
+static uint64_t compiler_block_skip(Token *tokens, uint64_t pos) {
+  int depth = 0;
+
+  do {
+    Token_t type = tokens[pos++].type;
+
+    if (type == Token_EOF)
+      return pos - 1;
 
-  return new_fn;
+    if (type == Token_LBrace)
+      depth++;
+    else if (type == Token_RBrace)
+      depth--;
+  } while (depth);
+
+  return pos;
 }
 
-static void compiler_call_destruct(Compiler *compiler) {
-  if (compiler->enclosing == NULL) {
-    fprintf(stderr, "Enclosing compiler null");
-    exit(8);
+// Does `[start, end)` assign `name`, or call anything when `name` is NULL
+static int compiler_tokens_write(Token *tokens, uint64_t start, uint64_t end,
+                                 const Token *name) {
+  for (uint64_t pos = start; pos + 1 < end; pos++) {
+    if (tokens[pos].type != Token_Identifier)
+      continue;
+
+    if (name == NULL && tokens[pos + 1].type == Token_LParen)
+      return 1;
+
+    if (name != NULL && compiler_token_is_name(&tokens[pos], name) &&
+        tokens[pos + 1].type == Token_Equal)
+      return 1;
   }
 
-  free(compiler);
+  return 0;
+}
+
+// Matches `(int i = init; i < limit; i = i + step) { body }` where the
+// body never writes i or the limit, so both can live on the stack
+static int compiler_for_is_counted(Compiler *compiler, Token *tokens) {
+  uint64_t pos = compiler->tokens_pos + 1;
+  const Token *counter = &tokens[pos + 1];
+
+  if (tokens[pos].type != Token_Int || counter->type != Token_Identifier ||
+      tokens[pos + 2].type != Token_Equal)
+    return 0;
+
+  for (pos += 3; tokens[pos].type != Token_Semicolon; pos++) {
+    if (tokens[pos].type == Token_EOF)
+      return 0;
+  }
+
+  if (!compiler_token_is_name(&tokens[pos + 1], counter) ||
+      tokens[pos + 2].type != Token_LT)
+    return 0;
+
+  uint64_t limit_start = pos + 3;
+  for (pos = limit_start; tokens[pos].type != Token_Semicolon; pos++) {
+    Token_t type = tokens[pos].type;
+
+    if (type != Token_Identifier && type != Token_Number &&
+        type != Token_Plus && type != Token_Minus && type != Token_Mult &&
+        type != Token_Div)
+      return 0;
+
+    if (compiler_token_is_name(&tokens[pos], counter))
+      return 0;
+  }
+  uint64_t limit_end = pos;
+
+  if (limit_start == limit_end ||
+      !compiler_token_is_name(&tokens[pos + 1], counter) ||
+      tokens[pos + 2].type != Token_Equal ||
+      !compiler_token_is_name(&tokens[pos + 3], counter) ||
+      tokens[pos + 4].type != Token_Plus ||
+      tokens[pos + 5].type != Token_Number ||
+      tokens[pos + 6].type != Token_RParen ||
+      tokens[pos + 7].type != Token_LBrace)
+    return 0;
+
+  uint64_t body_start = pos + 7;
+  uint64_t body_end = compiler_block_skip(tokens, body_start);
+
+  if (compiler_tokens_write(tokens, body_start, body_end, counter))
+    return 0;
+
+  for (pos = body_start; pos < body_end; pos++) {
+    if (tokens[pos].type == Token_Fn || tokens[pos].type == Token_Noinline)
+      return 0;
+  }
+
+  for (pos = limit_start; pos < limit_end; pos++) {
+    if (tokens[pos].type != Token_Identifier)
+      continue;
+
+    Sv name = {.len = tokens[pos].len, .str = tokens[pos].start};
+    if (compiler_tokens_write(tokens, body_start, body_end, &tokens[pos]))
+      return 0;
+
+    // Calls may write any global
+    if (compiler_var_resolve(compiler, &name) == -1 &&
+        compiler_tokens_write(tokens, body_start, body_end, NULL))
+      return 0;
+  }
+
+  return 1;
+}
+
+// Counter, limit and step sit on the stack as hidden locals and forloop
+// steps, compares and branches in one dispatch
+static void compiler_stmt_for_counted(Compiler *compiler, Token *tokens) {
+  MUNCH_TOKEN(Token_LParen);
+  MUNCH_TOKEN(Token_Int);
+  Token *counter = NEXT_TOKEN;
+  Sv name = {.len = counter->len, .str = counter->start};
+  MUNCH_TOKEN(Token_Equal);
+
+  compiler_expr(compiler, tokens);
+  MUNCH_TOKEN(Token_Semicolon);
+
+  // i <
+  compiler->tokens_pos += 2;
+  compiler_expr(compiler, tokens);
+  MUNCH_TOKEN(Token_Semicolon);
+
+  // i = i +
+  compiler->tokens_pos += 4;
+  Token *step = NEXT_TOKEN;
+  Word operand = (Word){.as_u64 = compiler_sv_to_u64(step->start, step->len)};
+  PUSH_INST(MAKE_PUSH(operand));
+  MUNCH_TOKEN(Token_RParen);
+
+  uint8_t locals_count_prev = compiler->locals_count;
+  uint64_t counter_slot = compiler->locals_count;
+  LOCAL_ADD(name, compiler->depth + 1);
+  LOCAL_ADD(((Sv){0}), compiler->depth + 1);
+  LOCAL_ADD(((Sv){0}), compiler->depth + 1);
+
+  // varl i; varl limit; lt; jmpnt #offset
+  PUSH_INST(MAKE_VARL(counter_slot));
+  PUSH_INST(MAKE_VARL(counter_slot + 1));
+  PUSH_INST(MAKE_LT);
+  PUSH_INST(MAKE_JMPNT(-1));
+  uint64_t for_body_pos = LOC_INST;
+
+  compiler_stmt_block(compiler, tokens);
+
+  // forloop #offset
+  PUSH_INST(MAKE_FORLOOP(for_body_pos));
+
+  uint64_t for_end_pos = LOC_INST;
+  ALTER_INST(for_body_pos - 1, MAKE_JMPNT(for_end_pos));
+
+  for (size_t i = 0; i < 3; i++) {
+    PUSH_INST(MAKE_POP);
+  }
+  compiler->locals_count = locals_count_prev;
+}
+
+static void compiler_stmt_for(Compiler *compiler, Token *tokens) {
+  MUNCH_TOKEN(Token_For);
+
+  if (compiler_for_is_counted(compiler, tokens)) {
+    compiler_stmt_for_counted(compiler, tokens);
+    return;
+  }
+
+  // Anything else runs as a while loop with the step after the body
+  MUNCH_TOKEN(Token_LParen);
+  if (PEEK_TOKEN_TYPE == Token_Semicolon) {
+    MUNCH_TOKEN(Token_Semicolon);
+  } else {
+    compiler_stmt(compiler, tokens);
+  }
+
+  uint64_t for_pred_start_pos = LOC_INST;
+  compiler_expr(compiler, tokens);
+  MUNCH_TOKEN(Token_Semicolon);
+
+  // jmpnt #offset
+  PUSH_INST(MAKE_JMPNT(-1));
+  uint64_t for_start_pos = LOC_INST;
+
+  uint64_t step_tokens_pos = compiler->tokens_pos;
+  for (int depth = 1; depth; compiler->tokens_pos++) {
+    Token_t type = PEEK_TOKEN_TYPE;
+
+    if (type == Token_EOF) {
+      compile_error_raise(compiler->error, 6, "Expected token type %s",
+                          lexer_token_t_to_str(Token_RParen));
+    }
+
+    if (type == Token_LParen)
+      depth++;
+    else if (type == Token_RParen)
+      depth--;
+  }
+
+  compiler_stmt_block(compiler, tokens);
+  uint64_t for_body_end_tokens_pos = compiler->tokens_pos;
+
+  compiler->tokens_pos = step_tokens_pos;
+  if (PEEK_TOKEN_TYPE != Token_RParen)
+    compiler_assign(compiler, tokens);
+  compiler->tokens_pos = for_body_end_tokens_pos;
+
+  // jmpa #offset
+  PUSH_INST(MAKE_JMPA(for_pred_start_pos));
+
+  uint64_t for_end_pos = LOC_INST;
+  ALTER_INST(for_start_pos - 1, MAKE_JMPNT(for_end_pos));
 }
 
 #define FN_DECLARE(_label, _label_pos, _arity)                                 \
@@ -421,8 +724,13 @@ static void compiler_call_destruct(Compiler *compiler) {
   } while (0);
 #define FN_CURR &compiler->fn[compiler->fn_count - 1]
 
-static int RETURNED = 0;
 static void compiler_stmt_fn(Compiler *compiler, Token *tokens) {
+  uint8_t noinline = 0;
+  if (PEEK_TOKEN_TYPE == Token_Noinline) {
+    MUNCH_TOKEN(Token_Noinline);
+    noinline = 1;
+  }
+
   MUNCH_TOKEN(Token_Fn);
 
   EXPECT_TOKEN(Token_Identifier);
@@ -465,18 +773,25 @@ static void compiler_stmt_fn(Compiler *compiler, Token *tokens) {
   MUNCH_TOKEN(Token_RParen);
 
   FN_DECLARE(label, label_start_pos, arity);
+  Fn *fn = FN_CURR;
+  fn->noinline = noinline;
+
+  Fn *fn_enclosing_prev = compiler->fn_enclosing;
+  compiler->fn_enclosing = fn;
 
   // Mid
   compiler_stmt_block(compiler, tokens);
 
+  compiler->fn_enclosing = fn_enclosing_prev;
+
   // Post call
-  if (!RETURNED) {
+  if (!compiler->returned) {
     Word null = {.as_u64 = 0};
     PUSH_INST(MAKE_PUSH(null));
     PUSH_INST(MAKE_STR(REG_RAX));
     PUSH_INST(MAKE_RET);
   } else {
-    RETURNED = 0;
+    compiler->returned = 0;
   }
 
   compiler->locals_count -= arity;
@@ -485,7 +800,7 @@ static void compiler_stmt_fn(Compiler *compiler, Token *tokens) {
   ALTER_INST(label_start_pos - 1, MAKE_JMPA(label_end_pos));
 }
 
-static Fn *compiler_fn_resolve(Compiler *compiler, Sv *label) {
+static Fn *compiler_fn_find(Compiler *compiler, const Sv *label) {
   for (size_t i = 0; i < compiler->fn_count; i++) {
     Fn *fn = &compiler->fn[i];
 
@@ -496,27 +811,52 @@ static Fn *compiler_fn_resolve(Compiler *compiler, Sv *label) {
     }
   }
 
-  fprintf(stderr, "Unknown Fn %.*s", label->len, label->str);
-  exit(9);
+  for (size_t i = 0; i < compiler->imports_count; i++) {
+    Fn *fn = &compiler->imports[i];
+
+    if (fn->label.len == label->len &&
+        memcmp(fn->label.str, label->str, label->len) == 0)
+      return fn;
+  }
+
+  return NULL;
 }
 
-static void compiler_expr_call(Compiler *compiler, Token *tokens, Sv label) {
-  Compiler *new_compiler = compiler_call_new(compiler, label);
+// `import "path";` makes the Fns of the file at path, relative to the
+// working directory, callable from here on
+static void compiler_stmt_import(Compiler *compiler, Token *tokens) {
+  MUNCH_TOKEN(Token_Import);
+  MUNCH_TOKEN(Token_Quote);
+  EXPECT_TOKEN(Token_Literal);
+  Token *literal = NEXT_TOKEN;
+  Sv path = (Sv){
+      .str = literal->start,
+      .len = literal->len,
+  };
+  MUNCH_TOKEN(Token_Quote);
+  MUNCH_TOKEN(Token_Semicolon);
 
-  Fn *fn = compiler_fn_resolve(compiler, &label);
-  uint8_t arity = fn->arity;
+  if (compiler->import == NULL || compiler->fn_enclosing != NULL) {
+    compile_error_raise(compiler->error, 14, "Cannot import %.*s here",
+                        path.len, path.str);
+  }
 
-  // ldr fp
-  PUSH_INST(MAKE_LDR(REG_FP));
+  compiler->import(compiler->import_ctx, compiler, path);
+}
 
-  // ldr ra
-  PUSH_INST(MAKE_LDR(REG_RA));
+static Fn *compiler_fn_resolve(Compiler *compiler, Sv *label) {
+  Fn *fn = compiler_fn_find(compiler, label);
+  if (fn != NULL)
+    return fn;
 
-  // mov cpsr, sp
-  PUSH_INST(MAKE_PUSH((Word){.as_u64 = REG_SP}));
-  PUSH_INST(MAKE_MOV(REG_CPSR));
+  compile_error_raise(compiler->error, 9, "Unknown Fn %.*s", label->len,
+                      label->str);
+}
 
-  MUNCH_TOKEN(Token_LParen);
+// The args of a call to fn, without the parens around them
+static void compiler_expr_args(Compiler *compiler, Token *tokens,
+                               const Fn *fn) {
+  uint8_t arity = fn->arity;
 
   while (1) {
     if (arity == 0) {
@@ -530,12 +870,94 @@ static void compiler_expr_call(Compiler *compiler, Token *tokens, Sv label) {
     }
 
     if (PEEK_TOKEN_TYPE != Token_Comma) {
-      fprintf(stderr, "Expected %d arguments for Fn %.*s\n", fn->arity,
-              label.len, label.str);
-      exit(11);
+      compile_error_raise(compiler->error, 11,
+                          "Expected %d arguments for Fn %.*s", fn->arity,
+                          fn->label.len, fn->label.str);
     }
     MUNCH_TOKEN(Token_Comma);
   }
+}
+
+static void compiler_expr_call_args(Compiler *compiler, Token *tokens,
+                                    const Fn *fn) {
+  MUNCH_TOKEN(Token_LParen);
+  compiler_expr_args(compiler, tokens, fn);
+  MUNCH_TOKEN(Token_RParen);
+}
+
+// Backward jumps a folded call may take before it is left to run time
+#define FOLD_FUEL 4096
+
+// Runs a call to a pure Fn whose args are constant in a sandboxed vm and
+// replaces the whole call sequence with a push of its result
+static void compiler_call_fold(Compiler *compiler, const Fn *fn,
+                               const uint64_t call_start_pos) {
+  if (!(compiler->passes & COMPILER_FOLD_CALLS))
+    return;
+  // An imported Fn's body is not in this ir
+  if (fn->label_pos >= INSTS_CAP)
+    return;
+
+  // ldr fp, ldr ra, push, mov cpsr | args | 10 protocol insts and pops
+  uint64_t args_start_pos = call_start_pos + 4;
+  uint64_t args_end_pos = LOC_INST - 10 - fn->arity;
+
+  for (size_t pos = args_start_pos; pos < args_end_pos; pos++) {
+    switch (compiler->ir->insts[pos].type) {
+    case INST_PUSH:
+    case INST_PLUS:
+    case INST_PLUSF:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_EQ:
+    case INST_NE:
+    case INST_GT:
+    case INST_LT:
+    case INST_NEG:
+      continue;
+    default:
+      return;
+    }
+  }
+
+  Analyzer *analyzer = (Analyzer *)calloc(1, sizeof(Analyzer));
+  if (analyzer == NULL)
+    return;
+
+  analyzer_ir_load(analyzer, compiler->ir);
+  analyzer_fns_load(analyzer, compiler->fn, compiler->fn_count);
+  analyzer_analyze_purity(analyzer);
+  free(analyzer);
+
+  if (!fn->pure)
+    return;
+
+  Word result;
+  Err err = vm_sandbox_eval(compiler->ir->insts, LOC_INST, call_start_pos,
+                            FOLD_FUEL, &result);
+  if (err != VM_OK)
+    return;
+
+  LOC_INST = call_start_pos;
+  PUSH_INST(MAKE_PUSH(result));
+}
+
+static void compiler_expr_call(Compiler *compiler, Token *tokens, Sv label) {
+  Fn *fn = compiler_fn_resolve(compiler, &label);
+  uint64_t call_start_pos = LOC_INST;
+
+  // ldr fp
+  PUSH_INST(MAKE_LDR(REG_FP));
+
+  // ldr ra
+  PUSH_INST(MAKE_LDR(REG_RA));
+
+  // mov cpsr, sp
+  PUSH_INST(MAKE_PUSH((Word){.as_u64 = REG_SP}));
+  PUSH_INST(MAKE_MOV(REG_CPSR));
+
+  compiler_expr_call_args(compiler, tokens, fn);
 
   // mov fp, cpsr
   PUSH_INST(MAKE_PUSH((Word){.as_u64 = REG_CPSR}));
@@ -554,8 +976,6 @@ static void compiler_expr_call(Compiler *compiler, Token *tokens, Sv label) {
     PUSH_INST(MAKE_POP);
   }
 
-  compiler_call_destruct(new_compiler);
-
   // mov sp, fp
   PUSH_INST(MAKE_PUSH((Word){.as_u64 = REG_FP}));
   PUSH_INST(MAKE_MOV(REG_SP));
@@ -569,18 +989,179 @@ static void compiler_expr_call(Compiler *compiler, Token *tokens, Sv label) {
   // ldr rax
   PUSH_INST(MAKE_LDR(REG_RAX));
 
-  MUNCH_TOKEN(Token_RParen);
+  compiler_call_fold(compiler, fn, call_start_pos);
+}
+
+// `spawn f(args)` starts f as a task of its own and evaluates to its
+// handle, which join(handle) later trades for f's result
+static void compiler_expr_spawn(Compiler *compiler, Token *tokens) {
+  EXPECT_TOKEN(Token_Identifier);
+  Token *identifier = NEXT_TOKEN;
+  Sv label = (Sv){
+      .str = identifier->start,
+      .len = identifier->len,
+  };
+
+  Fn *fn = compiler_fn_resolve(compiler, &label);
+
+  compiler_expr_call_args(compiler, tokens, fn);
+
+  // push #arity
+  PUSH_INST(MAKE_PUSH((Word){.as_u64 = fn->arity}));
+
+  // spawn label
+  PUSH_INST(MAKE_SPAWN(fn->label_pos));
+
+  // The task took a copy of the args
+  for (size_t i = 0; i < fn->arity; i++) {
+    PUSH_INST(MAKE_POP);
+  }
+
+  // ldr rax
+  PUSH_INST(MAKE_LDR(REG_RAX));
+}
+
+// Bulk array ops, task control and channels, shadowed by any user Fn of
+// the same name
+static const Builtin BUILTINS[] = {
+    {.label = {.len = 4, .str = "size"}, .arity = 1, .type = INST_ALEN},
+    {.label = {.len = 3, .str = "sum"}, .arity = 1, .type = INST_ASUM},
+    {.label = {.len = 3, .str = "dot"}, .arity = 2, .type = INST_ADOT},
+    {.label = {.len = 3, .str = "add"}, .arity = 3, .type = INST_AADD},
+    {.label = {.len = 5, .str = "scale"}, .arity = 3, .type = INST_ASCALE},
+    {.label = {.len = 4, .str = "mask"}, .arity = 3, .type = INST_AMASK},
+    {.label = {.len = 5, .str = "yield"}, .arity = 0, .type = INST_YIELD},
+    {.label = {.len = 4, .str = "join"}, .arity = 1, .type = INST_JOIN},
+    {.label = {.len = 4, .str = "chan"}, .arity = 1, .type = INST_CHAN},
+    {.label = {.len = 4, .str = "send"}, .arity = 2, .type = INST_SEND},
+    {.label = {.len = 4, .str = "recv"}, .arity = 1, .type = INST_RECV},
+    {.label = {.len = 12, .str = "parallel_map"},
+     .arity = 1,
+     .type = INST_PMAP,
+     .fn_arity = 1},
+    {.label = {.len = 15, .str = "parallel_reduce"},
+     .arity = 2,
+     .type = INST_PREDUCE,
+     .fn_arity = 2},
+};
+
+// `parallel_map(f, array)` and the like name a Fn rather than call it
+static Addr compiler_expr_builtin_fn(Compiler *compiler, Token *tokens,
+                                     const Builtin *builtin) {
+  EXPECT_TOKEN(Token_Identifier);
+  Token *identifier = NEXT_TOKEN;
+  Sv label = (Sv){
+      .str = identifier->start,
+      .len = identifier->len,
+  };
+
+  Fn *fn = compiler_fn_resolve(compiler, &label);
+  if (fn->arity != builtin->fn_arity) {
+    compile_error_raise(compiler->error, 11,
+                        "Expected a Fn of %d arguments for %.*s",
+                        builtin->fn_arity, builtin->label.len,
+                        builtin->label.str);
+  }
+
+  MUNCH_TOKEN(Token_Comma);
+  return fn->label_pos;
+}
+
+static int compiler_expr_builtin(Compiler *compiler, Token *tokens,
+                                 const Sv label) {
+  if (compiler_fn_find(compiler, &label) != NULL)
+    return 0;
+
+  for (size_t i = 0; i < sizeof(BUILTINS) / sizeof(BUILTINS[0]); i++) {
+    const Builtin *builtin = &BUILTINS[i];
+
+    if (builtin->label.len != label.len ||
+        memcmp(builtin->label.str, label.str, label.len) != 0)
+      continue;
+
+    Inst inst = {.type = builtin->type};
+    Fn fn = {.label = label, .arity = builtin->arity};
+
+    MUNCH_TOKEN(Token_LParen);
+    if (builtin->fn_arity > 0)
+      inst.operand.as_u64 = compiler_expr_builtin_fn(compiler, tokens, builtin);
+    compiler_expr_args(compiler, tokens, &fn);
+    MUNCH_TOKEN(Token_RParen);
+
+    PUSH_INST(inst);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int compiler_call_is_tail(Compiler *compiler, Token *tokens) {
+  if (PEEK_TOKEN_TYPE != Token_Identifier ||
+      tokens[compiler->tokens_pos + 1].type != Token_LParen)
+    return 0;
+
+  uint64_t pos = compiler->tokens_pos + 2;
+  int depth = 1;
+
+  while (depth) {
+    Token_t type = tokens[pos++].type;
+
+    if (type == Token_EOF)
+      return 0;
+
+    if (type == Token_LParen)
+      depth++;
+    else if (type == Token_RParen)
+      depth--;
+  }
+
+  return tokens[pos].type == Token_Semicolon;
+}
+
+static void compiler_stmt_tailcall(Compiler *compiler, Token *tokens) {
+  Token *identifier = NEXT_TOKEN;
+  Sv label = (Sv){
+      .str = identifier->start,
+      .len = identifier->len,
+  };
+
+  Fn *fn = compiler_fn_resolve(compiler, &label);
+
+  compiler_expr_call_args(compiler, tokens, fn);
+
+  // push #arity
+  PUSH_INST(MAKE_PUSH((Word){.as_u64 = fn->arity}));
+
+  // tailcall label
+  PUSH_INST(MAKE_TAILCALL(fn->label_pos));
 }
 
 static void compiler_stmt_return(Compiler *compiler, Token *tokens) {
   MUNCH_TOKEN(Token_Return);
 
-  RETURNED = 1;
+  compiler->returned = 1;
 
   if (PEEK_TOKEN_TYPE == Token_Semicolon) {
     Word null = {.as_u64 = 0};
     PUSH_INST(MAKE_PUSH(null));
 
+  } else if (compiler->fn_enclosing != NULL &&
+             (compiler->passes & COMPILER_TAIL_CALLS) &&
+             compiler_call_is_tail(compiler, tokens)) {
+    const Token *callee = PEEK_TOKEN;
+    Sv label = {.len = callee->len, .str = callee->start};
+    Fn *fn = compiler_fn_find(compiler, &label);
+
+    // Frame reuse only holds when the caller pops the same arity
+    if (fn != NULL && fn->arity == compiler->fn_enclosing->arity) {
+      compiler_stmt_tailcall(compiler, tokens);
+
+      MUNCH_TOKEN(Token_Semicolon);
+      return;
+    }
+
+    compiler_expr(compiler, tokens);
+
   } else {
     compiler_expr(compiler, tokens);
   }
@@ -588,6 +1169,15 @@ static void compiler_stmt_return(Compiler *compiler, Token *tokens) {
   // str rax
   PUSH_INST(MAKE_STR(REG_RAX));
 
+  // Locals above the params, e.g. of an enclosing for, leave the frame
+  // as the caller's pops expect it
+  Fn *fn_enclosing = compiler->fn_enclosing;
+  if (fn_enclosing != NULL) {
+    for (size_t i = fn_enclosing->arity; i < compiler->locals_count; i++) {
+      PUSH_INST(MAKE_POP);
+    }
+  }
+
   // ret
   PUSH_INST(MAKE_RET);
 
@@ -598,9 +1188,13 @@ static void compiler_stmt(Compiler *compiler, Token *tokens) {
   Token_t peek_type = PEEK_TOKEN_TYPE;
   Token *peek_peek = PEEK_PEEK_TOKEN;
 
-  if (peek_type == Token_Int || peek_type == Token_Str) {
+  if (peek_type == Token_Int || peek_type == Token_Str ||
+      peek_type == Token_FloatType) {
     compiler_stmt_define(compiler, tokens);
 
+  } else if (compiler_stmt_is_store(compiler, tokens)) {
+    compiler_stmt_store(compiler, tokens);
+
   } else if (peek_type == Token_Identifier && peek_peek->type == Token_Equal) {
     compiler_stmt_assign(compiler, tokens);
 
@@ -610,18 +1204,24 @@ static void compiler_stmt(Compiler *compiler, Token *tokens) {
   } else if (peek_type == Token_While) {
     compiler_stmt_while(compiler, tokens);
 
+  } else if (peek_type == Token_For) {
+    compiler_stmt_for(compiler, tokens);
+
   } else if (peek_type == Token_Print) {
     compiler_stmt_print(compiler, tokens);
 
   } else if (peek_type == Token_LBrace) {
     compiler_stmt_block(compiler, tokens);
 
-  } else if (peek_type == Token_Fn) {
+  } else if (peek_type == Token_Fn || peek_type == Token_Noinline) {
     compiler_stmt_fn(compiler, tokens);
 
   } else if (peek_type == Token_Return) {
     compiler_stmt_return(compiler, tokens);
 
+  } else if (peek_type == Token_Import) {
+    compiler_stmt_import(compiler, tokens);
+
   } else {
     compiler_expr_stmt(compiler, tokens);
   };
@@ -638,6 +1238,14 @@ void compiler_compile(Compiler *compiler, Token *tokens) {
   PUSH_INST(MAKE_EOF);
 }
 
+uint64_t compiler_compile_append(Compiler *compiler, Token *tokens) {
+  uint64_t start = LOC_INST > 0 ? LOC_INST - 1 : 0;
+  LOC_INST = start;
+  compiler->tokens_pos = 0;
+  compiler_compile(compiler, tokens);
+  return start;
+}
+
 #undef PEEK_TOKEN
 #undef PEEK_PEEK_TOKEN
 #undef NEXT_TOKEN
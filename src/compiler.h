@@ -25,9 +25,34 @@ typedef struct {
   Sv label;
 
   uint8_t arity;
+  uint8_t noinline;
+  uint8_t pure;
 } Fn;
 
+typedef struct {
+  Sv label;
+  uint8_t arity;
+  Inst_t type;
+  // Arity of the Fn named by a leading first arg, which becomes the inst's
+  // operand; 0 if there is none
+  uint8_t fn_arity;
+} Builtin;
+
 typedef struct Compiler Compiler;
+
+// Declares the Fns of the unit at path, which an import statement names,
+// in compiler's imports; see linker.h
+typedef void (*Compiler_import)(void *ctx, Compiler *compiler, Sv path);
+
+// Optimizations made while compiling, every one unless cleared from a
+// compiler's passes
+#define COMPILER_TAIL_CALLS (1u << 0)
+#define COMPILER_FOLD_CALLS (1u << 1)
+#define COMPILER_PASSES (COMPILER_TAIL_CALLS | COMPILER_FOLD_CALLS)
+
+// Calls to the i-th imported Fn target this until a linker places it
+#define COMPILER_IMPORTED(i) ((uint64_t)INSTS_CAP + (i))
+
 struct Compiler {
   Compiler *enclosing;
 
@@ -41,6 +66,21 @@ struct Compiler {
 
   Fn fn[FN_CAP];
   uint8_t fn_count;
+
+  // Fns of other units, searched after the ones declared here
+  Fn imports[FN_CAP];
+  uint8_t imports_count;
+  Compiler_import import;
+  void *import_ctx;
+
+  uint64_t tokens_pos;
+  // Whether the Fn body being compiled ended in a return
+  int returned;
+  Fn *fn_enclosing;
+
+  // NULL until set; see Compile_error
+  Compile_error *error;
+  unsigned passes;
 };
 
 typedef enum {
@@ -60,6 +100,10 @@ typedef struct {
 } Bp;
 
 void compiler_init(Compiler *compiler);
+void compiler_destruct(Compiler *compiler);
 void compiler_compile(Compiler *compiler, Token *tokens);
+// Compiles tokens on to the end of the ir in place of its eof, keeping
+// the Fns declared so far; the new insts start at the returned position
+uint64_t compiler_compile_append(Compiler *compiler, Token *tokens);
 
 #endif
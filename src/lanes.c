@@ -0,0 +1,369 @@
+#include <string.h>
+
+#include "lanes.h"
+
+typedef uint32_t Lanes_mask;
+
+_Static_assert(LANES_WIDTH <= 31, "a lane mask must fit every lane");
+
+// Visits the lanes in mask, lowest first
+#define LANES_EACH(l)                                                          \
+  for (Lanes_mask left = mask, l = 0;                                          \
+       left != 0 && (l = (Lanes_mask)__builtin_ctz(left), 1);                  \
+       left &= left - 1)
+#define LANES_CHECK(cond)                                                      \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      return 0;                                                                \
+  } while (0)
+
+#define COUNT(l) lanes->stack_count[l]
+#define SLOT(l, n) lanes->stack[COUNT(l) - (n)][l]
+#define REG(no, l) lanes->reg[no][l]
+
+#define PUSH(l, word)                                                          \
+  do {                                                                         \
+    LANES_CHECK(COUNT(l) < LANES_STACK_CAP);                                   \
+    const Word pushed = (word);                                                \
+    lanes->stack[COUNT(l)][l] = pushed;                                        \
+    COUNT(l)++;                                                                \
+    REG(REG_SP, l).as_u64++;                                                   \
+  } while (0)
+#define DROP(l)                                                                \
+  do {                                                                         \
+    COUNT(l)--;                                                                \
+    REG(REG_SP, l).as_u64--;                                                   \
+  } while (0)
+
+// Two operands in, one out: lhs and rhs name the lane's words
+#define BINARY(expr)                                                           \
+  LANES_EACH(l) {                                                              \
+    LANES_CHECK(COUNT(l) > 1);                                                 \
+    Word *lhs = &SLOT(l, 2);                                                   \
+    const Word rhs = SLOT(l, 1);                                               \
+    expr;                                                                      \
+    DROP(l);                                                                   \
+  }
+
+// Fuel burns once per dispatch of a backward jump, which is at least as
+// often as any one lane burns it: running dry here is only a hint that a
+// vm would as well
+#define FUEL_BURN(target)                                                      \
+  do {                                                                         \
+    if ((target) < pc && --fuel == 0)                                          \
+      return 0;                                                                \
+  } while (0)
+
+// A lane's frame args, gathered for the result caches
+static uint64_t lanes_frame_args(const Lanes *lanes, const size_t l,
+                                 Word *args) {
+  uint64_t fp = lanes->reg[REG_FP][l].as_u64;
+  uint64_t arity = lanes->stack_count[l] - fp;
+  if (arity > MEMO_ARITY_CAP)
+    return arity;
+
+  for (size_t i = 0; i < arity; i++)
+    args[i] = lanes->stack[fp + i][l];
+  return arity;
+}
+
+int lanes_call(Lanes *lanes, const Inst *program, const size_t program_size,
+               Memo **memos, const Addr label, Word args[][LANES_WIDTH],
+               const uint64_t arity, const size_t lanes_count, uint64_t fuel,
+               Word *results) {
+  if (lanes_count == 0 || lanes_count > LANES_WIDTH ||
+      arity + 2 > LANES_STACK_CAP || program_size == 0)
+    return 0;
+
+  memset(lanes->reg, 0, sizeof(lanes->reg));
+
+  // Each lane framed like a spawned task, its ret landing on the eof
+  Lanes_mask live = ((Lanes_mask)1 << lanes_count) - 1;
+  Lanes_mask mask = live;
+  LANES_EACH(l) {
+    lanes->stack[0][l].as_u64 = 0;
+    lanes->stack[1][l].as_u64 = 0;
+    for (size_t i = 0; i < arity; i++)
+      lanes->stack[i + 2][l] = args[i][l];
+    COUNT(l) = arity + 2;
+
+    REG(REG_IP, l).as_u64 = label;
+    REG(REG_FP, l).as_u64 = 2;
+    REG(REG_CPSR, l).as_u64 = 2;
+    REG(REG_SP, l).as_u64 = arity + 2;
+    REG(REG_RA, l).as_u64 = program_size - 1;
+  }
+
+  // Lanes in mask are all at pc, which their ip registers only catch up
+  // with at the next regroup; after a jump those hold where each went.
+  // The others wait, the first of them at meet, where they are regrouped
+  // with once pc gets there.
+  Addr pc = 0;
+  Addr meet = 0;
+  mask = 0;
+
+  while (live) {
+    if (pc == meet) {
+      LANES_EACH(l) { REG(REG_IP, l).as_u64 = pc; }
+
+      // The lanes furthest behind go first, so that the ones a branch
+      // split off wait for them where the paths meet again
+      pc = UINT64_MAX;
+      meet = UINT64_MAX;
+      mask = 0;
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        if (!(live & ((Lanes_mask)1 << l)))
+          continue;
+
+        Addr ip = REG(REG_IP, l).as_u64;
+        if (ip < pc) {
+          meet = pc;
+          pc = ip;
+          mask = (Lanes_mask)1 << l;
+        } else if (ip == pc) {
+          mask |= (Lanes_mask)1 << l;
+        } else if (ip < meet) {
+          meet = ip;
+        }
+      }
+    }
+
+    LANES_CHECK(pc < program_size);
+    const Inst inst = program[pc++];
+    const Word operand = inst.operand;
+
+    switch (INST_BASE(inst.type)) {
+    case INST_PUSH:
+      LANES_EACH(l) { PUSH(l, operand); }
+      continue;
+
+    case INST_POP:
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        DROP(l);
+      }
+      continue;
+
+    case INST_DUP:
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        PUSH(l, SLOT(l, 1));
+      }
+      continue;
+
+    case INST_PICK:
+      LANES_EACH(l) {
+        LANES_CHECK(operand.as_u64 < COUNT(l));
+        PUSH(l, SLOT(l, 1 + operand.as_u64));
+      }
+      continue;
+
+    case INST_PLUS:
+      BINARY(lhs->as_u64 += rhs.as_u64);
+      continue;
+    case INST_PLUSF:
+      BINARY(lhs->as_f64 += rhs.as_f64);
+      continue;
+    case INST_MINUS:
+      BINARY(lhs->as_u64 -= rhs.as_u64);
+      continue;
+    case INST_MULT:
+      BINARY(lhs->as_u64 *= rhs.as_u64);
+      continue;
+    case INST_DIV:
+      BINARY(LANES_CHECK(rhs.as_u64 != 0); lhs->as_u64 /= rhs.as_u64);
+      continue;
+    case INST_EQ:
+      BINARY(lhs->as_u64 = lhs->as_u64 == rhs.as_u64);
+      continue;
+    case INST_NE:
+      BINARY(lhs->as_u64 = lhs->as_u64 != rhs.as_u64);
+      continue;
+    case INST_GT:
+      BINARY(lhs->as_u64 = lhs->as_u64 > rhs.as_u64);
+      continue;
+    case INST_LT:
+      BINARY(lhs->as_u64 = lhs->as_u64 < rhs.as_u64);
+      continue;
+
+    case INST_SHL:
+    case INST_SHR:
+    case INST_NEG:
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        Word *top = &SLOT(l, 1);
+        if (INST_BASE(inst.type) == INST_SHL)
+          top->as_u64 <<= operand.as_u64;
+        else if (INST_BASE(inst.type) == INST_SHR)
+          top->as_u64 >>= operand.as_u64;
+        else
+          top->as_u64 = -top->as_u64;
+      }
+      continue;
+
+    case INST_DEFL:
+      LANES_EACH(l) {
+        LANES_CHECK(operand.as_u64 < COUNT(l));
+        PUSH(l, lanes->stack[operand.as_u64][l]);
+      }
+      continue;
+
+    case INST_VARL:
+      LANES_EACH(l) {
+        uint64_t slot = REG(REG_FP, l).as_u64 + operand.as_u64;
+        LANES_CHECK(slot < COUNT(l));
+        PUSH(l, lanes->stack[slot][l]);
+      }
+      continue;
+
+    // The ip register only holds where a lane is between dispatches
+    case INST_LDR:
+      LANES_CHECK(operand.as_u64 < VM_REGS_CAP && operand.as_u64 != REG_IP);
+      LANES_EACH(l) { PUSH(l, REG(operand.as_u64, l)); }
+      continue;
+
+    case INST_STR:
+      LANES_CHECK(operand.as_u64 < VM_REGS_CAP && operand.as_u64 != REG_IP);
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        Word word = SLOT(l, 1);
+        DROP(l);
+        REG(operand.as_u64, l) = word;
+      }
+      continue;
+
+    case INST_MOV:
+      LANES_CHECK(operand.as_u64 < VM_REGS_CAP && operand.as_u64 != REG_IP);
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        uint64_t src = SLOT(l, 1).as_u64;
+        LANES_CHECK(src < VM_REGS_CAP && src != REG_IP);
+        DROP(l);
+        REG(operand.as_u64, l) = REG(src, l);
+      }
+      continue;
+
+    case INST_LABEL:
+      continue;
+
+    // Jumps leave each lane's ip in its register and regroup all lanes
+    case INST_JMPA:
+      LANES_CHECK(operand.as_u64 < program_size);
+      FUEL_BURN(operand.as_u64);
+      LANES_EACH(l) { REG(REG_IP, l) = operand; }
+      break;
+
+    case INST_JMPT:
+    case INST_JMPNT:;
+      LANES_CHECK(operand.as_u64 < program_size);
+      uint64_t taken = INST_BASE(inst.type) == INST_JMPT;
+      Lanes_mask jumped = 0;
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        uint64_t cond = SLOT(l, 1).as_u64 != 0;
+        DROP(l);
+
+        if (cond == taken) {
+          REG(REG_IP, l) = operand;
+          jumped |= (Lanes_mask)1 << l;
+        } else {
+          REG(REG_IP, l).as_u64 = pc;
+        }
+      }
+      if (jumped)
+        FUEL_BURN(operand.as_u64);
+      break;
+
+    case INST_FORLOOP:;
+      // counter, limit, step on top; step the counter, loop while below
+      LANES_CHECK(operand.as_u64 < program_size);
+      Lanes_mask looped = 0;
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 2);
+        Word *counter = &SLOT(l, 3);
+        counter->as_u64 += SLOT(l, 1).as_u64;
+
+        if (counter->as_u64 < SLOT(l, 2).as_u64) {
+          REG(REG_IP, l) = operand;
+          looped |= (Lanes_mask)1 << l;
+        } else {
+          REG(REG_IP, l).as_u64 = pc;
+        }
+      }
+      if (looped)
+        FUEL_BURN(operand.as_u64);
+      break;
+
+    case INST_MEMOCALL:;
+      // Frame and args are in place: a hit returns to ra without entering
+      LANES_CHECK(operand.as_u64 < program_size);
+      Lanes_mask entered = 0;
+      LANES_EACH(l) {
+        Word memo_args[MEMO_ARITY_CAP];
+        uint64_t memo_arity = lanes_frame_args(lanes, l, memo_args);
+        Word *memoized = vm_memo_lookup(memos, operand.as_u64, memo_args,
+                                        memo_arity);
+
+        if (memoized != NULL) {
+          REG(REG_RAX, l) = *memoized;
+          REG(REG_IP, l) = REG(REG_RA, l);
+        } else {
+          REG(REG_IP, l) = operand;
+          entered |= (Lanes_mask)1 << l;
+        }
+      }
+      if (entered)
+        FUEL_BURN(operand.as_u64);
+      break;
+
+    case INST_MEMORET:
+      LANES_EACH(l) {
+        Word memo_args[MEMO_ARITY_CAP];
+        uint64_t memo_arity = lanes_frame_args(lanes, l, memo_args);
+        vm_memo_store(memos, operand.as_u64, memo_args, memo_arity,
+                      REG(REG_RAX, l));
+      }
+      // fallthrough
+    case INST_RET:
+      LANES_EACH(l) { REG(REG_IP, l) = REG(REG_RA, l); }
+      break;
+
+    case INST_TAILCALL:
+      LANES_CHECK(operand.as_u64 < program_size);
+      LANES_EACH(l) {
+        LANES_CHECK(COUNT(l) > 0);
+        uint64_t args_count = SLOT(l, 1).as_u64;
+        uint64_t fp = REG(REG_FP, l).as_u64;
+        LANES_CHECK(fp + args_count < COUNT(l));
+        DROP(l);
+
+        // Reuse the frame: new args replace the current ones
+        for (size_t i = 0; i < args_count; i++)
+          lanes->stack[fp + i][l] =
+              lanes->stack[COUNT(l) - args_count + i][l];
+        REG(REG_SP, l).as_u64 -= COUNT(l) - (fp + args_count);
+        COUNT(l) = fp + args_count;
+
+        REG(REG_IP, l) = operand;
+      }
+      FUEL_BURN(operand.as_u64);
+      break;
+
+    case INST_EOF:
+      LANES_EACH(l) { results[l] = REG(REG_RAX, l); }
+      live &= ~mask;
+      mask = 0;
+      break;
+
+    default:
+      // Globals, arrays, output and tasks belong to a vm
+      return 0;
+    }
+
+    // Only jumps get here
+    mask = 0;
+    meet = pc;
+  }
+
+  return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Inputs a single dispatch works on
+#ifndef LANES_WIDTH
+#define LANES_WIDTH 8
+#endif
+
+// Words of stack each lane may grow to before the call is left to a vm
+#ifndef LANES_STACK_CAP
+#define LANES_STACK_CAP 1024
+#endif
+
+// Every stack slot and register holds one word per lane, side by side
+typedef struct {
+  Word stack[LANES_STACK_CAP][LANES_WIDTH];
+  uint64_t stack_count[LANES_WIDTH];
+  Word reg[VM_REGS_CAP][LANES_WIDTH];
+} Lanes;
+
+// Calls the Fn at label once per lane, lane l taking args[i][l] as its
+// i-th arg, and interprets each inst once for all lanes that are at it.
+// Lanes that branch apart wait, masked off, for the others to catch up
+// with them. Pure Fns share the result caches in memos with the vm's.
+// 0 if some lane met an inst or error that only a vm handles; since
+// lanes have no effects outside themselves and the caches, the calls may
+// then be run again one by one.
+int lanes_call(Lanes *lanes, const Inst *program, size_t program_size,
+               Memo **memos, Addr label, Word args[][LANES_WIDTH],
+               uint64_t arity, size_t lanes_count, uint64_t fuel,
+               Word *results);
+
+#endif
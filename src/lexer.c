@@ -1,91 +1,158 @@
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "lexer.h"
 
-Lexer lexer = {0};
-
-inline static void lexer_code_advance(const int n) {
+inline static void lexer_code_advance(Lexer *lexer, const int n) {
   for (int i = 0; i < n; i++) {
-    lexer.code++;
+    lexer->code++;
   }
 }
 
-inline static void lexer_lex_token(const Token_t token_type, const int len) {
-  lexer.tokens[lexer.tokens_count++] =
-      (Token){.type = token_type, .start = lexer.code, .len = len};
-  lexer_code_advance(len);
+void compile_error_raise(Compile_error *error, int code, const char *format,
+                         ...) {
+  Compile_error fallback = {0};
+  if (error == NULL)
+    error = &fallback;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(error->message, sizeof(error->message), format, args);
+  va_end(args);
+  error->code = code;
+
+  if (error->recover != NULL)
+    longjmp(*error->recover, 1);
+
+  fprintf(stderr, "%s", error->message);
+  exit(code);
+}
+
+inline static void lexer_lex_token(Lexer *lexer, const Token_t token_type,
+                                   const int len) {
+  // The last one is left for the eof
+  if (lexer->tokens_count >= TOKENS_CAP - 1 && token_type != Token_EOF)
+    compile_error_raise(lexer->error, 2, "Code is over %d tokens",
+                        TOKENS_CAP - 1);
+
+  lexer->tokens[lexer->tokens_count++] =
+      (Token){.type = token_type, .start = lexer->code, .len = len};
+  lexer_code_advance(lexer, len);
 }
 
-void lexer_init_with_code(char *code) { lexer.code = code; }
+void lexer_init_with_code(Lexer *lexer, char *code) {
+  lexer->code = code;
+  lexer->tokens_count = 0;
+  lexer->error = NULL;
+}
 
-static int lexer_lex_keyword(void) {
-  const char *code = lexer.code;
+inline static int is_alphabet(const int c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+inline static int is_identifier(const int c) {
+  return c == '_' || is_alphabet(c);
+}
+inline static int is_number(const char c) { return c >= 48 && c <= 57; }
+
+inline static int lexer_keyword_is(Lexer *lexer, const char *keyword,
+                                   const int len) {
+  return strncmp(lexer->code, keyword, len) == 0 &&
+         !is_identifier(lexer->code[len]);
+}
 
-  switch (*code) {
+static int lexer_lex_keyword(Lexer *lexer) {
+  switch (*lexer->code) {
   case 'f':
-    ++code;
-    switch (*code) {
-    case 'o':
-      lexer_lex_token(Token_For, 3);
+    if (lexer_keyword_is(lexer, "for", 3)) {
+      lexer_lex_token(lexer, Token_For, 3);
       return 1;
-    case 'n':
-      lexer_lex_token(Token_Fn, 2);
+    }
+    if (lexer_keyword_is(lexer, "fn", 2)) {
+      lexer_lex_token(lexer, Token_Fn, 2);
+      return 1;
+    }
+    if (lexer_keyword_is(lexer, "float", 5)) {
+      lexer_lex_token(lexer, Token_FloatType, 5);
       return 1;
-    default:
-      return 0;
     }
     return 0;
 
   case 'i':
-    ++code;
-    switch (*code--) {
-    case 'f':
-      lexer_lex_token(Token_If, 2);
+    if (lexer_keyword_is(lexer, "import", 6)) {
+      lexer_lex_token(lexer, Token_Import, 6);
       return 1;
-    case 'n':
-      lexer_lex_token(Token_Int, 3);
+    }
+    if (lexer_keyword_is(lexer, "if", 2)) {
+      lexer_lex_token(lexer, Token_If, 2);
+      return 1;
+    }
+    if (lexer_keyword_is(lexer, "int", 3)) {
+      lexer_lex_token(lexer, Token_Int, 3);
+      return 1;
+    }
+    return 0;
+
+  case 'n':
+    if (lexer_keyword_is(lexer, "noinline", 8)) {
+      lexer_lex_token(lexer, Token_Noinline, 8);
+      return 1;
+    }
+    return 0;
+
+  case 's':
+    if (lexer_keyword_is(lexer, "spawn", 5)) {
+      lexer_lex_token(lexer, Token_Spawn, 5);
       return 1;
-    default:
-      return 0;
     }
+    return 0;
 
   case 'w':
-    lexer_lex_token(Token_While, 5);
-    return 1;
+    if (lexer_keyword_is(lexer, "while", 5)) {
+      lexer_lex_token(lexer, Token_While, 5);
+      return 1;
+    }
+    return 0;
   case 'l':
-    lexer_lex_token(Token_Long, 4);
-    return 1;
+    if (lexer_keyword_is(lexer, "long", 4)) {
+      lexer_lex_token(lexer, Token_Long, 4);
+      return 1;
+    }
+    return 0;
   case 'p':
-    lexer_lex_token(Token_Print, 5);
-    return 1;
+    if (lexer_keyword_is(lexer, "print", 5)) {
+      lexer_lex_token(lexer, Token_Print, 5);
+      return 1;
+    }
+    return 0;
   case 'e':
-    lexer_lex_token(Token_Else, 5);
-    return 1;
+    if (lexer_keyword_is(lexer, "else", 4)) {
+      lexer_lex_token(lexer, Token_Else, 4);
+      return 1;
+    }
+    return 0;
   case 'r':
-    lexer_lex_token(Token_Return, 6);
-    return 1;
+    if (lexer_keyword_is(lexer, "return", 6)) {
+      lexer_lex_token(lexer, Token_Return, 6);
+      return 1;
+    }
+    return 0;
   default:
     return 0;
   }
   return 0;
 }
 
-inline static int is_alphabet(const int c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
-inline static int is_number(const char c) { return c >= 48 && c <= 57; }
-
-static void lexer_lex_alphabet(void) {
+static void lexer_lex_alphabet(Lexer *lexer) {
   int len = 1;
-  char *p_code = lexer.code;
+  char *p_code = lexer->code;
   p_code++;
 
   while (1) {
     char c = *p_code;
 
-    if (c == '\0' || !is_alphabet(c)) {
+    if (c == '\0' || !is_identifier(c)) {
       break;
     }
 
@@ -93,12 +160,12 @@ static void lexer_lex_alphabet(void) {
     p_code++;
   }
 
-  lexer_lex_token(Token_Identifier, len);
+  lexer_lex_token(lexer, Token_Identifier, len);
 }
 
-static void lexer_lex_number(void) {
+static void lexer_lex_number(Lexer *lexer) {
   int len = 1;
-  char *p_code = lexer.code;
+  char *p_code = lexer->code;
   p_code++;
 
   while (1) {
@@ -116,7 +183,7 @@ static void lexer_lex_number(void) {
     p_code++;
   }
 
-  lexer_lex_token(Token_Number, len);
+  lexer_lex_token(lexer, Token_Number, len);
   return;
 
 token_float:
@@ -139,35 +206,35 @@ token_float:
     p_code++;
   }
 
-  lexer_lex_token(Token_Float, len);
+  lexer_lex_token(lexer, Token_Float, len);
 }
 
-static int lexer_lex_alphanumeric(void) {
-  char c = *lexer.code;
+static int lexer_lex_alphanumeric(Lexer *lexer) {
+  char c = *lexer->code;
 
-  if (c == '_' || is_alphabet(c)) {
-    lexer_lex_alphabet();
+  if (is_identifier(c)) {
+    lexer_lex_alphabet(lexer);
     return 1;
   } else if (is_number(c)) {
-    lexer_lex_number();
+    lexer_lex_number(lexer);
     return 1;
   }
 
   return 0;
 }
 
-inline static void lexer_trim_space(void) {
+inline static void lexer_trim_space(Lexer *lexer) {
   while (1) {
-    const char c = *lexer.code;
+    const char c = *lexer->code;
     switch (c) {
     case ' ':
-      lexer.code++;
+      lexer->code++;
       continue;
     case '\n':
-      lexer.code++;
+      lexer->code++;
       continue;
     case '\t':
-      lexer.code++;
+      lexer->code++;
       continue;
     default:
       return;
@@ -175,10 +242,10 @@ inline static void lexer_trim_space(void) {
   }
 }
 
-static void lexer_lex_literal(void) {
-  lexer_lex_token(Token_Quote, 1);
+static void lexer_lex_literal(Lexer *lexer) {
+  lexer_lex_token(lexer, Token_Quote, 1);
 
-  char *p_code = lexer.code;
+  char *p_code = lexer->code;
   p_code++;
   int len = 0;
 
@@ -194,96 +261,96 @@ static void lexer_lex_literal(void) {
       break;
   }
 
-  lexer_lex_token(Token_Literal, len);
+  lexer_lex_token(lexer, Token_Literal, len);
 }
 
-void lexer_lex(void) {
+void lexer_lex(Lexer *lexer) {
   while (1) {
-    lexer_trim_space();
-    const char *code = lexer.code;
+    lexer_trim_space(lexer);
+    const char *code = lexer->code;
     if (*code == '\0') {
-      lexer_lex_token(Token_EOF, 0);
+      lexer_lex_token(lexer, Token_EOF, 0);
       break;
     }
 
     if (*code == '"') {
-      lexer_lex_literal();
+      lexer_lex_literal(lexer);
     }
 
-    if (lexer_lex_keyword()) {
+    if (lexer_lex_keyword(lexer)) {
       continue;
     }
 
-    if (lexer_lex_alphanumeric()) {
+    if (lexer_lex_alphanumeric(lexer)) {
       continue;
     }
 
     switch (*code) {
     case '[':
-      lexer_lex_token(Token_LBracket, 1);
+      lexer_lex_token(lexer, Token_LBracket, 1);
       continue;
     case ']':
-      lexer_lex_token(Token_RBracket, 1);
+      lexer_lex_token(lexer, Token_RBracket, 1);
       continue;
     case '(':
-      lexer_lex_token(Token_LParen, 1);
+      lexer_lex_token(lexer, Token_LParen, 1);
       continue;
     case ')':
-      lexer_lex_token(Token_RParen, 1);
+      lexer_lex_token(lexer, Token_RParen, 1);
       continue;
     case '{':
-      lexer_lex_token(Token_LBrace, 1);
+      lexer_lex_token(lexer, Token_LBrace, 1);
       continue;
     case '}':
-      lexer_lex_token(Token_RBrace, 1);
+      lexer_lex_token(lexer, Token_RBrace, 1);
       continue;
     case ',':
-      lexer_lex_token(Token_Comma, 1);
+      lexer_lex_token(lexer, Token_Comma, 1);
       continue;
     case '+':
-      lexer_lex_token(Token_Plus, 1);
+      lexer_lex_token(lexer, Token_Plus, 1);
       continue;
     case '-':
-      lexer_lex_token(Token_Minus, 1);
+      lexer_lex_token(lexer, Token_Minus, 1);
       continue;
     case '*':
-      lexer_lex_token(Token_Mult, 1);
+      lexer_lex_token(lexer, Token_Mult, 1);
       continue;
     case '/':
-      lexer_lex_token(Token_Div, 1);
+      lexer_lex_token(lexer, Token_Div, 1);
       continue;
     case '=':
       if (*++code == '=') {
-        lexer_lex_token(Token_EqualEqual, 2);
+        lexer_lex_token(lexer, Token_EqualEqual, 2);
       } else {
-        lexer_lex_token(Token_Equal, 1);
+        lexer_lex_token(lexer, Token_Equal, 1);
       }
       continue;
     case '!':
       if (*++code == '=') {
-        lexer_lex_token(Token_ExcMarkEqual, 2);
+        lexer_lex_token(lexer, Token_ExcMarkEqual, 2);
       } else {
-        lexer_lex_token(Token_ExcMark, 1);
+        lexer_lex_token(lexer, Token_ExcMark, 1);
       }
       continue;
     case '>':
-      lexer_lex_token(Token_GT, 1);
+      lexer_lex_token(lexer, Token_GT, 1);
       continue;
     case '<':
-      lexer_lex_token(Token_LT, 1);
+      lexer_lex_token(lexer, Token_LT, 1);
       continue;
     case ';':
-      lexer_lex_token(Token_Semicolon, 1);
+      lexer_lex_token(lexer, Token_Semicolon, 1);
       continue;
     case ':':
-      lexer_lex_token(Token_Colon, 1);
+      lexer_lex_token(lexer, Token_Colon, 1);
       continue;
     case '"':
-      lexer_lex_token(Token_Quote, 1);
+      lexer_lex_token(lexer, Token_Quote, 1);
       continue;
     default:
-      fprintf(stderr, "ERROR: Unidentifiable character: %c\n", *code);
-      exit(2);
+      compile_error_raise(lexer->error, 2, "Unidentifiable character: %c",
+                          *code);
     }
   }
 }
@@ -310,6 +377,8 @@ char *lexer_token_t_to_str(const Token_t type) {
     return "Token_Comma";
   case Token_Fn:
     return "Token_Fn";
+  case Token_FloatType:
+    return "Token_FloatType";
   case Token_Int:
     return "Token_Int";
   case Token_Str:
@@ -328,6 +397,12 @@ char *lexer_token_t_to_str(const Token_t type) {
     return "Token_While";
   case Token_For:
     return "Token_For";
+  case Token_Noinline:
+    return "Token_Noinline";
+  case Token_Spawn:
+    return "Token_Spawn";
+  case Token_Import:
+    return "Token_Import";
   case Token_Plus:
     return "Token_Plus";
   case Token_Minus:
@@ -370,9 +445,9 @@ char *lexer_token_t_to_str(const Token_t type) {
   }
 }
 
-void lexer_tokens_dump(Token *const tokens) {
-  for (size_t i = 0; i < lexer.tokens_count; i++) {
-    Token *token = &tokens[i];
+void lexer_tokens_dump(const Lexer *lexer) {
+  for (size_t i = 0; i < lexer->tokens_count; i++) {
+    const Token *token = &lexer->tokens[i];
     printf("Type: %s\n", lexer_token_t_to_str(token->type));
     printf("Len: %d\n", token->len);
     printf("Data: %.*s\n\n", token->len, token->start);
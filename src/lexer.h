@@ -1,6 +1,7 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <setjmp.h>
 #include <stddef.h>
 typedef enum {
   Token_LParen,
@@ -16,6 +17,7 @@ typedef enum {
   Token_Comma,
   Token_Fn,
   Token_Int,
+  Token_FloatType,
   Token_Str,
   Token_Long,
   Token_Return,
@@ -24,6 +26,9 @@ typedef enum {
   Token_Else,
   Token_While,
   Token_For,
+  Token_Noinline,
+  Token_Spawn,
+  Token_Import,
   Token_Plus,
   Token_Minus,
   Token_Mult,
@@ -50,15 +55,34 @@ typedef struct {
 
 #define TOKENS_CAP 512
 
+// Bytes of a compile error's message, its terminator included
+#define COMPILE_ERROR_CAP 256
+
+// Where the lexer, compiler and linker report code that does not compile.
+// While recover is set the message is kept, along with the status main
+// exits with for it, and the compile unwinds there; otherwise the message
+// goes to stderr and the process exits with that status.
+typedef struct {
+  jmp_buf *recover;
+  int code;
+  char message[COMPILE_ERROR_CAP];
+} Compile_error;
+
+_Noreturn void compile_error_raise(Compile_error *error, int code,
+                                   const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
 typedef struct {
   char *code;
   Token tokens[TOKENS_CAP];
   size_t tokens_count;
+  // NULL until set; see Compile_error
+  Compile_error *error;
 } Lexer;
 
-void lexer_lex(void);
-void lexer_init_with_code(char *code);
-void lexer_tokens_dump(Token *const tokens);
+void lexer_lex(Lexer *lexer);
+void lexer_init_with_code(Lexer *lexer, char *code);
+void lexer_tokens_dump(const Lexer *lexer);
 char *lexer_token_t_to_str(const Token_t type);
 
 #endif
@@ -0,0 +1,399 @@
+// stat's st_mtim and strndup
+#define _DEFAULT_SOURCE
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "analyzer.h"
+#include "lexer.h"
+#include "linker.h"
+#include "pool.h"
+
+// Bytes of a file to import, as for the files given to main
+#define UNIT_CODE_CAP 1024
+
+void linker_init(Linker *linker) {
+  memset(linker, 0, sizeof(*linker));
+  linker->passes = COMPILER_PASSES;
+}
+
+void linker_unit_fini(Unit *unit) {
+  free(unit->ir);
+  unit->ir = NULL;
+}
+
+void linker_destruct(Linker *linker) {
+  for (size_t i = 0; i < linker->units_count; i++) {
+    Unit *unit = linker->units[i];
+    linker_unit_fini(unit);
+    free(unit->lexer);
+    free(unit->path);
+    free(unit->code);
+    free(unit);
+    linker->units[i] = NULL;
+  }
+  linker->units_count = 0;
+}
+
+static void linker_import(void *ctx, Compiler *compiler, Sv path);
+
+void linker_unit_end(Unit *unit, Compiler *compiler) {
+  Ir *ir = compiler->ir;
+  compiler->ir = NULL;
+  if (ir->insts_count > 0 && ir->insts[ir->insts_count - 1].type == INST_EOF)
+    ir->insts_count--;
+  unit->ir = ir;
+
+  memcpy(unit->fns, compiler->fn, compiler->fn_count * sizeof(Fn));
+  unit->fns_count = compiler->fn_count;
+
+  unit->relocs_count = 0;
+  for (size_t pos = 0; pos < ir->insts_count; pos++) {
+    if (analyzer_inst_is_addr(ir->insts, ir->insts_count, pos))
+      unit->relocs[unit->relocs_count++] = pos;
+  }
+}
+
+static Unit *linker_unit_find(Linker *linker, const Sv path) {
+  for (size_t i = 0; i < linker->units_count; i++) {
+    const char *unit_path = linker->units[i]->path;
+    if (strncmp(unit_path, path.str, (size_t)path.len) == 0 &&
+        unit_path[path.len] == '\0')
+      return linker->units[i];
+  }
+
+  return NULL;
+}
+
+static char *linker_code_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  char *code = (char *)malloc(UNIT_CODE_CAP);
+  size_t len = code != NULL ? fread(code, 1, UNIT_CODE_CAP, file) : 0;
+  int failed = code == NULL || ferror(file) || len == UNIT_CODE_CAP;
+  fclose(file);
+  if (failed) {
+    free(code);
+    return NULL;
+  }
+
+  code[len] = '\0';
+  return code;
+}
+
+// The cached unit for path, added if there is none yet
+static Unit *linker_unit_get(Linker *linker, const Sv path) {
+  Unit *unit = linker_unit_find(linker, path);
+  if (unit != NULL)
+    return unit;
+
+  if (linker->units_count >= LINKER_UNITS_CAP)
+    compile_error_raise(linker->error, 14, "Cannot import %.*s: over %d files",
+                        path.len, path.str, LINKER_UNITS_CAP);
+
+  unit = (Unit *)calloc(1, sizeof(Unit));
+  char *unit_path = unit != NULL ? strndup(path.str, (size_t)path.len) : NULL;
+  if (unit_path == NULL) {
+    free(unit);
+    compile_error_raise(linker->error, 14, "Cannot import %.*s: %s", path.len,
+                        path.str, vm_err_to_str(VM_OUT_OF_MEMORY));
+  }
+  unit->linker = linker;
+  unit->path = unit_path;
+  linker->units[linker->units_count++] = unit;
+  return unit;
+}
+
+static void linker_unit_lex(Unit *unit) {
+  if (unit->lexer == NULL)
+    unit->lexer = (Lexer *)malloc(sizeof(Lexer));
+  if (unit->lexer == NULL)
+    compile_error_raise(unit->linker->error, 14, "Cannot import %s: %s",
+                        unit->path, vm_err_to_str(VM_OUT_OF_MEMORY));
+
+  lexer_init_with_code(unit->lexer, unit->code);
+  unit->lexer->error = unit->linker->error;
+  lexer_lex(unit->lexer);
+}
+
+static void linker_unit_scan(Unit *unit);
+
+// Finds the files tokens import, before any of them is compiled, so that
+// the ones to compile can be laid out in waves
+static void linker_unit_deps_scan(Unit *unit, const Token *tokens) {
+  Linker *linker = unit->linker;
+
+  unit->deps_count = 0;
+  for (size_t i = 0; tokens[i].type != Token_EOF; i++) {
+    if (tokens[i].type != Token_Import || tokens[i + 1].type != Token_Quote ||
+        tokens[i + 2].type != Token_Literal)
+      continue;
+
+    const Sv path = {.str = tokens[i + 2].start, .len = tokens[i + 2].len};
+    if (unit->deps_count >= UNIT_DEPS_CAP)
+      compile_error_raise(linker->error, 14,
+                          "Cannot import %.*s: over %d imports", path.len,
+                          path.str, UNIT_DEPS_CAP);
+
+    Unit *dep = linker_unit_get(linker, path);
+    linker_unit_scan(dep);
+    unit->deps[unit->deps_count++] = dep;
+  }
+}
+
+// Marks unit pending if its file or anything it imports changed since it
+// was last compiled. Only the files that changed are read and lexed; the
+// others' imports are known from last time.
+static void linker_unit_scan(Unit *unit) {
+  Linker *linker = unit->linker;
+  if (unit->scanned == linker->scans) {
+    if (unit->loading)
+      compile_error_raise(linker->error, 14, "Import cycle through %s",
+                          unit->path);
+    return;
+  }
+
+  struct stat st;
+  if (stat(unit->path, &st) != 0)
+    compile_error_raise(linker->error, 14, "Cannot import %s: no such file",
+                        unit->path);
+
+  unit->scanned = linker->scans;
+  unit->loading = 1;
+
+  unit->pending = unit->ir == NULL || unit->mtime.tv_sec != st.st_mtim.tv_sec ||
+                  unit->mtime.tv_nsec != st.st_mtim.tv_nsec;
+  if (unit->pending) {
+    char *code = linker_code_load(unit->path);
+    if (code == NULL)
+      compile_error_raise(linker->error, 14,
+                          "Cannot import %s: unreadable or over %d bytes",
+                          unit->path, UNIT_CODE_CAP - 1);
+
+    // Its ir is stale from here on, even if compiling it fails
+    linker_unit_fini(unit);
+    free(unit->code);
+    unit->code = code;
+    unit->mtime = st.st_mtim;
+    linker_unit_lex(unit);
+    linker_unit_deps_scan(unit, unit->lexer->tokens);
+  } else {
+    for (size_t i = 0; i < unit->deps_count; i++) {
+      Unit *dep = unit->deps[i];
+      linker_unit_scan(dep);
+      if (dep->pending || dep->stamp != unit->deps_stamps[i])
+        unit->pending = 1;
+    }
+    if (unit->pending)
+      linker_unit_lex(unit);
+  }
+
+  unit->loading = 0;
+}
+
+// Compiles a pending unit from the tokens its scan left; everything it
+// imports was compiled by then. Runs on a worker, so a compile error is
+// kept in the unit for the thread that started the wave to raise.
+static void linker_unit_compile(Unit *unit) {
+  linker_unit_fini(unit);
+  unit->deps_count = 0;
+  unit->imports_count = 0;
+  unit->error.code = 0;
+
+  Compiler *compiler = (Compiler *)calloc(1, sizeof(Compiler));
+  if (compiler == NULL) {
+    unit->error.code = 14;
+    snprintf(unit->error.message, sizeof(unit->error.message),
+             "Cannot import %s: %s", unit->path,
+             vm_err_to_str(VM_OUT_OF_MEMORY));
+    return;
+  }
+
+  jmp_buf recover;
+  unit->error.recover = &recover;
+  compiler_init(compiler);
+  compiler->error = &unit->error;
+  compiler->passes = unit->linker->passes;
+  compiler->import = linker_import;
+  compiler->import_ctx = unit;
+  if (setjmp(recover) == 0) {
+    compiler_compile(compiler, unit->lexer->tokens);
+    linker_unit_end(unit, compiler);
+  }
+  unit->error.recover = NULL;
+
+  compiler_destruct(compiler);
+  free(compiler);
+  free(unit->lexer);
+  unit->lexer = NULL;
+}
+
+static void linker_unit_job(void *ctx, size_t worker, size_t job) {
+  (void)worker;
+  linker_unit_compile(((Unit **)ctx)[job]);
+}
+
+// Compiles the pending units in waves, each wave being the units none of
+// whose imports is still pending, on one thread per unit up to one per
+// core. Units only touch themselves and the earlier waves' units then.
+static void linker_units_compile(Linker *linker) {
+  Unit *pending[LINKER_UNITS_CAP];
+  size_t pending_count = 0;
+  for (size_t i = 0; i < linker->units_count; i++) {
+    Unit *unit = linker->units[i];
+    if (unit->scanned == linker->scans && unit->pending)
+      pending[pending_count++] = unit;
+  }
+
+  size_t workers_count = pool_workers_default();
+  while (pending_count > 0) {
+    Unit *wave[LINKER_UNITS_CAP];
+    size_t wave_count = 0;
+    size_t rest_count = 0;
+    for (size_t i = 0; i < pending_count; i++) {
+      Unit *unit = pending[i];
+      int ready = 1;
+      for (size_t j = 0; j < unit->deps_count && ready; j++) {
+        ready = !unit->deps[j]->pending;
+      }
+
+      if (ready)
+        wave[wave_count++] = unit;
+      else
+        pending[rest_count++] = unit;
+    }
+
+    size_t workers = workers_count < wave_count ? workers_count : wave_count;
+    if (workers < 2 ||
+        pool_run(workers, wave_count, linker_unit_job, wave) != 0) {
+      for (size_t i = 0; i < wave_count; i++) {
+        linker_unit_compile(wave[i]);
+      }
+    }
+
+    // Stamps are handed out in a fixed order, however the wave ran, and
+    // the first failure in that order is raised. Units that failed stay
+    // without an ir, and so pending for the next scan.
+    Unit *failed = NULL;
+    for (size_t i = 0; i < wave_count; i++) {
+      if (wave[i]->error.code != 0) {
+        failed = failed != NULL ? failed : wave[i];
+        continue;
+      }
+      wave[i]->stamp = ++linker->stamps;
+      wave[i]->pending = 0;
+    }
+    if (failed != NULL)
+      compile_error_raise(linker->error, failed->error.code, "%s",
+                          failed->error.message);
+    pending_count = rest_count;
+  }
+}
+
+void linker_unit_begin(Linker *linker, Unit *root, Compiler *compiler,
+                       const Token *tokens) {
+  root->linker = linker;
+  linker->scans++;
+  linker_unit_deps_scan(root, tokens);
+  linker_units_compile(linker);
+
+  root->deps_count = 0;
+  root->imports_count = 0;
+  compiler->import = linker_import;
+  compiler->import_ctx = root;
+}
+
+// Every Fn the imported unit declares becomes callable in the importer
+static void linker_import(void *ctx, Compiler *compiler, Sv path) {
+  Unit *importer = (Unit *)ctx;
+
+  Unit *unit = linker_unit_find(importer->linker, path);
+  if (unit == NULL || unit->ir == NULL)
+    compile_error_raise(compiler->error, 14, "Cannot import %.*s: not scanned",
+                        path.len, path.str);
+
+  if (importer->deps_count >= UNIT_DEPS_CAP ||
+      compiler->imports_count + unit->fns_count > FN_CAP)
+    compile_error_raise(compiler->error, 14,
+                        "Cannot import %.*s: over %d imports or %d Fns",
+                        path.len, path.str, UNIT_DEPS_CAP, FN_CAP);
+  importer->deps[importer->deps_count] = unit;
+  importer->deps_stamps[importer->deps_count++] = unit->stamp;
+
+  for (uint8_t i = 0; i < unit->fns_count; i++) {
+    Fn fn = unit->fns[i];
+    fn.label_pos = COMPILER_IMPORTED(compiler->imports_count);
+
+    importer->imports[compiler->imports_count] = (Unit_import){
+        .unit = unit,
+        .fn = i,
+    };
+    compiler->imports[compiler->imports_count++] = fn;
+  }
+  importer->imports_count = compiler->imports_count;
+}
+
+static void linker_unit_place(Linker *linker, Unit *unit, Unit **order,
+                              size_t *order_count, uint64_t *base) {
+  if (unit->placed == linker->links)
+    return;
+  unit->placed = linker->links;
+
+  for (size_t i = 0; i < unit->deps_count; i++) {
+    linker_unit_place(linker, unit->deps[i], order, order_count, base);
+  }
+
+  unit->base = *base;
+  *base += unit->ir->insts_count;
+  order[(*order_count)++] = unit;
+}
+
+int linker_link(Linker *linker, Unit *root, Ir *ir, Fn *fns,
+                uint8_t *fns_count) {
+  Unit *order[LINKER_UNITS_CAP + 1];
+  size_t order_count = 0;
+  uint64_t base = 0;
+
+  linker->links++;
+  linker_unit_place(linker, root, order, &order_count, &base);
+
+  size_t count = 0;
+  for (size_t i = 0; i < order_count; i++) {
+    count += order[i]->fns_count;
+  }
+  if (base + 1 >= INSTS_CAP || count > FN_CAP)
+    return 0;
+
+  *fns_count = 0;
+  for (size_t i = 0; i < order_count; i++) {
+    const Unit *unit = order[i];
+    Inst *insts = &ir->insts[unit->base];
+    memcpy(insts, unit->ir->insts, unit->ir->insts_count * sizeof(Inst));
+
+    for (size_t j = 0; j < unit->relocs_count; j++) {
+      Word *operand = &insts[unit->relocs[j]].operand;
+      if (operand->as_u64 < INSTS_CAP) {
+        operand->as_u64 += unit->base;
+        continue;
+      }
+
+      const Unit_import *target = &unit->imports[operand->as_u64 - INSTS_CAP];
+      operand->as_u64 =
+          target->unit->base + target->unit->fns[target->fn].label_pos;
+    }
+
+    for (size_t j = 0; j < unit->fns_count; j++) {
+      fns[*fns_count] = unit->fns[j];
+      fns[(*fns_count)++].label_pos += unit->base;
+    }
+  }
+
+  ir->insts[base] = MAKE_EOF;
+  ir->insts_count = base + 1;
+  return 1;
+}
@@ -0,0 +1,104 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "lexer.h"
+#include "vm.h"
+
+// Files imported across every load of one linker
+#define LINKER_UNITS_CAP 64
+// Imports per file
+#define UNIT_DEPS_CAP 16
+
+typedef struct Linker Linker;
+typedef struct Unit Unit;
+
+// Where a call to an imported Fn goes: the unit defining it and the Fn's
+// index among that unit's own
+typedef struct {
+  Unit *unit;
+  uint8_t fn;
+} Unit_import;
+
+// One file compiled on its own. Addresses in its ir count from its first
+// inst and calls to imported Fns target COMPILER_IMPORTED(i), both being
+// fixed up by the linker; globals are found by name at run time and need
+// no fixing up.
+struct Unit {
+  Linker *linker;
+  // NULL for code that was loaded rather than imported
+  char *path;
+  // Tokens, Fn labels and the program's names point into it
+  char *code;
+  struct timespec mtime;
+
+  // Without its eof: units run one after the other
+  Ir *ir;
+  Fn fns[FN_CAP];
+  uint8_t fns_count;
+  Unit_import imports[FN_CAP];
+  uint8_t imports_count;
+
+  // Positions of the insts whose operands are addresses
+  uint64_t relocs[INSTS_CAP];
+  uint64_t relocs_count;
+
+  // Units imported, with the stamps they had then; a unit is recompiled
+  // whenever its file or any of its imports changed
+  Unit *deps[UNIT_DEPS_CAP];
+  uint64_t deps_stamps[UNIT_DEPS_CAP];
+  uint8_t deps_count;
+  uint64_t stamp;
+
+  // Set by the scan that found the unit to compile afresh, along with the
+  // tokens to compile, and cleared once compiled
+  Lexer *lexer;
+  // What stopped its last compile, if code is set
+  Compile_error error;
+  uint8_t pending;
+  uint8_t loading;
+  uint64_t scanned;
+  // Where the last link placed it, and the link that did
+  uint64_t base;
+  uint64_t placed;
+};
+
+// Caches every unit it compiled, so that loading a program again only
+// recompiles the files that changed
+struct Linker {
+  Unit *units[LINKER_UNITS_CAP];
+  size_t units_count;
+  uint64_t stamps;
+  uint64_t scans;
+  uint64_t links;
+  // NULL until set; see Compile_error
+  Compile_error *error;
+  // The compiler passes units are compiled with, COMPILER_PASSES unless set
+  unsigned passes;
+};
+
+void linker_init(Linker *linker);
+void linker_destruct(Linker *linker);
+
+// Readies compiler, about to compile tokens of code that is not a file, to
+// import on behalf of root; linker_unit_end then takes the result. Every
+// file tokens import, directly or not, that changed is compiled first,
+// files that do not import one another in parallel.
+void linker_unit_begin(Linker *linker, Unit *root, Compiler *compiler,
+                       const Token *tokens);
+// Takes compiler's ir, leaving it without one, and Fns into unit
+void linker_unit_end(Unit *unit, Compiler *compiler);
+// Frees what linker_unit_end took
+void linker_unit_fini(Unit *unit);
+
+// Lays out root after everything it imports, each unit once and after its
+// own imports, fixing up their addresses, into ir and fns; 0 if the result
+// would not fit
+int linker_link(Linker *linker, Unit *root, Ir *ir, Fn *fns,
+                uint8_t *fns_count);
+
+#endif
@@ -1,21 +1,30 @@
+// open_memstream, fdopen and the socket calls
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-#include "analyzer.h"
-#include "compiler.h"
-#include "lexer.h"
+#include "noah.h"
+#include "pool.h"
 #include "vm.h"
 
 #define CODE_CAP 1024
 
-static void load_code_from_file(const char *file_path, char *buf) {
+static int load_code_from_file(const char *file_path, char *buf) {
 #define NULL_TERMINATE(str)                                                    \
   do {                                                                         \
     str[strlen(str) - 1] = '\0';                                               \
   } while (0)
 
   FILE *file = fopen(file_path, "rb");
+  if (file == NULL)
+    return 0;
 
   if (fseek(file, 0, SEEK_END) < 0) {
     printf("ERROR: fseek");
@@ -27,6 +36,10 @@ static void load_code_from_file(const char *file_path, char *buf) {
     printf("ERROR: ftell");
     goto close;
   }
+  if (m >= CODE_CAP) {
+    printf("ERROR: %s is over %d bytes", file_path, CODE_CAP - 1);
+    goto close;
+  }
 
   if (fseek(file, 0, SEEK_SET) < 0) {
     printf("ERROR: fseek");
@@ -42,47 +55,632 @@ static void load_code_from_file(const char *file_path, char *buf) {
   NULL_TERMINATE(buf);
 
   fclose(file);
-  return;
+  return 1;
 
 close:
   if (file)
     fclose(file);
+  return 0;
 #undef NULL_TERMINATE
 }
 
-extern Lexer lexer;
-extern Compiler compiler;
-extern Analyzer analyzer;
-extern Vm vm;
+// Reports code that did not load on out; 0 if there was nothing to report
+static int load_report(Noah *noah, Err err, FILE *out) {
+  if (err == VM_OK)
+    return 0;
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "USAGE: ./main <file.c>");
+  fprintf(out, "ERROR: %s\n",
+          err == VM_COMPILE_ERROR ? noah_error(noah, NULL)
+                                  : vm_err_to_str(err));
+  return 1;
+}
+
+// Reports a failed run on out; 0 if there was nothing to report
+static int run_report(Noah *noah, Err err, FILE *out) {
+  if (err == VM_OK)
+    return 0;
+  if (err == VM_COMPILE_ERROR)
+    return load_report(noah, err, out);
+
+  Vm *vm = noah_vm(noah);
+  fprintf(out, "ERROR: %s at %lld, call depth %zu\n", vm_err_to_str(err),
+          (long long)(vm->reg[REG_IP].as_u64 - 1),
+          (size_t)vm_call_depth(vm));
+  return 1;
+}
+
+typedef struct {
+  char **paths;
+  size_t paths_count;
+
+  // Captured per script, emitted in order once all have run
+  char **outs;
+  size_t *outs_len;
+  int *failed;
+
+  // Reused by every script its worker runs
+  Noah **noahs;
+
+  // Scripts run in rounds, each taking at most slice backward jumps per
+  // round; one that runs out keeps its noah and output for the next
+  uint64_t slice;
+  size_t *pending;
+  Noah **suspended;
+  FILE **streams;
+} Batch;
+
+// Gives a finished script's noah back to its worker, whose own may have
+// gone to a script that got suspended
+static void batch_noah_release(Batch *batch, size_t worker, Noah *noah) {
+  noah_output_set(noah, stdout);
+  if (batch->noahs[worker] == NULL)
+    batch->noahs[worker] = noah;
+  else if (batch->noahs[worker] != noah)
+    noah_destruct(noah);
+}
+
+static void batch_job(void *ctx, size_t worker, size_t pending) {
+  Batch *batch = (Batch *)ctx;
+  size_t job = batch->pending[pending];
+
+  Noah *noah = batch->suspended[job];
+  FILE *out = batch->streams[job];
+  if (noah != NULL) {
+    batch->suspended[job] = NULL;
+    batch->streams[job] = NULL;
+    goto run;
+  }
+
+  out = open_memstream(&batch->outs[job], &batch->outs_len[job]);
+  if (out == NULL) {
+    batch->failed[job] = 1;
+    return;
+  }
+
+  char code[CODE_CAP] = {0};
+  if (!load_code_from_file(batch->paths[job], code)) {
+    fprintf(out, "ERROR: could not read %s\n", batch->paths[job]);
+    batch->failed[job] = 1;
+    fclose(out);
+    return;
+  }
+
+  noah = batch->noahs[worker];
+  if (noah == NULL)
+    noah = batch->noahs[worker] = noah_new();
+  else
+    noah_reset(noah);
+  if (noah == NULL) {
+    fprintf(out, "ERROR: %s\n", vm_err_to_str(VM_OUT_OF_MEMORY));
+    batch->failed[job] = 1;
+    fclose(out);
+    return;
+  }
+
+  // A script that does not compile fails alone; its worker's noah is
+  // reset for the next one
+  noah_output_set(noah, out);
+  if (load_report(noah, noah_load(noah, code), out)) {
+    batch->failed[job] = 1;
+    batch_noah_release(batch, worker, noah);
+    fclose(out);
+    return;
+  }
+
+run:
+  noah_fuel_set(noah, batch->slice);
+  Err err = noah_run(noah);
+  if (err == VM_OUT_OF_FUEL && batch->slice != UINT64_MAX) {
+    if (batch->noahs[worker] == noah)
+      batch->noahs[worker] = NULL;
+    batch->suspended[job] = noah;
+    batch->streams[job] = out;
+    return;
+  }
+
+  batch->failed[job] = run_report(noah, err, out);
+  if (!batch->failed[job]) {
+    vm_stack_dump(noah_vm(noah));
+    vm_memo_dump(noah_vm(noah));
+  }
+
+  batch_noah_release(batch, worker, noah);
+  fclose(out);
+}
+
+// Runs rounds until no script is left suspended, doubling the slice each
+// round so that any script that terminates at all gets to; 0 if the pool
+// failed
+static int batch_rounds(Batch *batch, size_t workers_count) {
+  size_t pending_count = batch->paths_count;
+  for (size_t i = 0; i < pending_count; i++) {
+    batch->pending[i] = i;
+  }
+
+  while (pending_count > 0) {
+    if (pool_run(workers_count, pending_count, batch_job, batch) != 0)
+      return 0;
+
+    pending_count = 0;
+    for (size_t i = 0; i < batch->paths_count; i++) {
+      if (batch->suspended[i] != NULL)
+        batch->pending[pending_count++] = i;
+    }
+    batch->slice =
+        batch->slice > UINT64_MAX / 2 ? UINT64_MAX : batch->slice * 2;
+  }
+  return 1;
+}
+
+// Runs every script on its own worker's vm and prints their outputs in the
+// order given; 13 if any of them failed
+static int batch_run(char **paths, size_t paths_count, size_t workers_count,
+                     uint64_t slice) {
+  Batch batch = {
+      .paths = paths,
+      .paths_count = paths_count,
+      .outs = (char **)calloc(paths_count, sizeof(char *)),
+      .outs_len = (size_t *)calloc(paths_count, sizeof(size_t)),
+      .failed = (int *)calloc(paths_count, sizeof(int)),
+      .noahs = (Noah **)calloc(workers_count, sizeof(Noah *)),
+      .slice = slice,
+      .pending = (size_t *)calloc(paths_count, sizeof(size_t)),
+      .suspended = (Noah **)calloc(paths_count, sizeof(Noah *)),
+      .streams = (FILE **)calloc(paths_count, sizeof(FILE *)),
+  };
+  if ((paths_count > 0 &&
+       (batch.outs == NULL || batch.outs_len == NULL ||
+        batch.failed == NULL || batch.pending == NULL ||
+        batch.suspended == NULL || batch.streams == NULL)) ||
+      batch.noahs == NULL || !batch_rounds(&batch, workers_count)) {
+    fprintf(stderr, "ERROR: %s\n", vm_err_to_str(VM_OUT_OF_MEMORY));
+    exit(13);
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < paths_count; i++) {
+    printf("==> %s <==\n", paths[i]);
+    if (batch.outs[i] != NULL)
+      fwrite(batch.outs[i], 1, batch.outs_len[i], stdout);
+    if (batch.failed[i])
+      status = 13;
+    free(batch.outs[i]);
+  }
+
+  for (size_t i = 0; i < workers_count; i++) {
+    noah_destruct(batch.noahs[i]);
+  }
+  free(batch.outs);
+  free(batch.outs_len);
+  free(batch.failed);
+  free(batch.noahs);
+  free(batch.pending);
+  free(batch.suspended);
+  free(batch.streams);
+  return status;
+}
+
+// A manifest lists one script path per line
+static size_t manifest_load(const char *manifest_path, char ***paths) {
+  FILE *file = fopen(manifest_path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: could not read %s\n", manifest_path);
     exit(1);
   }
 
-  char *code_path = argv[1];
+  size_t count = 0;
+  size_t cap = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_cap, file)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      *paths = (char **)realloc(*paths, cap * sizeof(char *));
+    }
+    (*paths)[count++] = strdup(line);
+  }
+
+  free(line);
+  fclose(file);
+  return count;
+}
+
+static int serve_socket(const char *socket_path, struct sockaddr_un *addr) {
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "ERROR: socket path %s is too long\n", socket_path);
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    perror("ERROR: socket");
+  return fd;
+}
+
+// The child serving a request: resumes its copy of the warm vm with the
+// program's output and any error going to the client
+static void serve_request(Noah *noah, int conn) {
+  FILE *out = fdopen(conn, "w");
+  if (out == NULL)
+    _exit(13);
+
+  noah_output_set(noah, out);
+  noah_fuel_set(noah, UINT64_MAX);
+  Err err = noah_run(noah);
+  int failed = run_report(noah, err, out);
+  if (!failed) {
+    vm_stack_dump(noah_vm(noah));
+    vm_memo_dump(noah_vm(noah));
+  }
+
+  fclose(out);
+  _exit(failed ? 13 : 0);
+}
+
+// Forks the warm process once per connection, so every request starts
+// from the same copy-on-write state and none sees another's effects
+static int serve_run(Noah *noah, const char *socket_path) {
+  struct sockaddr_un addr;
+  int server = serve_socket(socket_path, &addr);
+  if (server < 0)
+    return 13;
+
+  unlink(socket_path);
+  if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server, SOMAXCONN) != 0) {
+    perror("ERROR: bind");
+    close(server);
+    return 13;
+  }
+
+  // Children are reaped as they exit; a request's status goes to its client
+  signal(SIGCHLD, SIG_IGN);
+  fflush(stdout);
+  fflush(stderr);
+
+  while (1) {
+    int conn = accept(server, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("ERROR: accept");
+      break;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(server);
+      serve_request(noah, conn);
+    }
+    if (pid < 0)
+      perror("ERROR: fork");
+    close(conn);
+  }
+
+  close(server);
+  unlink(socket_path);
+  return 13;
+}
+
+// Copies a served run's output to stdout; 13 if it ended in an error,
+// which is always the last line
+static int request_main(const char *socket_path) {
+  struct sockaddr_un addr;
+  int fd = serve_socket(socket_path, &addr);
+  if (fd < 0)
+    return 13;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("ERROR: connect");
+    close(fd);
+    return 13;
+  }
+  shutdown(fd, SHUT_WR);
+
+  char buf[4096];
+  char line[8] = {0};
+  size_t line_len = 0;
+  int failed = 0;
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    fwrite(buf, 1, (size_t)len, stdout);
+    for (ssize_t i = 0; i < len; i++) {
+      if (line_len < sizeof(line) - 1)
+        line[line_len++] = buf[i];
+      if (buf[i] != '\n')
+        continue;
+      failed = strncmp(line, "ERROR: ", 7) == 0;
+      line_len = 0;
+    }
+  }
+
+  close(fd);
+  return len < 0 || failed ? 13 : 0;
+}
+
+// 1 if piece is whole statements: brackets balanced outside of string
+// literals, and the last one ended by ; or }. -1 if its last line ends a
+// statement inside an unclosed (, which no later line can mend; else 0
+static int repl_piece_complete(const char *piece) {
+  int depth = 0;
+  int parens = 0;
+  int quoted = 0;
+  char last = '\0';
+  for (const char *c = piece; *c != '\0'; c++) {
+    if (*c == '"')
+      quoted = !quoted;
+    if (quoted)
+      continue;
+    if (*c == '{' || *c == '(')
+      depth++;
+    else if (*c == '}' || *c == ')')
+      depth--;
+    if (*c == '(')
+      parens++;
+    else if (*c == ')')
+      parens--;
+    if (*c != ' ' && *c != '\t' && *c != '\n' && *c != '\r')
+      last = *c;
+  }
+  if (!quoted && parens > 0 && last == ';')
+    return -1;
+  return depth <= 0 && !quoted && (last == ';' || last == '}');
+}
+
+// Reads statements a line at a time, running each complete piece on top
+// of the earlier ones; errors are reported and the session goes on
+static int repl_main(void) {
+  Noah *noah = noah_new();
+  if (noah == NULL) {
+    fprintf(stderr, "ERROR: %s\n", vm_err_to_str(VM_OUT_OF_MEMORY));
+    exit(13);
+  }
+
+  int interactive = isatty(STDIN_FILENO);
+  char piece[CODE_CAP] = {0};
+  size_t piece_len = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  while (1) {
+    if (interactive) {
+      fputs(piece_len == 0 ? "> " : ". ", stdout);
+      fflush(stdout);
+    }
+    if ((len = getline(&line, &line_cap, stdin)) == -1)
+      break;
+
+    if (piece_len + (size_t)len >= CODE_CAP) {
+      fprintf(stderr, "ERROR: piece is over %d bytes\n", CODE_CAP - 1);
+      piece_len = 0;
+      piece[0] = '\0';
+      continue;
+    }
+    memcpy(piece + piece_len, line, (size_t)len + 1);
+    piece_len += (size_t)len;
+    int complete = repl_piece_complete(piece);
+    if (complete == 0)
+      continue;
+
+    if (complete < 0)
+      fprintf(stderr, "ERROR: statement ends inside an unclosed (\n");
+    else
+      run_report(noah, noah_eval(noah, piece), stderr);
+    fflush(stdout);
+    piece_len = 0;
+    piece[0] = '\0';
+  }
+
+  if (piece_len > 0)
+    run_report(noah, noah_eval(noah, piece), stderr);
+
+  free(line);
+  noah_destruct(noah);
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  unsigned pass;
+} pass_names[] = {
+    {"tail", NOAH_PASS_TAIL},
+    {"fold", NOAH_PASS_FOLD},
+    {"inline", NOAH_PASS_INLINE},
+    {"memo", NOAH_PASS_MEMO},
+    {"vectorize", NOAH_PASS_VECTORIZE},
+    {"unroll", NOAH_PASS_UNROLL},
+    {"loops", NOAH_PASS_LOOPS},
+    {"cse", NOAH_PASS_CSE},
+    {"dse", NOAH_PASS_DSE},
+    {"ranges", NOAH_PASS_RANGES},
+};
+
+// all, none, or a comma-separated list of the passes to make, or of the
+// passes to skip with each name prefixed by '-'; 0 if it names no pass
+static int passes_parse(const char *list, unsigned *passes) {
+  if (strcmp(list, "all") == 0 || strcmp(list, "none") == 0) {
+    *passes = strcmp(list, "all") == 0 ? NOAH_PASSES : 0;
+    return 1;
+  }
+
+  int skip = list[0] == '-';
+  *passes = skip ? NOAH_PASSES : 0;
+  while (*list != '\0') {
+    if ((list[0] == '-') != skip)
+      return 0;
+    list += skip;
+
+    size_t len = strcspn(list, ",");
+    size_t i = 0;
+    size_t names_count = sizeof(pass_names) / sizeof(pass_names[0]);
+    while (i < names_count && (strlen(pass_names[i].name) != len ||
+                               strncmp(pass_names[i].name, list, len) != 0))
+      i++;
+    if (i == names_count)
+      return 0;
+
+    if (skip)
+      *passes &= ~pass_names[i].pass;
+    else
+      *passes |= pass_names[i].pass;
+    list += len + (list[len] == ',');
+  }
+  return 1;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "USAGE: ./main [--passes <list>] [--fuel <jumps>] [--save <image>] "
+          "<file.c>\n"
+          "       ./main [--fuel <jumps>] [--save <image>] --load <image>\n"
+          "       ./main --batch [-j <workers>] [-s <slice>] <file.c>...\n"
+          "       ./main --batch [-j <workers>] [-s <slice>] @<manifest>\n"
+          "       ./main [--passes <list>] [--fuel <jumps>] [--load <image>] "
+          "--serve <socket> [<file.c>]\n"
+          "       ./main --request <socket>\n"
+          "       ./main --repl\n"
+          "<list> is all, none, or passes separated by commas, each "
+          "prefixed by '-' to\n"
+          "skip it instead: tail, fold, inline, memo, vectorize, unroll, "
+          "loops, cse,\n"
+          "dse, ranges\n");
+  exit(1);
+}
+
+static int batch_main(int argc, char **argv) {
+  size_t workers_count = pool_workers_default();
+  int i = 2;
+  if (i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+    workers_count = (size_t)strtoull(argv[i + 1], NULL, 10);
+    if (workers_count == 0)
+      usage();
+    i += 2;
+  }
+  uint64_t slice = UINT64_MAX;
+  if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+    slice = (uint64_t)strtoull(argv[i + 1], NULL, 10);
+    if (slice == 0)
+      usage();
+    i += 2;
+  }
+  if (i >= argc)
+    usage();
+
+  if (argv[i][0] != '@')
+    return batch_run(&argv[i], (size_t)(argc - i), workers_count, slice);
+
+  char **paths = NULL;
+  size_t paths_count = manifest_load(&argv[i][1], &paths);
+  int status = batch_run(paths, paths_count, workers_count, slice);
+  for (size_t j = 0; j < paths_count; j++) {
+    free(paths[j]);
+  }
+  free(paths);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+    return batch_main(argc, argv);
+  if (argc == 3 && strcmp(argv[1], "--request") == 0)
+    return request_main(argv[2]);
+  if (argc == 2 && strcmp(argv[1], "--repl") == 0)
+    return repl_main();
+
+  // Running out of fuel is an error here unless the run is saved, to be
+  // resumed from the image with --load
+  uint64_t fuel = UINT64_MAX;
+  char *save_path = NULL;
+  char *load_path = NULL;
+  char *serve_path = NULL;
+  unsigned passes = NOAH_PASSES;
+  int i = 1;
+  for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+    if (strcmp(argv[i], "--fuel") == 0) {
+      fuel = (uint64_t)strtoull(argv[i + 1], NULL, 10);
+      if (fuel == 0)
+        usage();
+    } else if (strcmp(argv[i], "--save") == 0) {
+      save_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--load") == 0) {
+      load_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      serve_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--passes") == 0) {
+      if (!passes_parse(argv[i + 1], &passes))
+        usage();
+    } else {
+      usage();
+    }
+  }
+  if (argc != i + (load_path == NULL))
+    usage();
 
   char code[CODE_CAP] = {0};
-  load_code_from_file(code_path, code);
+  if (load_path == NULL && !load_code_from_file(argv[i], code)) {
+    fprintf(stderr, "ERROR: could not read %s\n", argv[i]);
+    exit(1);
+  }
 
   /*printf("Code: \n%s\n\n", code);*/
 
-  lexer_init_with_code(code);
-  lexer_lex();
-  /*lexer_tokens_dump(lexer.tokens);*/
+  Noah *noah = noah_new();
+  if (noah == NULL) {
+    fprintf(stderr, "ERROR: %s\n", vm_err_to_str(VM_OUT_OF_MEMORY));
+    exit(13);
+  }
+  noah_passes_set(noah, passes);
+  if (load_path == NULL) {
+    Err err = noah_load(noah, code);
+    if (err == VM_COMPILE_ERROR) {
+      int status;
+      fputs(noah_error(noah, &status), stderr);
+      exit(status);
+    }
+    if (load_report(noah, err, stderr))
+      exit(13);
+  } else {
+    Err err = noah_image_load(noah, load_path);
+    if (err != VM_OK) {
+      fprintf(stderr, "ERROR: %s: %s\n", load_path, vm_err_to_str(err));
+      exit(13);
+    }
+  }
+  noah_fuel_set(noah, fuel);
 
-  Compiler compiler;
-  compiler_init(&compiler);
-  compiler_compile(&compiler, lexer.tokens);
+  // A server warms the script up by running it as far as --fuel goes, if
+  // given, and has every request resume it from there
+  if (serve_path != NULL) {
+    Err err = fuel == UINT64_MAX ? VM_OUT_OF_FUEL : noah_run(noah);
+    if (err == VM_OUT_OF_FUEL)
+      return serve_run(noah, serve_path);
+    if (!run_report(noah, err, stderr))
+      fprintf(stderr, "ERROR: the script ended while warming up\n");
+    exit(13);
+  }
 
-  analyzer_ir_load(compiler.ir->insts);
-  analyzer_analyze_dse();
+  Err err = noah_run(noah);
+  if (err == VM_OUT_OF_FUEL && save_path != NULL) {
+    err = noah_image_save(noah, save_path);
+    if (err != VM_OK) {
+      fprintf(stderr, "ERROR: %s: %s\n", save_path, vm_err_to_str(err));
+      exit(13);
+    }
+    noah_destruct(noah);
+    return 0;
+  }
 
-  vm_init();
-  vm_program_load_from_memory(compiler.ir->insts, compiler.ir->insts_count);
-  /*vm_program_dump();*/
-  vm_execute();
-  vm_stack_dump();
-  vm_destruct();
+  if (run_report(noah, err, stderr))
+    exit(13);
+  vm_stack_dump(noah_vm(noah));
+  vm_memo_dump(noah_vm(noah));
+  noah_destruct(noah);
 }
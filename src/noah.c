@@ -0,0 +1,283 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyzer.h"
+#include "compiler.h"
+#include "lexer.h"
+#include "linker.h"
+#include "noah.h"
+#include "pool.h"
+#include "vm.h"
+
+struct Noah {
+  // Tokens and the program's string operands point into it
+  char *code;
+  // Every piece noah_eval compiled, for the same reason
+  char **pieces;
+  size_t pieces_count;
+  // Where the program's output and the dumps go
+  FILE *out;
+
+  Lexer lexer;
+  Compiler compiler;
+  Analyzer analyzer;
+  Vm vm;
+
+  // Units imported by any code loaded so far, kept across resets; code
+  // that imports some is linked with them into linked and fns
+  Linker linker;
+  Unit root;
+  Ir *linked;
+  Fn fns[FN_CAP];
+
+  // Where compiling the code given to noah_load or noah_eval stopped, if
+  // it did
+  Compile_error error;
+  // Noah_pass flags
+  unsigned passes;
+};
+
+static unsigned noah_compiler_passes(const unsigned passes) {
+  return ((passes & NOAH_PASS_TAIL) ? COMPILER_TAIL_CALLS : 0) |
+         ((passes & NOAH_PASS_FOLD) ? COMPILER_FOLD_CALLS : 0);
+}
+
+static void noah_init(Noah *noah) {
+  compiler_init(&noah->compiler);
+  noah->compiler.error = &noah->error;
+  noah->compiler.passes = noah_compiler_passes(noah->passes);
+  vm_init(&noah->vm);
+  noah->vm.out = noah->out;
+  noah->analyzer.out = noah->out;
+}
+
+static void noah_fini(Noah *noah) {
+  vm_destruct(&noah->vm);
+  compiler_destruct(&noah->compiler);
+  free(noah->code);
+  noah->code = NULL;
+  linker_unit_fini(&noah->root);
+  free(noah->linked);
+  noah->linked = NULL;
+  for (size_t i = 0; i < noah->pieces_count; i++) {
+    free(noah->pieces[i]);
+  }
+  free(noah->pieces);
+  noah->pieces = NULL;
+  noah->pieces_count = 0;
+}
+
+Noah *noah_new(void) {
+  Noah *noah = (Noah *)calloc(1, sizeof(Noah));
+  if (noah == NULL)
+    return NULL;
+
+  noah->out = stdout;
+  noah->passes = NOAH_PASSES;
+  linker_init(&noah->linker);
+  noah->linker.error = &noah->error;
+  noah_init(noah);
+  pool_acquire();
+  return noah;
+}
+
+void noah_destruct(Noah *noah) {
+  if (noah == NULL)
+    return;
+
+  noah_fini(noah);
+  linker_destruct(&noah->linker);
+  free(noah);
+  pool_release();
+}
+
+void noah_reset(Noah *noah) {
+  noah_fini(noah);
+  noah_init(noah);
+}
+
+void noah_output_set(Noah *noah, FILE *out) {
+  noah->out = out;
+  noah->vm.out = out;
+  noah->analyzer.out = out;
+}
+
+void noah_passes_set(Noah *noah, unsigned passes) {
+  noah->passes = passes;
+  noah->compiler.passes = noah_compiler_passes(passes);
+
+  // Imported units compiled with other passes are compiled again
+  if (noah->linker.passes != noah->compiler.passes) {
+    linker_destruct(&noah->linker);
+    noah->linker.passes = noah->compiler.passes;
+  }
+}
+
+Err noah_load(Noah *noah, const char *code) {
+  size_t len = strlen(code);
+  noah->code = (char *)malloc(len + 1);
+  if (noah->code == NULL)
+    return VM_OUT_OF_MEMORY;
+  memcpy(noah->code, code, len + 1);
+
+  // Everything compiling allocates is held by noah, which a reset frees
+  jmp_buf recover;
+  noah->error.recover = &recover;
+  if (setjmp(recover) != 0) {
+    noah->error.recover = NULL;
+    return VM_COMPILE_ERROR;
+  }
+
+  lexer_init_with_code(&noah->lexer, noah->code);
+  noah->lexer.error = &noah->error;
+  lexer_lex(&noah->lexer);
+  /*lexer_tokens_dump(&noah->lexer);*/
+
+  Compiler *compiler = &noah->compiler;
+  linker_unit_begin(&noah->linker, &noah->root, compiler,
+                    noah->lexer.tokens);
+  compiler_compile(compiler, noah->lexer.tokens);
+
+  // The analyzer sees the linked program whole, imported Fns included
+  Ir *ir = compiler->ir;
+  Fn *fns = compiler->fn;
+  uint8_t fns_count = compiler->fn_count;
+  if (noah->root.deps_count > 0) {
+    linker_unit_end(&noah->root, compiler);
+    noah->linked = (Ir *)calloc(1, sizeof(Ir));
+    if (noah->linked == NULL || !linker_link(&noah->linker, &noah->root,
+                                             noah->linked, noah->fns,
+                                             &fns_count))
+      compile_error_raise(&noah->error, 10,
+                          "Program is over %d insts or %d Fns", INSTS_CAP - 1,
+                          FN_CAP);
+    ir = noah->linked;
+    fns = noah->fns;
+  }
+  noah->error.recover = NULL;
+
+  Analyzer *analyzer = &noah->analyzer;
+  analyzer_ir_load(analyzer, ir);
+  analyzer_fns_load(analyzer, fns, fns_count);
+  if (noah->passes & NOAH_PASS_INLINE)
+    analyzer_analyze_inline(analyzer);
+  if (noah->passes & NOAH_PASS_MEMO)
+    analyzer_analyze_memo(analyzer);
+  if (noah->passes & NOAH_PASS_VECTORIZE)
+    analyzer_analyze_vectorize(analyzer);
+  if (noah->passes & NOAH_PASS_UNROLL)
+    analyzer_analyze_unroll(analyzer);
+  if (noah->passes & NOAH_PASS_LOOPS)
+    analyzer_analyze_loops(analyzer);
+  if (noah->passes & NOAH_PASS_CSE)
+    analyzer_analyze_cse(analyzer);
+  if (noah->passes & NOAH_PASS_DSE)
+    analyzer_analyze_dse(analyzer);
+  if (noah->passes & NOAH_PASS_RANGES)
+    analyzer_analyze_ranges(analyzer);
+
+  vm_program_load_from_memory(&noah->vm, ir->insts, ir->insts_count);
+  /*vm_program_dump(&noah->vm);*/
+  return VM_OK;
+}
+
+const char *noah_error(const Noah *noah, int *code) {
+  if (code != NULL)
+    *code = noah->error.code;
+  return noah->error.message;
+}
+
+// Pieces skip the analyzer: its passes renumber the whole program, which
+// would move code that earlier pieces' Fns and globals already refer to.
+// vm_program_append still verifies each before it runs unchecked.
+Err noah_eval(Noah *noah, const char *code) {
+  char **pieces = (char **)realloc(
+      noah->pieces, (noah->pieces_count + 1) * sizeof(char *));
+  if (pieces == NULL)
+    return VM_OUT_OF_MEMORY;
+  noah->pieces = pieces;
+
+  size_t len = strlen(code);
+  char *piece = (char *)malloc(len + 1);
+  if (piece == NULL)
+    return VM_OUT_OF_MEMORY;
+  memcpy(piece, code, len + 1);
+  noah->pieces[noah->pieces_count++] = piece;
+
+  // A piece that does not compile is dropped whole: the compiler gets back
+  // the Fns and locals it had and the ir its eof, so the session goes on
+  Compiler *compiler = &noah->compiler;
+  Compiler *saved = (Compiler *)malloc(sizeof(Compiler));
+  if (saved == NULL) {
+    free(noah->pieces[--noah->pieces_count]);
+    return VM_OUT_OF_MEMORY;
+  }
+  *saved = *compiler;
+  uint64_t insts_count = compiler->ir->insts_count;
+
+  jmp_buf recover;
+  noah->error.recover = &recover;
+  if (setjmp(recover) != 0) {
+    noah->error.recover = NULL;
+    *compiler = *saved;
+    free(saved);
+    compiler->ir->insts_count = insts_count;
+    if (insts_count > 0)
+      compiler->ir->insts[insts_count - 1] = MAKE_EOF;
+    free(noah->pieces[--noah->pieces_count]);
+    return VM_COMPILE_ERROR;
+  }
+
+  lexer_init_with_code(&noah->lexer, piece);
+  noah->lexer.error = &noah->error;
+  lexer_lex(&noah->lexer);
+
+  uint64_t start = compiler_compile_append(compiler, noah->lexer.tokens);
+  noah->error.recover = NULL;
+  free(saved);
+
+  vm_program_append(&noah->vm, &compiler->ir->insts[start],
+                    compiler->ir->insts_count - start);
+  return vm_execute(&noah->vm);
+}
+
+void noah_fuel_set(Noah *noah, uint64_t fuel) { noah->vm.fuel = fuel; }
+
+Err noah_run(Noah *noah) { return vm_execute(&noah->vm); }
+
+Err noah_image_save(Noah *noah, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return VM_BAD_IMAGE;
+
+  Err err = vm_image_save(&noah->vm, file);
+  if (fclose(file) != 0 && err == VM_OK)
+    err = VM_BAD_IMAGE;
+  if (err != VM_OK)
+    remove(path);
+  return err;
+}
+
+Err noah_image_load(Noah *noah, const char *path) {
+  noah_reset(noah);
+  return vm_image_load(&noah->vm, path);
+}
+
+Err noah_chan_share(Noah *from, const char *name, Noah *to) {
+  Sv label = {.str = (char *)name, .len = (int)strlen(name)};
+  Word *handle = hash_table_get(&from->vm.env, label);
+  if (handle == NULL)
+    return VM_UNDEFINED_GLOBAL;
+
+  Word shared;
+  Err err = vm_chan_share(&from->vm, *handle, &to->vm, &shared);
+  if (err != VM_OK)
+    return err;
+
+  hash_table_insert(&to->vm.env, label, shared);
+  return VM_OK;
+}
+
+Vm *noah_vm(Noah *noah) { return &noah->vm; }
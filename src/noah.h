@@ -0,0 +1,74 @@
+#ifndef NOAH_H
+#define NOAH_H
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// One independent interpreter: its own lexer, compiler, analyzer and vm.
+// Separate instances share no state and may run on separate threads.
+//
+// The first run installs process-wide SIGSEGV and SIGBUS handlers to catch
+// vm stack overflows on a guard page. Handlers the host installed before
+// then keep receiving every other fault, default and ignored dispositions
+// included; handlers installed after then must forward faults to the ones
+// they replace for overflows to be reported as VM_STACK_OVERFLOW.
+typedef struct Noah Noah;
+
+// Optimizations noah_load makes: the first two as it compiles, the others
+// in the analyzer, in this order
+typedef enum {
+  NOAH_PASS_TAIL = 1 << 0,
+  NOAH_PASS_FOLD = 1 << 1,
+  NOAH_PASS_INLINE = 1 << 2,
+  NOAH_PASS_MEMO = 1 << 3,
+  NOAH_PASS_VECTORIZE = 1 << 4,
+  NOAH_PASS_UNROLL = 1 << 5,
+  NOAH_PASS_LOOPS = 1 << 6,
+  NOAH_PASS_CSE = 1 << 7,
+  NOAH_PASS_DSE = 1 << 8,
+  NOAH_PASS_RANGES = 1 << 9,
+  NOAH_PASSES = (1 << 10) - 1,
+} Noah_pass;
+
+// Each noah keeps pool_run's threads parked between runs until it is
+// destructed
+Noah *noah_new(void);
+void noah_destruct(Noah *noah);
+// Drops the loaded program and its run, keeping the allocation for the
+// next noah_load
+void noah_reset(Noah *noah);
+// stdout unless set
+void noah_output_set(Noah *noah, FILE *out);
+// The Noah_pass flags of the optimizations to make, NOAH_PASSES unless
+// set; for a fresh or reset noah. Every pass keeps what the program
+// prints, so any set of them runs it the same.
+void noah_passes_set(Noah *noah, unsigned passes);
+// VM_COMPILE_ERROR if code does not compile, which noah_error describes;
+// noah_reset then readies noah for other code
+Err noah_load(Noah *noah, const char *code);
+// The last compile error's message, and in code the status main exits
+// with for it
+const char *noah_error(const Noah *noah, int *code);
+// Compiles code on to what the earlier calls compiled and runs only the
+// new part, with the globals and Fns they left; for a fresh or reset noah.
+// Code that does not compile is dropped, leaving noah as the earlier calls
+// did, and VM_COMPILE_ERROR returned as for noah_load
+Err noah_eval(Noah *noah, const char *code);
+// Backward jumps the next noah_run may take, unlimited unless set
+void noah_fuel_set(Noah *noah, uint64_t fuel);
+// VM_OUT_OF_FUEL suspends the run; calling again resumes it
+Err noah_run(Noah *noah);
+// Writes the vm as it stands, typically suspended, to the image at path
+Err noah_image_save(Noah *noah, const char *path);
+// Drops what is loaded and restores the vm from the image at path, so
+// that noah_run picks up where the saved run stopped
+Err noah_image_load(Noah *noah, const char *path);
+// Defines the global name in to as the channel the global name of from
+// holds, so that the two, typically run on separate threads, pass words
+// through it; VM_UNDEFINED_GLOBAL if from has no such global. See
+// vm_chan_share.
+Err noah_chan_share(Noah *from, const char *name, Noah *to);
+Vm *noah_vm(Noah *noah);
+
+#endif
@@ -0,0 +1,319 @@
+// sysconf
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define POOL_EMPTY SIZE_MAX
+// A steal that lost a race; the deque may still hold jobs
+#define POOL_ABORT (SIZE_MAX - 1)
+
+// Chase-Lev deque of job numbers: its owner pushes and takes at the
+// bottom, every other worker steals from the top. Top and bottom sit on
+// their own cache lines so thieves do not slow the owner down.
+typedef struct {
+  _Alignas(64) _Atomic int64_t top;
+  _Alignas(64) _Atomic int64_t bottom;
+
+  _Atomic size_t *jobs;
+  int64_t jobs_cap;
+} Pool_deque;
+
+typedef struct {
+  Pool_deque *deques;
+  size_t workers_count;
+
+  Pool_fn fn;
+  void *ctx;
+} Pool;
+
+// The threads every pool_run shares, started as runs first need them and
+// parked between runs for as long as the pool is held
+static struct {
+  pthread_mutex_t lock;
+  // Signalled when a run is handed out and when the threads are to quit
+  pthread_cond_t wake;
+  // Signalled when the last thread working on a run is done with it
+  pthread_cond_t done;
+
+  pthread_t *threads;
+  size_t threads_count;
+  // pool_acquire calls not yet released, and runs under way
+  size_t users;
+  // A run holds the threads, or they are being joined
+  int busy;
+  int quit;
+
+  // The run handed out, NULL between runs
+  Pool *run;
+  // Worker numbers the threads took for it, counting from 1
+  size_t claimed;
+  // Threads yet to finish it
+  size_t active;
+} pool_shared = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void pool_deque_push(Pool_deque *deque, const size_t job) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  if (bottom >= deque->jobs_cap)
+    abort();
+
+  atomic_store_explicit(&deque->jobs[bottom], job, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static size_t pool_deque_take(Pool_deque *deque) {
+  int64_t bottom =
+      atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return POOL_EMPTY;
+  }
+
+  size_t job =
+      atomic_load_explicit(&deque->jobs[bottom], memory_order_relaxed);
+  if (top == bottom) {
+    // The last job: thieves may be after it too
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      job = POOL_EMPTY;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+
+  return job;
+}
+
+static size_t pool_deque_steal(Pool_deque *deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom)
+    return POOL_EMPTY;
+
+  size_t job = atomic_load_explicit(&deque->jobs[top], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed))
+    return POOL_ABORT;
+
+  return job;
+}
+
+// Jobs are never added once the workers run, so a sweep that finds every
+// deque empty means there is nothing left to do
+static size_t pool_steal(Pool *pool, const size_t thief) {
+  for (;;) {
+    int aborted = 0;
+
+    for (size_t i = 1; i < pool->workers_count; i++) {
+      size_t victim = (thief + i) % pool->workers_count;
+      size_t job = pool_deque_steal(&pool->deques[victim]);
+      if (job == POOL_ABORT)
+        aborted = 1;
+      else if (job != POOL_EMPTY)
+        return job;
+    }
+
+    if (!aborted)
+      return POOL_EMPTY;
+  }
+}
+
+static void pool_worker_run(Pool *pool, const size_t no) {
+  for (;;) {
+    size_t job = pool_deque_take(&pool->deques[no]);
+    if (job == POOL_EMPTY)
+      job = pool_steal(pool, no);
+    if (job == POOL_EMPTY)
+      break;
+
+    pool->fn(pool->ctx, no, job);
+  }
+}
+
+static void *pool_thread_run(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&pool_shared.lock);
+  for (;;) {
+    while (!pool_shared.quit &&
+           (pool_shared.run == NULL ||
+            pool_shared.claimed + 1 >= pool_shared.run->workers_count))
+      pthread_cond_wait(&pool_shared.wake, &pool_shared.lock);
+    if (pool_shared.quit)
+      break;
+
+    Pool *pool = pool_shared.run;
+    size_t no = ++pool_shared.claimed;
+    pthread_mutex_unlock(&pool_shared.lock);
+
+    pool_worker_run(pool, no);
+
+    pthread_mutex_lock(&pool_shared.lock);
+    if (--pool_shared.active == 0)
+      pthread_cond_signal(&pool_shared.done);
+  }
+  pthread_mutex_unlock(&pool_shared.lock);
+
+  return NULL;
+}
+
+// Starts threads until count are running, as far as the system allows;
+// called with the lock held
+static void pool_threads_start(const size_t count) {
+  if (count <= pool_shared.threads_count)
+    return;
+
+  pthread_t *threads = (pthread_t *)realloc(pool_shared.threads,
+                                            count * sizeof(pthread_t));
+  if (threads == NULL)
+    return;
+  pool_shared.threads = threads;
+
+  while (pool_shared.threads_count < count &&
+         pthread_create(&threads[pool_shared.threads_count], NULL,
+                        pool_thread_run, NULL) == 0) {
+    pool_shared.threads_count++;
+  }
+}
+
+void pool_acquire(void) {
+  pthread_mutex_lock(&pool_shared.lock);
+  pool_shared.users++;
+  pthread_mutex_unlock(&pool_shared.lock);
+}
+
+void pool_release(void) {
+  pthread_mutex_lock(&pool_shared.lock);
+  if (--pool_shared.users > 0 || pool_shared.threads_count == 0) {
+    pthread_mutex_unlock(&pool_shared.lock);
+    return;
+  }
+
+  // Runs that start while the threads are joined run on their callers
+  pool_shared.busy = 1;
+  pool_shared.quit = 1;
+  pthread_cond_broadcast(&pool_shared.wake);
+  pthread_t *threads = pool_shared.threads;
+  size_t threads_count = pool_shared.threads_count;
+  pool_shared.threads = NULL;
+  pool_shared.threads_count = 0;
+  pthread_mutex_unlock(&pool_shared.lock);
+
+  for (size_t i = 0; i < threads_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  pthread_mutex_lock(&pool_shared.lock);
+  pool_shared.quit = 0;
+  pool_shared.busy = 0;
+  pthread_mutex_unlock(&pool_shared.lock);
+}
+
+int pool_run(size_t workers_count, size_t jobs_count, Pool_fn fn, void *ctx) {
+  if (jobs_count == 0)
+    return 0;
+  if (workers_count == 0)
+    workers_count = 1;
+  if (workers_count > jobs_count)
+    workers_count = jobs_count;
+
+  // A run from inside a job, or alongside another run, gets no threads of
+  // its own: the ones there are already have all the cores busy
+  pthread_mutex_lock(&pool_shared.lock);
+  if (pool_shared.busy) {
+    pthread_mutex_unlock(&pool_shared.lock);
+    for (size_t job = 0; job < jobs_count; job++) {
+      fn(ctx, 0, job);
+    }
+    return 0;
+  }
+  pool_shared.busy = 1;
+  pool_shared.users++;
+  pool_threads_start(workers_count - 1);
+  if (workers_count > pool_shared.threads_count + 1)
+    workers_count = pool_shared.threads_count + 1;
+  pthread_mutex_unlock(&pool_shared.lock);
+
+  Pool pool = {
+      .deques = (Pool_deque *)aligned_alloc(
+          64, workers_count * sizeof(Pool_deque)),
+      .workers_count = workers_count,
+      .fn = fn,
+      .ctx = ctx,
+  };
+  _Atomic size_t *jobs =
+      (_Atomic size_t *)malloc(jobs_count * sizeof(_Atomic size_t));
+  int status = -1;
+  if (pool.deques == NULL || jobs == NULL)
+    goto release;
+
+  // Contiguous runs, pushed back to front so each owner works through its
+  // run in order while thieves take from the far end
+  size_t per_worker = (jobs_count + workers_count - 1) / workers_count;
+  for (size_t i = 0; i < workers_count; i++) {
+    size_t start = i * per_worker < jobs_count ? i * per_worker : jobs_count;
+    size_t end = start + per_worker < jobs_count ? start + per_worker
+                                                 : jobs_count;
+
+    Pool_deque *deque = &pool.deques[i];
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    deque->jobs = &jobs[start];
+    deque->jobs_cap = (int64_t)(end - start);
+    for (size_t job = end; job > start; job--) {
+      pool_deque_push(deque, job - 1);
+    }
+  }
+
+  pthread_mutex_lock(&pool_shared.lock);
+  pool_shared.run = &pool;
+  pool_shared.claimed = 0;
+  pool_shared.active = workers_count - 1;
+  pthread_cond_broadcast(&pool_shared.wake);
+  pthread_mutex_unlock(&pool_shared.lock);
+
+  pool_worker_run(&pool, 0);
+
+  // Worker 0 returns only once every deque is empty, so the numbers no
+  // thread took yet are left with nothing to do
+  pthread_mutex_lock(&pool_shared.lock);
+  pool_shared.active -= workers_count - 1 - pool_shared.claimed;
+  pool_shared.claimed = workers_count - 1;
+  while (pool_shared.active > 0)
+    pthread_cond_wait(&pool_shared.done, &pool_shared.lock);
+  pool_shared.run = NULL;
+  pthread_mutex_unlock(&pool_shared.lock);
+  status = 0;
+
+release:
+  free(pool.deques);
+  free(jobs);
+
+  pthread_mutex_lock(&pool_shared.lock);
+  pool_shared.busy = 0;
+  pthread_mutex_unlock(&pool_shared.lock);
+  pool_release();
+  return status;
+}
+
+size_t pool_workers_default(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (size_t)cores : 1;
+}
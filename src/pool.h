@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Runs one job; worker is the calling worker's number, below the
+// workers_count given to pool_run, so it can index per-worker state
+typedef void (*Pool_fn)(void *ctx, size_t worker, size_t job);
+
+// Runs fn for every job in [0, jobs_count) on workers_count threads, the
+// calling thread being worker 0, and returns once all of them are done;
+// -1 if the pool could not be set up. The threads are shared by the whole
+// process: a run made from inside a job, or while another is under way,
+// does all its jobs on the calling thread.
+int pool_run(size_t workers_count, size_t jobs_count, Pool_fn fn, void *ctx);
+
+// Keeps the threads parked between runs until the matching pool_release;
+// without it they are joined at the end of every run
+void pool_acquire(void);
+void pool_release(void);
+
+// One worker per online core
+size_t pool_workers_default(void);
+
+#endif
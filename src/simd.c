@@ -0,0 +1,537 @@
+#include <stdatomic.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+// Integer kernels wrap on overflow like the vm's own arithmetic
+
+static int64_t simd_scalar_sum_i64(const int64_t *a, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += (uint64_t)a[i];
+  }
+
+  return (int64_t)sum;
+}
+
+static double simd_scalar_sum_f64(const double *a, size_t n) {
+  double sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += a[i];
+  }
+
+  return sum;
+}
+
+static int64_t simd_scalar_dot_i64(const int64_t *a, const int64_t *b,
+                                   size_t n) {
+  uint64_t dot = 0;
+  for (size_t i = 0; i < n; i++) {
+    dot += (uint64_t)a[i] * (uint64_t)b[i];
+  }
+
+  return (int64_t)dot;
+}
+
+static double simd_scalar_dot_f64(const double *a, const double *b,
+                                  size_t n) {
+  double dot = 0;
+  for (size_t i = 0; i < n; i++) {
+    dot += a[i] * b[i];
+  }
+
+  return dot;
+}
+
+static void simd_scalar_add_i64(int64_t *dst, const int64_t *a,
+                                const int64_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+  }
+}
+
+static void simd_scalar_sub_i64(int64_t *dst, const int64_t *a,
+                                const int64_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = (int64_t)((uint64_t)a[i] - (uint64_t)b[i]);
+  }
+}
+
+static void simd_scalar_mul_i64(int64_t *dst, const int64_t *a,
+                                const int64_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = (int64_t)((uint64_t)a[i] * (uint64_t)b[i]);
+  }
+}
+
+static void simd_scalar_add_f64(double *dst, const double *a,
+                                const double *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = a[i] + b[i];
+  }
+}
+
+static void simd_scalar_scale_i64(int64_t *dst, const int64_t *a, int64_t k,
+                                  size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = (int64_t)((uint64_t)a[i] * (uint64_t)k);
+  }
+}
+
+static void simd_scalar_scale_f64(double *dst, const double *a, double k,
+                                  size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = a[i] * k;
+  }
+}
+
+static void simd_scalar_mask_i64(int64_t *dst, const int64_t *a,
+                                 const int64_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = a[i] < b[i];
+  }
+}
+
+static void simd_scalar_mask_f64(double *dst, const double *a,
+                                 const double *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = a[i] < b[i];
+  }
+}
+
+static const Simd_kernels SIMD_SCALAR = {
+    .name = "scalar",
+    .sum_i64 = simd_scalar_sum_i64,
+    .sum_f64 = simd_scalar_sum_f64,
+    .dot_i64 = simd_scalar_dot_i64,
+    .dot_f64 = simd_scalar_dot_f64,
+    .add_i64 = simd_scalar_add_i64,
+    .sub_i64 = simd_scalar_sub_i64,
+    .mul_i64 = simd_scalar_mul_i64,
+    .add_f64 = simd_scalar_add_f64,
+    .scale_i64 = simd_scalar_scale_i64,
+    .scale_f64 = simd_scalar_scale_f64,
+    .mask_i64 = simd_scalar_mask_i64,
+    .mask_f64 = simd_scalar_mask_f64,
+};
+
+#if SIMD_X86
+
+// SSE2 is part of x86-64 itself. It has no 64-bit lane multiply or
+// compare, so those are built from 32-bit products or left scalar.
+
+static inline __m128i simd_sse2_mul_epi64(__m128i a, __m128i b) {
+  __m128i lo = _mm_mul_epu32(a, b);
+  __m128i mid = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                              _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+  return _mm_add_epi64(lo, _mm_slli_epi64(mid, 32));
+}
+
+static int64_t simd_sse2_sum_i64(const int64_t *a, size_t n) {
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+  }
+
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1] +
+                   (uint64_t)simd_scalar_sum_i64(a + i, n - i));
+}
+
+static double simd_sse2_sum_f64(const double *a, size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    acc = _mm_add_pd(acc, _mm_loadu_pd(a + i));
+  }
+
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  return lanes[0] + lanes[1] + simd_scalar_sum_f64(a + i, n - i);
+}
+
+static int64_t simd_sse2_dot_i64(const int64_t *a, const int64_t *b,
+                                 size_t n) {
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi64(acc, simd_sse2_mul_epi64(x, y));
+  }
+
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1] +
+                   (uint64_t)simd_scalar_dot_i64(a + i, b + i, n - i));
+}
+
+static double simd_sse2_dot_f64(const double *a, const double *b,
+                                size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    acc = _mm_add_pd(acc, _mm_mul_pd(x, _mm_loadu_pd(b + i)));
+  }
+
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  return lanes[0] + lanes[1] + simd_scalar_dot_f64(a + i, b + i, n - i);
+}
+
+static void simd_sse2_add_i64(int64_t *dst, const int64_t *a,
+                              const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi64(x, y));
+  }
+
+  simd_scalar_add_i64(dst + i, a + i, b + i, n - i);
+}
+
+static void simd_sse2_sub_i64(int64_t *dst, const int64_t *a,
+                              const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi64(x, y));
+  }
+
+  simd_scalar_sub_i64(dst + i, a + i, b + i, n - i);
+}
+
+static void simd_sse2_mul_i64(int64_t *dst, const int64_t *a,
+                                const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(dst + i), simd_sse2_mul_epi64(x, y));
+  }
+
+  simd_scalar_mul_i64(dst + i, a + i, b + i, n - i);
+}
+
+static void simd_sse2_add_f64(double *dst, const double *a, const double *b,
+                              size_t n) {
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    _mm_storeu_pd(dst + i, _mm_add_pd(x, _mm_loadu_pd(b + i)));
+  }
+
+  simd_scalar_add_f64(dst + i, a + i, b + i, n - i);
+}
+
+static void simd_sse2_scale_i64(int64_t *dst, const int64_t *a, int64_t k,
+                                size_t n) {
+  __m128i y = _mm_set1_epi64x(k);
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    _mm_storeu_si128((__m128i *)(dst + i), simd_sse2_mul_epi64(x, y));
+  }
+
+  simd_scalar_scale_i64(dst + i, a + i, k, n - i);
+}
+
+static void simd_sse2_scale_f64(double *dst, const double *a, double k,
+                                size_t n) {
+  __m128d y = _mm_set1_pd(k);
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_loadu_pd(a + i), y));
+  }
+
+  simd_scalar_scale_f64(dst + i, a + i, k, n - i);
+}
+
+static void simd_sse2_mask_f64(double *dst, const double *a, const double *b,
+                               size_t n) {
+  __m128d one = _mm_set1_pd(1.0);
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128d lt = _mm_cmplt_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    _mm_storeu_pd(dst + i, _mm_and_pd(lt, one));
+  }
+
+  simd_scalar_mask_f64(dst + i, a + i, b + i, n - i);
+}
+
+static const Simd_kernels SIMD_SSE2 = {
+    .name = "sse2",
+    .sum_i64 = simd_sse2_sum_i64,
+    .sum_f64 = simd_sse2_sum_f64,
+    .dot_i64 = simd_sse2_dot_i64,
+    .dot_f64 = simd_sse2_dot_f64,
+    .add_i64 = simd_sse2_add_i64,
+    .sub_i64 = simd_sse2_sub_i64,
+    .mul_i64 = simd_sse2_mul_i64,
+    .add_f64 = simd_sse2_add_f64,
+    .scale_i64 = simd_sse2_scale_i64,
+    .scale_f64 = simd_sse2_scale_f64,
+    .mask_i64 = simd_scalar_mask_i64,
+    .mask_f64 = simd_sse2_mask_f64,
+};
+
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+
+SIMD_TARGET_AVX2
+static inline __m256i simd_avx2_mul_epi64(__m256i a, __m256i b) {
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i mid =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(mid, 32));
+}
+
+SIMD_TARGET_AVX2
+static int64_t simd_avx2_reduce_i64(__m256i acc) {
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1] +
+                   (uint64_t)lanes[2] + (uint64_t)lanes[3]);
+}
+
+SIMD_TARGET_AVX2
+static double simd_avx2_reduce_f64(__m256d acc) {
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+SIMD_TARGET_AVX2
+static int64_t simd_avx2_sum_i64(const int64_t *a, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+  }
+
+  return (int64_t)((uint64_t)simd_avx2_reduce_i64(acc) +
+                   (uint64_t)simd_scalar_sum_i64(a + i, n - i));
+}
+
+SIMD_TARGET_AVX2
+static double simd_avx2_sum_f64(const double *a, size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+  }
+
+  return simd_avx2_reduce_f64(acc) + simd_scalar_sum_f64(a + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static int64_t simd_avx2_dot_i64(const int64_t *a,
+                                 const int64_t *b, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    acc = _mm256_add_epi64(acc, simd_avx2_mul_epi64(x, y));
+  }
+
+  return (int64_t)((uint64_t)simd_avx2_reduce_i64(acc) +
+                   (uint64_t)simd_scalar_dot_i64(a + i, b + i, n - i));
+}
+
+SIMD_TARGET_AVX2
+static double simd_avx2_dot_f64(const double *a,
+                                const double *b, size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(
+        acc, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+  }
+
+  return simd_avx2_reduce_f64(acc) + simd_scalar_dot_f64(a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_add_i64(int64_t *dst, const int64_t *a,
+                              const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi64(x, y));
+  }
+
+  simd_scalar_add_i64(dst + i, a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_sub_i64(int64_t *dst, const int64_t *a,
+                              const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi64(x, y));
+  }
+
+  simd_scalar_sub_i64(dst + i, a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_mul_i64(int64_t *dst, const int64_t *a,
+                                const int64_t *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), simd_avx2_mul_epi64(x, y));
+  }
+
+  simd_scalar_mul_i64(dst + i, a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_add_f64(double *dst, const double *a,
+                              const double *b, size_t n) {
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+
+  simd_scalar_add_f64(dst + i, a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_scale_i64(int64_t *dst, const int64_t *a,
+                                int64_t k, size_t n) {
+  __m256i y = _mm256_set1_epi64x(k);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), simd_avx2_mul_epi64(x, y));
+  }
+
+  simd_scalar_scale_i64(dst + i, a + i, k, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_scale_f64(double *dst, const double *a,
+                                double k, size_t n) {
+  __m256d y = _mm256_set1_pd(k);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), y));
+  }
+
+  simd_scalar_scale_f64(dst + i, a + i, k, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_mask_i64(int64_t *dst, const int64_t *a,
+                               const int64_t *b, size_t n) {
+  __m256i one = _mm256_set1_epi64x(1);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_and_si256(_mm256_cmpgt_epi64(y, x), one));
+  }
+
+  simd_scalar_mask_i64(dst + i, a + i, b + i, n - i);
+}
+
+SIMD_TARGET_AVX2
+static void simd_avx2_mask_f64(double *dst, const double *a,
+                               const double *b, size_t n) {
+  __m256d one = _mm256_set1_pd(1.0);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d lt = _mm256_cmp_pd(x, _mm256_loadu_pd(b + i), _CMP_LT_OQ);
+    _mm256_storeu_pd(dst + i, _mm256_and_pd(lt, one));
+  }
+
+  simd_scalar_mask_f64(dst + i, a + i, b + i, n - i);
+}
+
+#undef SIMD_TARGET_AVX2
+
+static const Simd_kernels SIMD_AVX2 = {
+    .name = "avx2",
+    .sum_i64 = simd_avx2_sum_i64,
+    .sum_f64 = simd_avx2_sum_f64,
+    .dot_i64 = simd_avx2_dot_i64,
+    .dot_f64 = simd_avx2_dot_f64,
+    .add_i64 = simd_avx2_add_i64,
+    .sub_i64 = simd_avx2_sub_i64,
+    .mul_i64 = simd_avx2_mul_i64,
+    .add_f64 = simd_avx2_add_f64,
+    .scale_i64 = simd_avx2_scale_i64,
+    .scale_f64 = simd_avx2_scale_f64,
+    .mask_i64 = simd_avx2_mask_i64,
+    .mask_f64 = simd_avx2_mask_f64,
+};
+
+#endif
+
+const Simd_kernels *simd_kernels(void) {
+  // Threads racing the first call all pick the same table
+  static const Simd_kernels *_Atomic picked = NULL;
+
+  const Simd_kernels *kernels = atomic_load(&picked);
+  if (kernels != NULL)
+    return kernels;
+
+#if SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels = &SIMD_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    kernels = &SIMD_SSE2;
+  } else {
+    kernels = &SIMD_SCALAR;
+  }
+#else
+  kernels = &SIMD_SCALAR;
+#endif
+
+  atomic_store(&picked, kernels);
+  return kernels;
+}
@@ -0,0 +1,38 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk array kernels, one table per instruction set
+typedef struct {
+  const char *name;
+
+  int64_t (*sum_i64)(const int64_t *a, size_t n);
+  double (*sum_f64)(const double *a, size_t n);
+
+  int64_t (*dot_i64)(const int64_t *a, const int64_t *b, size_t n);
+  double (*dot_f64)(const double *a, const double *b, size_t n);
+
+  void (*add_i64)(int64_t *dst, const int64_t *a, const int64_t *b,
+                  size_t n);
+  void (*add_f64)(double *dst, const double *a, const double *b, size_t n);
+
+  void (*sub_i64)(int64_t *dst, const int64_t *a, const int64_t *b,
+                  size_t n);
+  void (*mul_i64)(int64_t *dst, const int64_t *a, const int64_t *b,
+                  size_t n);
+
+  void (*scale_i64)(int64_t *dst, const int64_t *a, int64_t k, size_t n);
+  void (*scale_f64)(double *dst, const double *a, double k, size_t n);
+
+  // dst[i] = a[i] < b[i]
+  void (*mask_i64)(int64_t *dst, const int64_t *a, const int64_t *b,
+                   size_t n);
+  void (*mask_f64)(double *dst, const double *a, const double *b, size_t n);
+} Simd_kernels;
+
+// Best table the running CPU supports, picked on first use
+const Simd_kernels *simd_kernels(void);
+
+#endif
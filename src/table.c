@@ -25,12 +25,25 @@ inline static void hash_table_keys_insert(Hash_Table *ht, HashKey key) {
 }
 
 void hash_table_insert(Hash_Table *ht, const Sv key_str, const Word data) {
-  HashKey key = hash_table_key_hash(key_str);
+  hash_table_insert_hashed(ht, hash_table_key_hash(key_str), data);
+}
+
+void hash_table_insert_hashed(Hash_Table *ht, const HashKey key,
+                              const Word data) {
   HashKey key_mod = key % HASH_TABLE_CAP;
 
+  // Redefinitions overwrite, so the key list never holds duplicates
+  for (Bucket *bucket = ht->nodes[key_mod]; bucket; bucket = bucket->prev) {
+    if (bucket->key == key) {
+      bucket->data = data;
+      return;
+    }
+  }
+
   Bucket *new_bucket = (Bucket *)malloc(sizeof(Bucket));
   new_bucket->key = key;
   new_bucket->data = data;
+  new_bucket->prev = NULL;
 
   Bucket *bucket = ht->nodes[key_mod];
 
@@ -43,7 +56,10 @@ void hash_table_insert(Hash_Table *ht, const Sv key_str, const Word data) {
 }
 
 Word *hash_table_get(Hash_Table *ht, const Sv key_str) {
-  HashKey key = hash_table_key_hash(key_str);
+  return hash_table_get_hashed(ht, hash_table_key_hash(key_str));
+}
+
+Word *hash_table_get_hashed(Hash_Table *ht, const HashKey key) {
   HashKey key_mod = key % HASH_TABLE_CAP;
 
   Bucket *bucket = ht->nodes[key_mod];
@@ -152,3 +168,24 @@ void hash_table_destruct(Hash_Table *ht) {
     }
   }
 }
+
+// Buckets keep their chain order, so lookups resolve the same way
+Hash_Table hash_table_clone(const Hash_Table *ht) {
+  Hash_Table clone = *ht;
+
+  for (size_t i = 0; i < HASH_TABLE_CAP; i++) {
+    Bucket **link = &clone.nodes[i];
+
+    for (const Bucket *bucket = ht->nodes[i]; bucket; bucket = bucket->prev) {
+      Bucket *copy = (Bucket *)malloc(sizeof(Bucket));
+      copy->key = bucket->key;
+      copy->data = bucket->data;
+      copy->prev = NULL;
+
+      *link = copy;
+      link = &copy->prev;
+    }
+  }
+
+  return clone;
+}
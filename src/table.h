@@ -27,7 +27,7 @@ typedef enum {
 typedef union {
   uint64_t as_u64;
   int64_t as_i64;
-  float as_f64;
+  double as_f64;
   Sv as_sv;
   void *as_ptr;
 } Word;
@@ -47,9 +47,14 @@ typedef struct {
 
 Hash_Table hash_table_new(void);
 void hash_table_destruct(Hash_Table *ht);
+Hash_Table hash_table_clone(const Hash_Table *ht);
 
 void hash_table_insert(Hash_Table *ht, const Sv key_str, const Word data);
 Word *hash_table_get(Hash_Table *ht, const Sv key_str);
+// By the hash of a key, as listed in keys, for when the name is gone
+void hash_table_insert_hashed(Hash_Table *ht, const HashKey key,
+                              const Word data);
+Word *hash_table_get_hashed(Hash_Table *ht, const HashKey key);
 void hash_table_delete(Hash_Table *ht, const Sv key_str);
 
 int hash_table_keys_contains(Hash_Table *ht, Sv key_str);
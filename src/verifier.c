@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "verifier.h"
+#include "vm.h"
+
+typedef struct {
+  // Stack depth relative to the frame base, -1 if unreached
+  int64_t depth;
+  // Entry of the Fn owning the frame, -1 for the top level
+  int64_t owner;
+  // Depth cpsr marks as the base of the frame of a call being set up,
+  // -1 when none is
+  int64_t base;
+} Verifier_state;
+
+// The callee frame of a call starts offset words above the caller's base
+typedef struct {
+  int64_t from;
+  int64_t to;
+  int64_t offset;
+} Verifier_edge;
+
+typedef struct {
+  const Inst *insts;
+  size_t insts_count;
+
+  Verifier_state states[INSTS_CAP];
+  uint64_t worklist[INSTS_CAP];
+  size_t worklist_count;
+
+  // Indexed by Fn entry, -1 if never called
+  int64_t arities[INSTS_CAP];
+  uint8_t targets[INSTS_CAP];
+  // Jumps that are calls, and the insts of the calling convention which
+  // alone may write fp, sp, ra and cpsr
+  uint8_t calls[INSTS_CAP];
+  uint8_t protocol[INSTS_CAP];
+
+  // Highest depth each frame reaches, indexed by owner plus one
+  int64_t peaks[INSTS_CAP + 1];
+  Verifier_edge edges[INSTS_CAP];
+  size_t edges_count;
+} Verifier;
+
+#ifndef DEBUG
+#define VERIFIER_REJECT(pos) return 0
+#else
+#define VERIFIER_REJECT(pos)                                                   \
+  do {                                                                         \
+    printf("Verifier: rejected at %zu\n", (size_t)(pos));                      \
+    return 0;                                                                  \
+  } while (0)
+#endif
+
+#define VERIFIER_IS(v, pos, inst_type, reg)                                    \
+  ((pos) < (v)->insts_count &&                                                 \
+   INST_BASE((v)->insts[pos].type) == (inst_type) &&                           \
+   (v)->insts[pos].operand.as_u64 == (uint64_t)(reg))
+
+static int verifier_reg_is_protected(const uint64_t reg_no) {
+  return reg_no == REG_IP || reg_no == REG_FP || reg_no == REG_SP ||
+         reg_no == REG_RA || reg_no == REG_CPSR;
+}
+
+static int verifier_untargeted(const Verifier *v, const size_t from,
+                               const size_t to) {
+  for (size_t pos = from; pos <= to && pos < v->insts_count; pos++) {
+    if (v->targets[pos])
+      return 0;
+  }
+
+  return 1;
+}
+
+static void verifier_stack_effect(const Inst_t type, uint64_t *pops,
+                                  uint64_t *pushes) {
+  *pops = 0;
+  *pushes = 0;
+
+  switch (type) {
+  case INST_PUSH:
+  case INST_PICK:
+  case INST_DEFL:
+  case INST_VARG:
+  case INST_VARL:
+  case INST_LDR:
+    *pushes = 1;
+    break;
+  case INST_POP:
+  case INST_INCG:
+  case INST_JMPT:
+  case INST_JMPNT:
+  case INST_STR:
+  case INST_MOV:
+  case INST_TAILCALL:
+    *pops = 1;
+    break;
+  case INST_DUP:
+    *pops = 1;
+    *pushes = 2;
+    break;
+  case INST_PLUS:
+  case INST_PLUSF:
+  case INST_MINUS:
+  case INST_MULT:
+  case INST_DIV:
+  case INST_EQ:
+  case INST_NE:
+  case INST_GT:
+  case INST_LT:
+  case INST_ALOAD:
+  case INST_ADOT:
+  case INST_SEND:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case INST_SHL:
+  case INST_SHR:
+  case INST_NEG:
+  case INST_PRINT:
+  case INST_PRINTS:
+  case INST_DEFG:
+  case INST_ANEW:
+  case INST_ALEN:
+  case INST_ASUM:
+  case INST_CHAN:
+  case INST_RECV:
+    *pops = 1;
+    *pushes = 1;
+    break;
+  case INST_FORLOOP:
+    *pops = 3;
+    *pushes = 3;
+    break;
+  case INST_ASTORE:
+    *pops = 3;
+    break;
+  case INST_AADD:
+  case INST_ASCALE:
+  case INST_AMASK:
+    *pops = 3;
+    *pushes = 1;
+    break;
+  default:
+    // vexpr checks the operands it reads itself
+    break;
+  }
+}
+
+// Marks jump targets and the calls the compiler's convention emits:
+// `ldr fp; ldr ra; push sp; mov cpsr; args; push cpsr; mov fp;
+// push ra; str ra; jmpa fn; pop * arity; push fp; mov sp; str ra; str fp`
+static int verifier_protocol_mark(Verifier *v) {
+  for (size_t pos = 0; pos < v->insts_count; pos++) {
+    Inst_t type = INST_BASE(v->insts[pos].type);
+    uint64_t target = v->insts[pos].operand.as_u64;
+
+    switch (type) {
+    case INST_JMPA:
+    case INST_JMPT:
+    case INST_JMPNT:
+    case INST_FORLOOP:
+    case INST_TAILCALL:
+    case INST_MEMOCALL:
+      if (target >= v->insts_count)
+        VERIFIER_REJECT(pos);
+      v->targets[target] = 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (size_t pos = 0; pos < v->insts_count; pos++) {
+    Inst_t type = INST_BASE(v->insts[pos].type);
+    uint64_t operand = v->insts[pos].operand.as_u64;
+
+    if (type == INST_MOV && operand == REG_CPSR && pos >= 3 &&
+        VERIFIER_IS(v, pos - 3, INST_LDR, REG_FP) &&
+        VERIFIER_IS(v, pos - 2, INST_LDR, REG_RA) &&
+        VERIFIER_IS(v, pos - 1, INST_PUSH, REG_SP) &&
+        verifier_untargeted(v, pos - 2, pos)) {
+      v->protocol[pos] = 1;
+      continue;
+    }
+
+    if (type == INST_TAILCALL) {
+      if (pos < 1 || INST_BASE(v->insts[pos - 1].type) != INST_PUSH ||
+          v->targets[pos])
+        VERIFIER_REJECT(pos);
+
+      int64_t arity = (int64_t)v->insts[pos - 1].operand.as_u64;
+      if (arity < 0 || arity >= INSTS_CAP ||
+          (v->arities[operand] != -1 && v->arities[operand] != arity))
+        VERIFIER_REJECT(pos);
+
+      v->arities[operand] = arity;
+      continue;
+    }
+
+    if ((type != INST_JMPA && type != INST_MEMOCALL) || pos < 4)
+      continue;
+    if (!VERIFIER_IS(v, pos - 4, INST_PUSH, REG_CPSR) ||
+        !VERIFIER_IS(v, pos - 3, INST_MOV, REG_FP) ||
+        !VERIFIER_IS(v, pos - 2, INST_PUSH, pos + 1) ||
+        !VERIFIER_IS(v, pos - 1, INST_STR, REG_RA))
+      continue;
+
+    size_t ret = pos + 1;
+    int64_t arity = 0;
+    while (ret + arity < v->insts_count &&
+           INST_BASE(v->insts[ret + arity].type) == INST_POP) {
+      arity++;
+    }
+
+    size_t post = ret + arity;
+    if (!VERIFIER_IS(v, post, INST_PUSH, REG_FP) ||
+        !VERIFIER_IS(v, post + 1, INST_MOV, REG_SP) ||
+        !VERIFIER_IS(v, post + 2, INST_STR, REG_RA) ||
+        !VERIFIER_IS(v, post + 3, INST_STR, REG_FP) ||
+        !verifier_untargeted(v, pos - 3, pos) ||
+        !verifier_untargeted(v, ret, post + 3))
+      continue;
+
+    if (v->arities[operand] != -1 && v->arities[operand] != arity)
+      VERIFIER_REJECT(pos);
+    v->arities[operand] = arity;
+
+    v->calls[pos] = 1;
+    v->protocol[pos - 3] = 1;
+    v->protocol[pos - 1] = 1;
+    v->protocol[post + 1] = 1;
+    v->protocol[post + 2] = 1;
+    v->protocol[post + 3] = 1;
+  }
+
+  return 1;
+}
+
+// Every path into an inst must agree on its state
+static int verifier_flow(Verifier *v, const uint64_t pos,
+                         const Verifier_state state) {
+  if (pos >= v->insts_count)
+    return 0;
+
+  Verifier_state *seen = &v->states[pos];
+  if (seen->depth == -1) {
+    *seen = state;
+    v->worklist[v->worklist_count++] = pos;
+    return 1;
+  }
+
+  return seen->depth == state.depth && seen->owner == state.owner &&
+         seen->base == state.base;
+}
+
+static int verifier_edge_add(Verifier *v, const int64_t from,
+                             const int64_t to, const int64_t offset) {
+  if (v->edges_count >= INSTS_CAP)
+    return 0;
+
+  v->edges[v->edges_count++] = (Verifier_edge){
+      .from = from,
+      .to = to,
+      .offset = offset,
+  };
+  return 1;
+}
+
+static int verifier_step(Verifier *v, const size_t pos) {
+  const Inst *inst = &v->insts[pos];
+  Inst_t type = INST_BASE(inst->type);
+  uint64_t operand = inst->operand.as_u64;
+  Verifier_state state = v->states[pos];
+
+  uint64_t pops;
+  uint64_t pushes;
+  verifier_stack_effect(type, &pops, &pushes);
+
+  if ((uint64_t)state.depth < pops)
+    VERIFIER_REJECT(pos);
+  // Nothing may reach under the frame of a call being set up
+  if (state.base != -1 && state.depth - (int64_t)pops < state.base)
+    VERIFIER_REJECT(pos);
+
+  Verifier_state next = state;
+  next.depth = state.depth - (int64_t)pops + (int64_t)pushes;
+
+  int64_t *peak = &v->peaks[state.owner + 1];
+  if (next.depth > *peak)
+    *peak = next.depth;
+
+  switch (type) {
+  case INST_PICK:
+  case INST_VARL:
+  case INST_DEFL:
+    if (operand >= (uint64_t)state.depth)
+      VERIFIER_REJECT(pos);
+    break;
+
+  case INST_SPAWN:
+  case INST_YIELD:
+  case INST_JOIN:
+  case INST_SEND:
+  case INST_RECV:
+    // Task switches swap out the very stack these states describe
+    VERIFIER_REJECT(pos);
+
+  case INST_PMAP:
+  case INST_PREDUCE:
+    // Workers enter the Fn on frames no call site here sets up
+    VERIFIER_REJECT(pos);
+
+  case INST_LDR:
+    if (operand >= VM_REGS_CAP)
+      VERIFIER_REJECT(pos);
+    break;
+
+  case INST_STR:
+    if (operand >= VM_REGS_CAP ||
+        (verifier_reg_is_protected(operand) && !v->protocol[pos]))
+      VERIFIER_REJECT(pos);
+    break;
+
+  case INST_MOV:
+    // The source register is the push right before
+    if (operand >= VM_REGS_CAP ||
+        (verifier_reg_is_protected(operand) && !v->protocol[pos]))
+      VERIFIER_REJECT(pos);
+    if (pos < 1 || v->targets[pos] ||
+        INST_BASE(v->insts[pos - 1].type) != INST_PUSH ||
+        v->insts[pos - 1].operand.as_u64 >= VM_REGS_CAP)
+      VERIFIER_REJECT(pos);
+
+    if (operand == REG_CPSR)
+      next.base = next.depth;
+    break;
+
+  case INST_JMPA:
+  case INST_MEMOCALL:
+    if (!v->calls[pos]) {
+      if (type == INST_MEMOCALL || !verifier_flow(v, operand, next))
+        VERIFIER_REJECT(pos);
+      return 1;
+    }
+
+    // The callee's args are exactly what was pushed since cpsr was set
+    if (state.base == -1 ||
+        state.depth - state.base != v->arities[operand] ||
+        !verifier_edge_add(v, state.owner, (int64_t)operand, state.base))
+      VERIFIER_REJECT(pos);
+
+    next.base = -1;
+    if (!verifier_flow(v, pos + 1, next))
+      VERIFIER_REJECT(pos);
+    return 1;
+
+  case INST_JMPT:
+  case INST_JMPNT:
+  case INST_FORLOOP:
+    if (!verifier_flow(v, operand, next) || !verifier_flow(v, pos + 1, next))
+      VERIFIER_REJECT(pos);
+    return 1;
+
+  case INST_RET:
+  case INST_MEMORET:
+    if (state.owner == -1 || state.base != -1 ||
+        state.depth != v->arities[state.owner])
+      VERIFIER_REJECT(pos);
+    if (type == INST_MEMORET && operand >= v->insts_count)
+      VERIFIER_REJECT(pos);
+    return 1;
+
+  case INST_TAILCALL: {
+    // The new args replace the current ones in the same frame
+    int64_t arity = v->arities[operand];
+    if (state.owner == -1 || state.base != -1 ||
+        arity != v->arities[state.owner] || next.depth < arity ||
+        !verifier_edge_add(v, state.owner, (int64_t)operand, 0))
+      VERIFIER_REJECT(pos);
+    return 1;
+  }
+
+  case INST_EOF:
+    return 1;
+
+  default:
+    break;
+  }
+
+  if (!verifier_flow(v, pos + 1, next))
+    VERIFIER_REJECT(pos);
+  return 1;
+}
+
+// A callee's need stacks on its caller's at the call's offset; a cycle
+// that keeps raising it is recursion with no bound. Fns the top level
+// never calls into do not count.
+static void verifier_need_compute(const Verifier *v, Verdict *verdict) {
+  uint8_t called[INSTS_CAP + 1] = {1};
+  for (size_t round = 0; round < v->edges_count; round++) {
+    for (size_t i = 0; i < v->edges_count; i++) {
+      const Verifier_edge *edge = &v->edges[i];
+      if (called[edge->from + 1])
+        called[edge->to + 1] = 1;
+    }
+  }
+
+  int64_t needs[INSTS_CAP + 1];
+  memcpy(needs, v->peaks, sizeof(needs));
+
+  for (size_t round = 0; round <= v->edges_count; round++) {
+    int changed = 0;
+
+    for (size_t i = 0; i < v->edges_count; i++) {
+      const Verifier_edge *edge = &v->edges[i];
+      if (!called[edge->from + 1])
+        continue;
+
+      int64_t need = edge->offset + needs[edge->to + 1];
+
+      if (need > needs[edge->from + 1]) {
+        needs[edge->from + 1] = need;
+        changed = 1;
+      }
+    }
+
+    if (!changed) {
+      verdict->bounded = 1;
+      verdict->stack_need = (uint64_t)needs[0];
+      return;
+    }
+  }
+
+  verdict->bounded = 0;
+  verdict->stack_need = 0;
+}
+
+int verifier_verify(const Inst *insts, size_t insts_count, Verdict *verdict) {
+  Verifier verifier;
+  Verifier *v = &verifier;
+
+  memset(v, 0, sizeof(Verifier));
+  memset(verdict, 0, sizeof(Verdict));
+  v->insts = insts;
+  v->insts_count = insts_count;
+
+  if (insts_count == 0 || insts_count > INSTS_CAP)
+    return 0;
+
+  for (size_t pos = 0; pos < INSTS_CAP; pos++) {
+    v->states[pos].depth = -1;
+    v->arities[pos] = -1;
+  }
+
+  if (!verifier_protocol_mark(v))
+    return 0;
+
+  verifier_flow(v, 0, (Verifier_state){.depth = 0, .owner = -1, .base = -1});
+  for (size_t pos = 0; pos < insts_count; pos++) {
+    if (v->arities[pos] == -1)
+      continue;
+
+    Verifier_state entry = {
+        .depth = v->arities[pos],
+        .owner = (int64_t)pos,
+        .base = -1,
+    };
+    v->peaks[pos + 1] = entry.depth;
+    if (!verifier_flow(v, pos, entry))
+      VERIFIER_REJECT(pos);
+  }
+
+  while (v->worklist_count > 0) {
+    if (!verifier_step(v, v->worklist[--v->worklist_count]))
+      return 0;
+  }
+
+  for (size_t pos = 0; pos < insts_count; pos++) {
+    verdict->reached[pos] = v->states[pos].depth != -1;
+    verdict->depths[pos] =
+        v->states[pos].owner == -1 ? v->states[pos].depth : -1;
+  }
+  verifier_need_compute(v, verdict);
+
+  return 1;
+}
+
+#undef VERIFIER_IS
+#undef VERIFIER_REJECT
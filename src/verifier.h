@@ -0,0 +1,26 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+typedef struct {
+  // Most words the program holds on the stack at once, if bounded
+  uint64_t stack_need;
+  // Unset when calls recurse and the stack may grow without limit
+  int bounded;
+
+  // Insts some path of execution reaches
+  uint8_t reached[INSTS_CAP];
+  // Stack depth of each inst the top level reaches outside of any Fn, -1
+  // for the others
+  int64_t depths[INSTS_CAP];
+} Verdict;
+
+// Proves every reachable inst meets the stack, jump and register
+// discipline its unchecked twin relies on; 0 if it cannot
+int verifier_verify(const Inst *insts, size_t insts_count, Verdict *verdict);
+
+#endif
@@ -1,43 +1,341 @@
+// mmap, sigaction and sigsetjmp
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
-
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lanes.h"
+#include "pool.h"
+#include "simd.h"
 #include "table.h"
+#include "verifier.h"
 #include "vm.h"
 
-Vm vm = {0};
+// Set once by the first vm created; every thread stores the same value
+static _Atomic size_t vm_page_size = 0;
+
+// Whole pages holding words, the guard page not included
+static size_t vm_stack_bytes(const uint64_t words) {
+  size_t bytes = words * sizeof(Word) + vm_page_size - 1;
+  return bytes - bytes % vm_page_size;
+}
+
+// Reserves limit words and a PROT_NONE guard page past them, of which
+// only the first VM_STACK_CAP words are committed
+static Err vm_stack_map(const uint64_t limit, Word **stack_out,
+                        uint64_t *stack_cap, uint64_t *stack_limit) {
+  if (vm_page_size == 0)
+    vm_page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+  size_t reserved = vm_stack_bytes(limit) + vm_page_size;
+  void *stack = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+  if (stack == MAP_FAILED)
+    return VM_OUT_OF_MEMORY;
+
+  uint64_t cap = limit < VM_STACK_CAP ? limit : VM_STACK_CAP;
+  size_t committed = vm_stack_bytes(cap);
+  if (mprotect(stack, committed, PROT_READ | PROT_WRITE) != 0) {
+    munmap(stack, reserved);
+    return VM_OUT_OF_MEMORY;
+  }
+
+  *stack_out = (Word *)stack;
+  *stack_cap = committed / sizeof(Word);
+  *stack_limit = vm_stack_bytes(limit) / sizeof(Word);
+  return VM_OK;
+}
+
+static void vm_stack_unmap(Word *stack, const uint64_t stack_limit) {
+  if (stack != NULL)
+    munmap(stack, vm_stack_bytes(stack_limit) + vm_page_size);
+}
+
+static Err vm_stack_new(Vm *vm, const uint64_t limit) {
+  return vm_stack_map(limit, &vm->stack, &vm->stack_cap, &vm->stack_limit);
+}
+
+static void vm_stack_free(Vm *vm) {
+  vm_stack_unmap(vm->stack, vm->stack_limit);
+  vm->stack = NULL;
+}
+
+void vm_init(Vm *vm) {
+  Err err = vm_stack_new(vm, VM_STACK_LIMIT);
+  if (err != VM_OK) {
+    fprintf(stderr, "ERROR: %s\n", vm_err_to_str(err));
+    exit(13);
+  }
+  vm->stack_count = 0;
+  vm->program_size = 0;
+  vm->env = hash_table_new();
+
+  vm->reg[REG_IP].as_u64 = 0;
+  vm->reg[REG_FP].as_u64 = 0;
+  vm->reg[REG_SP].as_u64 = 0;
+  vm->reg[REG_RA].as_u64 = 0;
+  vm->reg[REG_CPSR].as_u64 = 0;
+
+  vm->fuel = UINT64_MAX;
+  vm->out = stdout;
+  vm->image = NULL;
+  vm->image_size = 0;
+
+  vm->tasks_count = 0;
+  vm->task = 0;
+  vm->tasks_live = 0;
+  vm->slice = UINT64_MAX;
+}
+
+static void vm_memos_free(Vm *vm) {
+  for (size_t i = 0; i < INSTS_CAP; i++) {
+    free(vm->memos[i]);
+    vm->memos[i] = NULL;
+  }
+}
+
+static void vm_arrays_free(Vm *vm) {
+  for (size_t i = 0; i < vm->arrays_count; i++) {
+    if (i >= vm->arrays_borrowed) {
+      free(vm->arrays[i]->data);
+      free(vm->arrays[i]);
+    }
+    vm->arrays[i] = NULL;
+  }
+  vm->arrays_count = 0;
+  vm->arrays_borrowed = 0;
+}
+
+static void vm_chan_wake(Chan *chan);
+
+static void vm_chans_free(Vm *vm) {
+  for (size_t i = 0; i < vm->chans_count; i++) {
+    Chan *chan = vm->chans[i];
+    vm->chans[i] = NULL;
+    // Woken first, as the chan may be gone once this vm lets go of it
+    vm_chan_wake(chan);
+    if (atomic_fetch_sub(&chan->refs, 1) > 1)
+      continue;
+
+    pthread_cond_destroy(&chan->moved);
+    pthread_mutex_destroy(&chan->lock);
+    free(chan->ring);
+    free(chan);
+  }
+  vm->chans_count = 0;
+}
+
+// The running task's stack is the vm's own
+static void vm_tasks_free(Vm *vm) {
+  for (size_t i = 0; i < vm->tasks_count; i++) {
+    Task *task = vm->tasks[i];
+    if (i != vm->task)
+      vm_stack_unmap(task->stack, task->stack_limit);
+    free(task);
+    vm->tasks[i] = NULL;
+  }
+  vm->tasks_count = 0;
+  vm->task = 0;
+  vm->tasks_live = 0;
+}
+
+void vm_destruct(Vm *vm) {
+  vm_tasks_free(vm);
+  vm_stack_free(vm);
+  hash_table_destruct(&vm->env);
+  vm_memos_free(vm);
+  vm_arrays_free(vm);
+  vm_chans_free(vm);
+  if (vm->image != NULL)
+    munmap(vm->image, vm->image_size);
+  vm->image = NULL;
+}
+
+// Insts whose checks the verifier discharges
+static int vm_inst_is_verifiable(const Inst_t type) {
+  switch (type) {
+  case INST_PUSH:
+  case INST_DUP:
+  case INST_PICK:
+  case INST_DEFL:
+  case INST_VARG:
+  case INST_VARL:
+  case INST_LDR:
+  case INST_POP:
+  case INST_PLUS:
+  case INST_PLUSF:
+  case INST_MINUS:
+  case INST_MULT:
+  case INST_DIV:
+  case INST_SHL:
+  case INST_SHR:
+  case INST_EQ:
+  case INST_NE:
+  case INST_GT:
+  case INST_LT:
+  case INST_PRINT:
+  case INST_PRINTS:
+  case INST_NEG:
+  case INST_DEFG:
+  case INST_INCG:
+  case INST_JMPA:
+  case INST_JMPT:
+  case INST_JMPNT:
+  case INST_FORLOOP:
+  case INST_STR:
+  case INST_MOV:
+  case INST_TAILCALL:
+  case INST_MEMOCALL:
+    return 1;
+  default:
+    return 0;
+  }
+}
 
-void vm_init(void) {
-  vm.stack_count = 0;
-  vm.program_size = 0;
-  vm.env = hash_table_new();
+// Rewrites the insts a verified program reaches to their unchecked twins,
+// provided it was proven to reach entry at the top level on an empty stack,
+// where the run starts; 0, leaving every check in place, otherwise
+static int vm_program_uncheck(Vm *vm, const uint64_t entry,
+                              Verdict *verdict) {
+  if (!verifier_verify(vm->program, vm->program_size, verdict) ||
+      verdict->depths[entry] != 0)
+    return 0;
+
+  for (size_t i = 0; i < vm->program_size; i++) {
+    Inst_t type = vm->program[i].type;
+    if (verdict->reached[i] && type <= INST_EOF && vm_inst_is_verifiable(type))
+      vm->program[i].type = INST_UNCHECKED(type);
+  }
 
-  vm.reg[REG_IP].as_u64 = 0;
-  vm.reg[REG_FP].as_u64 = 0;
-  vm.reg[REG_SP].as_u64 = 0;
-  vm.reg[REG_RA].as_u64 = 0;
-  vm.reg[REG_CPSR].as_u64 = 0;
+  return 1;
 }
 
-void vm_destruct(void) { hash_table_destruct(&vm.env); }
+void vm_program_append(Vm *vm, const Inst *insts, size_t insts_count) {
+  uint64_t start = vm->program_size > 0 ? vm->program_size - 1 : 0;
+  assert(start + insts_count < INSTS_CAP);
 
-void vm_program_load_from_memory(Inst *insts, size_t insts_count) {
+  for (size_t i = 0; i < insts_count; i++) {
+    vm->program[start + i] = insts[i];
+  }
+  vm->program_size = start + insts_count;
+
+  // A piece that failed leaves its frames and tasks behind; one that
+  // reached eof leaves only globals and the tasks it waited for
+  if (vm->task != 0 || vm->tasks_live > 0)
+    vm_tasks_free(vm);
+  vm->stack_count = 0;
+  memset(vm->reg, 0, sizeof(vm->reg));
+  vm->reg[REG_IP].as_u64 = start;
+
+  // Earlier pieces were proven without this one, so the whole program is
+  // verified again with the piece entered on an empty stack; if it does not
+  // verify, every inst goes back to being checked
+  Verdict verdict;
+  if (!vm_program_uncheck(vm, start, &verdict)) {
+    for (size_t i = 0; i < vm->program_size; i++)
+      vm->program[i].type = INST_BASE(vm->program[i].type);
+  }
+}
+
+void vm_program_load_from_memory(Vm *vm, Inst *insts, size_t insts_count) {
   assert(insts_count < INSTS_CAP);
 
   for (size_t i = 0; i < insts_count; i++) {
-    vm.program[i] = insts[i];
+    vm->program[i] = insts[i];
+  }
+
+  vm->program_size = insts_count;
+
+  // Verified programs run unchecked and reserve only the stack they need;
+  // the others keep every check
+  Verdict verdict;
+  if (!vm_program_uncheck(vm, 0, &verdict))
+    return;
+
+  uint64_t limit = verdict.stack_need + 1;
+  if (!verdict.bounded || limit >= vm->stack_limit || vm->stack_count > 0)
+    return;
+
+  Vm sized = {0};
+  if (vm_stack_new(&sized, limit) != VM_OK)
+    return;
+
+  vm_stack_free(vm);
+  vm->stack = sized.stack;
+  vm->stack_cap = sized.stack_cap;
+  vm->stack_limit = sized.stack_limit;
+}
+
+// Each frame saved its caller's fp two words below its own
+uint64_t vm_call_depth(const Vm *vm) {
+  uint64_t depth = 0;
+  uint64_t fp = vm->reg[REG_FP].as_u64;
+
+  while (fp >= 2 && fp <= vm->stack_count) {
+    uint64_t caller = vm->stack[fp - 2].as_u64;
+    if (caller >= fp)
+      break;
+
+    fp = caller;
+    depth++;
   }
 
-  vm.program_size = insts_count;
+  return depth;
+}
+
+char *vm_err_to_str(Err err) {
+  switch (err) {
+  case VM_OK:
+    return "ok";
+  case VM_STACK_OVERFLOW:
+    return "stack overflow";
+  case VM_STACK_UNDERFLOW:
+    return "stack underflow";
+  case VM_ILLEGAL_ACCESS:
+    return "illegal access";
+  case VM_DIV_BY_ZERO:
+    return "division by zero";
+  case VM_UNDEFINED_GLOBAL:
+    return "undefined global variable";
+  case VM_OUT_OF_FUEL:
+    return "out of fuel";
+  case VM_OUT_OF_BOUNDS:
+    return "index out of bounds";
+  case VM_OUT_OF_MEMORY:
+    return "out of memory";
+  case VM_DEADLOCK:
+    return "every task is blocked";
+  case VM_BAD_IMAGE:
+    return "bad image";
+  case VM_COMPILE_ERROR:
+    return "compile error";
+  default:
+    __builtin_unreachable();
+  }
 }
 
 char *vm_inst_t_to_str(Inst_t type) {
-  switch (type) {
+  switch (INST_BASE(type)) {
   case INST_PUSH:
     return "\tpush";
   case INST_POP:
     return "\tpop";
+  case INST_DUP:
+    return "\tdup";
+  case INST_PICK:
+    return "\tpick";
   case INST_PLUS:
     return "\tplus";
   case INST_PLUSF:
@@ -48,6 +346,10 @@ char *vm_inst_t_to_str(Inst_t type) {
     return "\tmult";
   case INST_DIV:
     return "\tdiv";
+  case INST_SHL:
+    return "\tshl";
+  case INST_SHR:
+    return "\tshr";
   case INST_EQ:
     return "\teq";
   case INST_NE:
@@ -62,6 +364,8 @@ char *vm_inst_t_to_str(Inst_t type) {
     return "\tneg";
   case INST_DEFG:
     return "\tdefg";
+  case INST_INCG:
+    return "\tincg";
   case INST_DEFL:
     return "\tdefl";
   case INST_VARG:
@@ -74,6 +378,8 @@ char *vm_inst_t_to_str(Inst_t type) {
     return "\tjmpt";
   case INST_JMPNT:
     return "\tjmpnt";
+  case INST_FORLOOP:
+    return "\tforloop";
   case INST_RET:
     return "\tret";
   case INST_LDR:
@@ -82,6 +388,48 @@ char *vm_inst_t_to_str(Inst_t type) {
     return "\tstr";
   case INST_MOV:
     return "\tmov";
+  case INST_TAILCALL:
+    return "\ttailcall";
+  case INST_MEMOCALL:
+    return "\tmemocall";
+  case INST_MEMORET:
+    return "\tmemoret";
+  case INST_ANEW:
+    return "\tanew";
+  case INST_ALOAD:
+    return "\taload";
+  case INST_ASTORE:
+    return "\tastore";
+  case INST_ALEN:
+    return "\talen";
+  case INST_ASUM:
+    return "\tasum";
+  case INST_ADOT:
+    return "\tadot";
+  case INST_AADD:
+    return "\taadd";
+  case INST_ASCALE:
+    return "\tascale";
+  case INST_AMASK:
+    return "\tamask";
+  case INST_VEXPR:
+    return "\tvexpr";
+  case INST_SPAWN:
+    return "\tspawn";
+  case INST_YIELD:
+    return "\tyield";
+  case INST_JOIN:
+    return "\tjoin";
+  case INST_CHAN:
+    return "\tchan";
+  case INST_SEND:
+    return "\tsend";
+  case INST_RECV:
+    return "\trecv";
+  case INST_PMAP:
+    return "\tpmap";
+  case INST_PREDUCE:
+    return "\tpreduce";
   case INST_LABEL:
     return "Fn";
   case INST_EOF:
@@ -101,6 +449,15 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
         {
             .has_operand = 0,
         },
+    [INST_DUP] =
+        {
+            .has_operand = 0,
+        },
+    [INST_PICK] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
     [INST_PLUS] =
         {
             .has_operand = 0,
@@ -121,6 +478,16 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
         {
             .has_operand = 0,
         },
+    [INST_SHL] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_SHR] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
     [INST_EQ] =
         {
             .has_operand = 0,
@@ -154,6 +521,11 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
             .has_operand = 1,
             .operand_type = WORD_SV,
         },
+    [INST_INCG] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_SV,
+        },
     [INST_DEFL] =
         {
             .has_operand = 1,
@@ -184,6 +556,11 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
             .has_operand = 1,
             .operand_type = WORD_U64,
         },
+    [INST_FORLOOP] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
     [INST_RET] =
         {
             .has_operand = 0,
@@ -203,6 +580,98 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
             .has_operand = 1,
             .operand_type = WORD_REG,
         },
+    [INST_TAILCALL] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_MEMOCALL] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_MEMORET] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_ANEW] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_ALOAD] =
+        {
+            .has_operand = 0,
+        },
+    [INST_ASTORE] =
+        {
+            .has_operand = 0,
+        },
+    [INST_ALEN] =
+        {
+            .has_operand = 0,
+        },
+    [INST_ASUM] =
+        {
+            .has_operand = 0,
+        },
+    [INST_ADOT] =
+        {
+            .has_operand = 0,
+        },
+    [INST_AADD] =
+        {
+            .has_operand = 0,
+        },
+    [INST_ASCALE] =
+        {
+            .has_operand = 0,
+        },
+    [INST_AMASK] =
+        {
+            .has_operand = 0,
+        },
+    [INST_VEXPR] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_SPAWN] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_YIELD] =
+        {
+            .has_operand = 0,
+        },
+    [INST_JOIN] =
+        {
+            .has_operand = 0,
+        },
+    [INST_CHAN] =
+        {
+            .has_operand = 0,
+        },
+    [INST_SEND] =
+        {
+            .has_operand = 0,
+        },
+    [INST_RECV] =
+        {
+            .has_operand = 0,
+        },
+    [INST_PMAP] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
+    [INST_PREDUCE] =
+        {
+            .has_operand = 1,
+            .operand_type = WORD_U64,
+        },
     [INST_LABEL] =
         {
             .has_operand = 1,
@@ -214,12 +683,12 @@ static Inst_Context INST_CONTEXTS[INST_EOF + 1] = {
         },
 };
 
-void vm_stack_dump(void) {
-  printf("Stack: \n");
-  for (size_t i = 0; i < (size_t)vm.stack_count; i++) {
-    printf("\t%zu: %lld\n", i, vm.stack[i].as_u64);
+void vm_stack_dump(const Vm *vm) {
+  fprintf(vm->out, "Stack: \n");
+  for (size_t i = 0; i < (size_t)vm->stack_count; i++) {
+    fprintf(vm->out, "\t%zu: %lld\n", i, vm->stack[i].as_u64);
   }
-  printf("-----\n\n");
+  fprintf(vm->out, "-----\n\n");
 }
 
 __attribute__((unused)) static char *vm_word_reg_translate(uint64_t reg_no) {
@@ -239,372 +708,2053 @@ __attribute__((unused)) static char *vm_word_reg_translate(uint64_t reg_no) {
   }
 }
 
-void vm_inst_dump(const Inst *inst) {
-  printf("%s ", vm_inst_t_to_str(inst->type));
-  if (INST_CONTEXTS[inst->type].has_operand) {
-    switch (INST_CONTEXTS[inst->type].operand_type) {
+void vm_inst_dump(FILE *out, const Inst *inst) {
+  fprintf(out, "%s ", vm_inst_t_to_str(inst->type));
+  Inst_t type = INST_BASE(inst->type);
+  if (INST_CONTEXTS[type].has_operand) {
+    switch (INST_CONTEXTS[type].operand_type) {
     case WORD_ANY:
-      printf("%lld", inst->operand.as_u64);
+      fprintf(out, "%lld", inst->operand.as_u64);
       break;
     case WORD_REG:
-      printf("%s", vm_word_reg_translate(inst->operand.as_u64));
+      fprintf(out, "%s", vm_word_reg_translate(inst->operand.as_u64));
       break;
     case WORD_U64:
-      printf("%lld", inst->operand.as_u64);
+      fprintf(out, "%lld", inst->operand.as_u64);
       break;
     case WORD_I64:
-      printf("%lld", inst->operand.as_i64);
+      fprintf(out, "%lld", inst->operand.as_i64);
       break;
     case WORD_F64:
-      printf("%f", inst->operand.as_f64);
+      fprintf(out, "%f", inst->operand.as_f64);
       break;
     case WORD_SV:
-      printf("%.*s", inst->operand.as_sv.len, inst->operand.as_sv.str);
+      fprintf(out, "%.*s", inst->operand.as_sv.len, inst->operand.as_sv.str);
       break;
     case WORD_PTR:
-      printf("%p", inst->operand.as_ptr);
+      fprintf(out, "%p", inst->operand.as_ptr);
       break;
     }
   }
-  printf("\n");
+  fprintf(out, "\n");
 }
 
-void vm_program_dump(void) {
-  printf("Program: \n");
-  for (size_t i = 0; i < (size_t)vm.program_size; i++) {
-    Inst *inst = &vm.program[i];
+void vm_program_dump(const Vm *vm) {
+  fprintf(vm->out, "Program: \n");
+  for (size_t i = 0; i < (size_t)vm->program_size; i++) {
+    const Inst *inst = &vm->program[i];
 #ifdef DEBUG
-    printf("%zu: ", i);
+    fprintf(vm->out, "%zu: ", i);
 #endif
-    vm_inst_dump(inst);
+    vm_inst_dump(vm->out, inst);
   }
-  printf("-----\n\n");
+  fprintf(vm->out, "-----\n\n");
 }
 
-inline static Word vm_env_resolve(const Sv label) {
-  Word *data = hash_table_get(&vm.env, label);
-  if (data == NULL) {
-    fprintf(stderr, "Undefined global variable %.*s", label.len, label.str);
-    exit(12);
+void vm_memo_dump(const Vm *vm) {
+  int dumped = 0;
+
+  for (size_t i = 0; i < INSTS_CAP; i++) {
+    Memo *memo = vm->memos[i];
+    if (memo == NULL)
+      continue;
+
+    if (!dumped++)
+      fprintf(vm->out, "Memo: \n");
+    fprintf(vm->out, "\tFn %zu: hits %zu, misses %zu, evictions %zu\n", i,
+            (size_t)memo->hits, (size_t)memo->misses,
+            (size_t)memo->evictions);
   }
 
-  return *hash_table_get(&vm.env, label);
+  if (dumped)
+    fprintf(vm->out, "-----\n\n");
 }
 
-#ifndef DEBUG
-#define SP_INCREMENT vm.reg[REG_SP].as_u64++;
-#define SP_DECREMENT vm.reg[REG_SP].as_u64--;
-#else
-#define SP_INCREMENT                                                           \
-  do {                                                                         \
-    vm.reg[REG_SP].as_u64++;                                                   \
-    printf("IP    : %lld\n", vm.ip);                                           \
-    printf("RA    : %lld\n", vm.reg[REG_RA].as_u64);                           \
-    printf("CPSR  : %lld\n", vm.reg[REG_CPSR].as_u64);                         \
-    printf("FP    : %lld\n", vm.reg[REG_FP].as_u64);                           \
-    printf("SP++  : %lld\n", vm.reg[REG_SP].as_u64);                           \
-  } while (0)
-#define SP_DECREMENT                                                           \
-  do {                                                                         \
-    vm.reg[REG_SP].as_u64--;                                                   \
-    printf("IP    : %lld\n", vm.ip);                                           \
-    printf("RA    : %lld\n", vm.reg[REG_RA].as_u64);                           \
-    printf("CPSR  : %lld\n", vm.reg[REG_CPSR].as_u64);                         \
-    printf("FP    : %lld\n", vm.reg[REG_FP].as_u64);                           \
-    printf("SP--  : %lld\n", vm.reg[REG_SP].as_u64);                           \
-  } while (0)
-#endif
+// The args form the key; returns the set to probe, or -1 when they are
+// too many or too large to be cached
+static int64_t vm_memo_key(const Word *args, const uint64_t arity) {
+  if (arity > MEMO_ARITY_CAP)
+    return -1;
 
-void vm_execute(void) {
-  int n = 1;
-#ifdef DEBUG
-  n = 100;
-#endif
+  uint64_t hash = arity;
+  for (size_t i = 0; i < arity; i++) {
+    uint64_t arg = args[i].as_u64;
+    if (arg >= MEMO_ARG_LIMIT)
+      return -1;
 
-  while (n) {
-    const Inst inst = vm.program[vm.reg[REG_IP].as_u64++];
-    Word word_one;
-    Word word_two;
-    uint64_t reg_no;
-    uint64_t jmp_offset;
-    uint64_t fp;
+    hash = (hash ^ arg) * 0x100000001b3;
+  }
 
-#ifdef DEBUG
-    n--;
-    vm_stack_dump();
-    vm_inst_dump(&inst);
-#endif
+  return (hash ^ (hash >> 29)) % MEMO_SETS_CAP;
+}
 
-    switch (inst.type) {
-    case INST_PUSH:
-      assert(vm.stack_count + 1 < VM_STACK_CAP && "Stack overflow");
+inline static int vm_memo_entry_matches(const Memo_entry *entry,
+                                        const Word *args,
+                                        const uint64_t arity) {
+  if (!entry->used)
+    return 0;
 
-      vm.stack[vm.stack_count++] = inst.operand;
-      SP_INCREMENT;
-      continue;
+  for (size_t i = 0; i < arity; i++) {
+    if (entry->args[i] != args[i].as_u64)
+      return 0;
+  }
 
-    case INST_POP:
-      assert(vm.stack_count > 0 && "Stack underflow");
+  return 1;
+}
 
-      vm.stack_count--;
-      SP_DECREMENT;
-      continue;
+Word *vm_memo_lookup(Memo **memos, const Addr label, const Word *args,
+                     const uint64_t arity) {
+  int64_t set = vm_memo_key(args, arity);
+  if (set == -1)
+    return NULL;
 
-    case INST_PLUS:
-      assert(vm.stack_count > 1 && "Stack underflow");
+  Memo *memo = memos[label];
+  if (memo == NULL) {
+    memo = memos[label] = (Memo *)calloc(1, sizeof(Memo));
+  }
 
-      word_one = vm.stack[vm.stack_count - 1];
-      vm.stack[--vm.stack_count - 1].as_u64 += word_one.as_u64;
-      SP_DECREMENT;
-      continue;
+  for (size_t way = 0; way < 2; way++) {
+    Memo_entry *entry = &memo->ways[set][way];
 
-    case INST_PLUSF:
-      assert(vm.stack_count > 1 && "Stack underflow");
+    if (vm_memo_entry_matches(entry, args, arity)) {
+      memo->lru[set] = !way;
+      memo->hits++;
+      return &entry->result;
+    }
+  }
 
-      word_one = vm.stack[vm.stack_count - 1];
-      vm.stack[--vm.stack_count - 1].as_f64 += word_one.as_f64;
-      SP_DECREMENT;
-      continue;
+  memo->misses++;
+  return NULL;
+}
 
-    case INST_MINUS:
-      assert(vm.stack_count > 1);
+void vm_memo_store(Memo **memos, const Addr label, const Word *args,
+                   const uint64_t arity, const Word result) {
+  int64_t set = vm_memo_key(args, arity);
+  Memo *memo = memos[label];
+  if (set == -1 || memo == NULL)
+    return;
 
-      word_one = vm.stack[vm.stack_count - 1];
-      vm.stack[--vm.stack_count - 1].as_u64 -= word_one.as_u64;
-      SP_DECREMENT;
-      continue;
+  // Refill a way that already holds the key before evicting the lru one
+  size_t way = memo->lru[set];
+  if (vm_memo_entry_matches(&memo->ways[set][!way], args, arity))
+    way = !way;
 
-    case INST_MULT:
-      assert(vm.stack_count > 1 && "Stack underflow");
+  Memo_entry *entry = &memo->ways[set][way];
+  if (entry->used && !vm_memo_entry_matches(entry, args, arity))
+    memo->evictions++;
 
-      word_one = vm.stack[vm.stack_count - 1];
-      vm.stack[--vm.stack_count - 1].as_u64 *= word_one.as_u64;
-      SP_DECREMENT;
-      continue;
+  for (size_t i = 0; i < arity; i++) {
+    entry->args[i] = args[i].as_u64;
+  }
+  entry->result = result;
+  entry->used = 1;
+  memo->lru[set] = !way;
+}
 
-    case INST_DIV:
-      assert(vm.stack_count > 1 && "Stack underflow");
+// Handles are registry indices plus one so that 0 is never a valid array
+inline static Array *vm_array_resolve(Vm *vm, const Word handle) {
+  if (handle.as_u64 == 0 || handle.as_u64 > vm->arrays_count)
+    return NULL;
 
-      word_one = vm.stack[vm.stack_count - 1];
-      assert(word_one.as_u64 != 0);
-      vm.stack[--vm.stack_count - 1].as_u64 /= word_one.as_u64;
-      SP_DECREMENT;
-      continue;
+  return vm->arrays[handle.as_u64 - 1];
+}
 
-    case INST_EQ:
-      assert(vm.stack_count > 1 && "Stack underflow");
+// As vm_array_resolve, for the insts that write the array
+inline static Array *vm_array_resolve_mut(Vm *vm, const Word handle) {
+  if (handle.as_u64 <= vm->arrays_borrowed)
+    return NULL;
 
-      word_two = vm.stack[vm.stack_count - 2];
-      word_one = vm.stack[vm.stack_count - 1];
+  return vm_array_resolve(vm, handle);
+}
 
-      uint64_t eq = 0;
-      if (word_one.as_u64 == word_two.as_u64)
-        eq = 1;
+static Err vm_array_new(Vm *vm, const Word_t type, const uint64_t len,
+                        Word *handle) {
+  if (vm->arrays_count >= VM_ARRAYS_CAP || len > VM_ARRAY_LEN_CAP)
+    return VM_OUT_OF_MEMORY;
+
+  // Rounded up to whole vectors so kernels may load the last one unmasked
+  size_t size = len * sizeof(int64_t) + VM_ARRAY_ALIGN - 1;
+  size -= size % VM_ARRAY_ALIGN;
+  if (size == 0)
+    size = VM_ARRAY_ALIGN;
+
+  Array *array = (Array *)malloc(sizeof(Array));
+  void *data = aligned_alloc(VM_ARRAY_ALIGN, size);
+  if (array == NULL || data == NULL) {
+    free(array);
+    free(data);
+    return VM_OUT_OF_MEMORY;
+  }
+  memset(data, 0, size);
 
-      vm.stack[vm.stack_count - 2] = (Word){.as_u64 = eq};
+  array->type = type;
+  array->len = len;
+  array->data = data;
 
-      vm.stack_count -= 1;
-      SP_DECREMENT;
+  vm->arrays[vm->arrays_count++] = array;
+  handle->as_u64 = vm->arrays_count;
+  return VM_OK;
+}
 
-      continue;
+// Handles are registry indices plus one, like arrays'
+inline static Chan *vm_chan_resolve(Vm *vm, const Word handle) {
+  if (handle.as_u64 == 0 || handle.as_u64 > vm->chans_count)
+    return NULL;
 
-    case INST_NE:
-      assert(vm.stack_count > 1 && "Stack underflow");
+  return vm->chans[handle.as_u64 - 1];
+}
 
-      word_two = vm.stack[vm.stack_count - 2];
-      word_one = vm.stack[vm.stack_count - 1];
+// Rounds cap up to a power of two so slots are counters masked
+static Err vm_chan_new(Vm *vm, const uint64_t cap, Word *handle) {
+  if (vm->chans_count >= VM_CHANS_CAP || cap > VM_CHAN_LEN_CAP)
+    return VM_OUT_OF_MEMORY;
+
+  uint64_t len = 1;
+  while (len < cap)
+    len <<= 1;
+
+  Chan *chan = (Chan *)aligned_alloc(_Alignof(Chan), sizeof(Chan));
+  Word *ring = (Word *)malloc(len * sizeof(Word));
+  if (chan == NULL || ring == NULL) {
+    free(chan);
+    free(ring);
+    return VM_OUT_OF_MEMORY;
+  }
 
-      uint64_t ne = 0;
-      if (word_one.as_u64 != word_two.as_u64)
-        ne = 1;
+  chan->ring = ring;
+  chan->mask = len - 1;
+  atomic_init(&chan->refs, 1);
+  atomic_init(&chan->waiters, 0);
+  pthread_mutex_init(&chan->lock, NULL);
+  pthread_cond_init(&chan->moved, NULL);
+  atomic_init(&chan->head, 0);
+  atomic_init(&chan->receiver, NULL);
+  atomic_init(&chan->tail, 0);
+  atomic_init(&chan->sender, NULL);
+
+  vm->chans[vm->chans_count++] = chan;
+  handle->as_u64 = vm->chans_count;
+  return VM_OK;
+}
 
-      vm.stack[vm.stack_count - 2] = (Word){.as_u64 = ne};
+// Each end of a channel belongs to the first vm to use it
+static int vm_chan_claim(_Atomic(const struct Vm *) *end, const Vm *vm) {
+  const Vm *owner = atomic_load_explicit(end, memory_order_relaxed);
+  if (owner == NULL && atomic_compare_exchange_strong(end, &owner, vm))
+    return 1;
 
-      vm.stack_count -= 1;
+  return owner == vm;
+}
+
+// Wakes the threads of other vms waiting on chan; only shared channels
+// pay for it. The fence pairs with vm_chan_wait's, so that either the
+// waiter sees the counter moved or this sees the waiter.
+static void vm_chan_wake(Chan *chan) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&chan->waiters, memory_order_relaxed) == 0)
+    return;
+
+  pthread_mutex_lock(&chan->lock);
+  pthread_cond_broadcast(&chan->moved);
+  pthread_mutex_unlock(&chan->lock);
+}
+
+// The sender owns tail and the receiver head; each only reads the
+// other's counter, acquiring the slots it released
+static int vm_chan_send(Chan *chan, const Word word) {
+  uint64_t tail = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&chan->head, memory_order_acquire);
+  if (tail - head > chan->mask)
+    return 0;
+
+  chan->ring[tail & chan->mask] = word;
+  atomic_store_explicit(&chan->tail, tail + 1, memory_order_release);
+  if (atomic_load_explicit(&chan->refs, memory_order_relaxed) > 1)
+    vm_chan_wake(chan);
+  return 1;
+}
+
+static int vm_chan_recv(Chan *chan, Word *word) {
+  uint64_t head = atomic_load_explicit(&chan->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&chan->tail, memory_order_acquire);
+  if (head == tail)
+    return 0;
+
+  *word = chan->ring[head & chan->mask];
+  atomic_store_explicit(&chan->head, head + 1, memory_order_release);
+  if (atomic_load_explicit(&chan->refs, memory_order_relaxed) > 1)
+    vm_chan_wake(chan);
+  return 1;
+}
+
+// Whether a task parked on chan can make progress
+static int vm_chan_ready(const Chan *chan, const uint8_t sending) {
+  uint64_t head = atomic_load_explicit(&chan->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&chan->tail, memory_order_acquire);
+  return sending ? tail - head <= chan->mask : head != tail;
+}
+
+// Parks the thread until chan can make progress, another vm lets go of it,
+// or VM_CHAN_WAIT_NS pass; 0 if it cannot make progress and no other vm
+// holds it, so that nothing ever will
+static int vm_chan_wait(Chan *chan, const uint8_t sending) {
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += VM_CHAN_WAIT_NS;
+  until.tv_sec += until.tv_nsec / 1000000000;
+  until.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&chan->lock);
+  atomic_fetch_add(&chan->waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  int err = 0;
+  while (err == 0 && !vm_chan_ready(chan, sending) &&
+         atomic_load(&chan->refs) > 1)
+    err = pthread_cond_timedwait(&chan->moved, &chan->lock, &until);
+  atomic_fetch_sub(&chan->waiters, 1);
+  pthread_mutex_unlock(&chan->lock);
+
+  return vm_chan_ready(chan, sending) || atomic_load(&chan->refs) > 1;
+}
+
+Err vm_chan_share(Vm *vm, const Word handle, Vm *to, Word *shared) {
+  Chan *chan = vm_chan_resolve(vm, handle);
+  if (chan == NULL || to == vm)
+    return VM_ILLEGAL_ACCESS;
+  if (to->chans_count >= VM_CHANS_CAP)
+    return VM_OUT_OF_MEMORY;
+
+  atomic_fetch_add(&chan->refs, 1);
+  to->chans[to->chans_count++] = chan;
+  shared->as_u64 = to->chans_count;
+  return VM_OK;
+}
+
+#define VEXPR_OP(prog, i) ((Vexpr_op)(((prog) >> (4 * (i))) & 0xf))
+
+// Runs `for (i = counter; i < limit; i++) dst[i] = prog(i)` with counter,
+// limit, step, dst and the operands of prog on top. Lanes hold the raw 64
+// bits of elements, which is what the scalar loop computes on as well.
+static Err vm_vexpr_run(Vm *vm, const uint64_t prog) {
+  size_t operands = 0;
+  size_t depth = 0;
+
+  for (size_t i = 0; i < VEXPR_OPS_CAP && VEXPR_OP(prog, i); i++) {
+    switch (VEXPR_OP(prog, i)) {
+    case VEXPR_ELEM:
+    case VEXPR_SCALAR:
+      operands++;
+      // fallthrough
+    case VEXPR_INDEX:
+      if (++depth > VEXPR_DEPTH_CAP)
+        return VM_ILLEGAL_ACCESS;
+      break;
+    case VEXPR_PLUS:
+    case VEXPR_MINUS:
+    case VEXPR_MULT:
+      if (depth-- < 2)
+        return VM_ILLEGAL_ACCESS;
+      break;
+    case VEXPR_NEG:
+      if (depth < 1)
+        return VM_ILLEGAL_ACCESS;
+      break;
+    default:
+      return VM_ILLEGAL_ACCESS;
+    }
+  }
+
+  if (depth != 1)
+    return VM_ILLEGAL_ACCESS;
+  if (vm->stack_count < operands + 4)
+    return VM_STACK_UNDERFLOW;
+
+  const Word *args = &vm->stack[vm->stack_count - operands];
+  uint64_t start = args[-4].as_u64;
+  uint64_t limit = args[-3].as_u64;
+  if (start >= limit)
+    return VM_OK;
+
+  Array *dst = vm_array_resolve_mut(vm, args[-1]);
+  if (dst == NULL)
+    return VM_ILLEGAL_ACCESS;
+
+  // Stops where the shortest array runs out, as the scalar loop would
+  uint64_t end = limit < dst->len ? limit : dst->len;
+  const int64_t *elems[VEXPR_OPS_CAP] = {0};
+
+  for (size_t i = 0, operand = 0; operand < operands; i++) {
+    if (VEXPR_OP(prog, i) == VEXPR_SCALAR) {
+      operand++;
+    } else if (VEXPR_OP(prog, i) == VEXPR_ELEM) {
+      Array *array = vm_array_resolve(vm, args[operand]);
+      if (array == NULL)
+        return VM_ILLEGAL_ACCESS;
+
+      elems[operand++] = array->data;
+      end = array->len < end ? array->len : end;
+    }
+  }
+
+  // Fuel burns as the forloop's backward jumps would. Short of it, the
+  // loop runs as far as the fuel goes and leaves its counter there, to be
+  // picked up by running the vexpr again once the vm resumes.
+  uint64_t stop = end;
+  if (end > start && end - start - 1 >= vm->fuel)
+    stop = start + vm->fuel;
+  if (stop > start)
+    vm->fuel -= stop - start - 1;
+
+  const Simd_kernels *kernels = simd_kernels();
+  int64_t lanes[VEXPR_DEPTH_CAP][VEXPR_BLOCK];
+  const int64_t *tops[VEXPR_DEPTH_CAP];
+
+  for (uint64_t base = start; base < stop; base += VEXPR_BLOCK) {
+    size_t n = stop - base < VEXPR_BLOCK ? stop - base : VEXPR_BLOCK;
+    size_t operand = 0;
+    depth = 0;
+
+    for (size_t i = 0; i < VEXPR_OPS_CAP && VEXPR_OP(prog, i); i++) {
+      Vexpr_op op = VEXPR_OP(prog, i);
+
+      switch (op) {
+      case VEXPR_ELEM:
+        tops[depth++] = elems[operand++] + base;
+        break;
+      case VEXPR_SCALAR:
+        for (size_t j = 0; j < n; j++) {
+          lanes[depth][j] = args[operand].as_i64;
+        }
+        operand++;
+        tops[depth] = lanes[depth];
+        depth++;
+        break;
+      case VEXPR_INDEX:
+        for (size_t j = 0; j < n; j++) {
+          lanes[depth][j] = (int64_t)(base + j);
+        }
+        tops[depth] = lanes[depth];
+        depth++;
+        break;
+      case VEXPR_PLUS:
+      case VEXPR_MINUS:
+      case VEXPR_MULT: {
+        int64_t *lhs = lanes[depth - 2];
+
+        if (op == VEXPR_PLUS)
+          kernels->add_i64(lhs, tops[depth - 2], tops[depth - 1], n);
+        else if (op == VEXPR_MINUS)
+          kernels->sub_i64(lhs, tops[depth - 2], tops[depth - 1], n);
+        else
+          kernels->mul_i64(lhs, tops[depth - 2], tops[depth - 1], n);
+
+        tops[--depth - 1] = lhs;
+        break;
+      }
+      case VEXPR_NEG:
+        kernels->scale_i64(lanes[depth - 1], tops[depth - 1], -1, n);
+        tops[depth - 1] = lanes[depth - 1];
+        break;
+      default:
+        __builtin_unreachable();
+      }
+    }
+
+    memmove((int64_t *)dst->data + base, tops[0], n * sizeof(int64_t));
+  }
+
+  if (stop < end) {
+    vm->stack[vm->stack_count - operands - 4].as_u64 = stop;
+    vm->fuel = 0;
+    return VM_OUT_OF_FUEL;
+  }
+
+  return end < limit ? VM_OUT_OF_BOUNDS : VM_OK;
+}
+
+#undef VEXPR_OP
+
+inline static Word vm_env_resolve(Vm *vm, const Sv label) {
+  Word *data = hash_table_get(&vm->env, label);
+  if (data == NULL) {
+    fprintf(stderr, "Undefined global variable %.*s", label.len, label.str);
+    exit(12);
+  }
+
+  return *hash_table_get(&vm->env, label);
+}
+
+static void vm_task_save(const Vm *vm, Task *task) {
+  task->stack = vm->stack;
+  task->stack_cap = vm->stack_cap;
+  task->stack_limit = vm->stack_limit;
+  task->stack_count = vm->stack_count;
+  memcpy(task->reg, vm->reg, sizeof(vm->reg));
+}
+
+static void vm_task_load(Vm *vm, const Task *task) {
+  vm->stack = task->stack;
+  vm->stack_cap = task->stack_cap;
+  vm->stack_limit = task->stack_limit;
+  vm->stack_count = task->stack_count;
+  memcpy(vm->reg, task->reg, sizeof(vm->reg));
+}
+
+// Round robin from the running task, which comes last; -1 if no task can
+// make progress
+static int64_t vm_task_next(const Vm *vm) {
+  for (size_t i = 1; i <= vm->tasks_count; i++) {
+    uint64_t no = (vm->task + i) % vm->tasks_count;
+    const Task *task = vm->tasks[no];
+
+    if (task->done)
+      continue;
+    if (task->joining && !vm->tasks[task->joining]->done)
+      continue;
+    if (task->parked && !vm_chan_ready(task->parked, task->parked_sending))
+      continue;
+    if (task->draining && vm->tasks_live > 0)
+      continue;
+
+    return (int64_t)no;
+  }
+
+  return -1;
+}
+
+static void vm_task_switch(Vm *vm, const uint64_t no) {
+  vm->slice = VM_TASK_SLICE;
+  if (no == vm->task)
+    return;
+
+  vm_task_save(vm, vm->tasks[vm->task]);
+  vm_task_load(vm, vm->tasks[no]);
+  vm->task = no;
+}
+
+// A task parked on a channel another vm holds, NULL if none
+static Task *vm_task_parked_shared(const Vm *vm) {
+  for (size_t i = 0; i < vm->tasks_count; i++) {
+    Task *task = vm->tasks[i];
+    if (!task->done && task->parked != NULL &&
+        atomic_load(&task->parked->refs) > 1)
+      return task;
+  }
+
+  return NULL;
+}
+
+// The running task cannot go on; it picks up at resume once it can. When
+// no task can, only another vm moving a shared channel ever lets one, so
+// the thread waits on such a channel until some task is ready.
+static Err vm_task_block(Vm *vm, const Addr resume) {
+  int64_t next;
+  while ((next = vm_task_next(vm)) == -1) {
+    Task *task = vm_task_parked_shared(vm);
+    if (task == NULL)
+      return VM_DEADLOCK;
+    vm_chan_wait(task->parked, task->parked_sending);
+  }
+
+  vm->reg[REG_IP].as_u64 = resume;
+  vm_task_switch(vm, (uint64_t)next);
+  return VM_OK;
+}
+
+// The running task waits on chan, and runs its send or recv again once
+// that can go through. Without other tasks only another vm holding chan
+// ever lets it, so the thread waits for one to.
+static Err vm_task_park(Vm *vm, Chan *chan, const uint8_t sending) {
+  if (vm->tasks_count == 0) {
+    if (!vm_chan_wait(chan, sending))
+      return VM_DEADLOCK;
+    vm->reg[REG_IP].as_u64--;
+    return VM_OK;
+  }
+
+  Task *task = vm->tasks[vm->task];
+  task->parked = chan;
+  task->parked_sending = sending;
+  return vm_task_block(vm, vm->reg[REG_IP].as_u64 - 1);
+}
+
+// Called when the running task's slice runs out at a back-edge to resume;
+// 1 if another task now runs
+static int vm_task_preempt(Vm *vm, const Addr resume) {
+  vm->slice = VM_TASK_SLICE;
+  if (vm->tasks_count == 0)
+    return 0;
+
+  int64_t next = vm_task_next(vm);
+  if (next == -1 || (uint64_t)next == vm->task)
+    return 0;
+
+  vm->reg[REG_IP].as_u64 = resume;
+  vm_task_switch(vm, (uint64_t)next);
+  return 1;
+}
+
+// Frames a call to label with args as the only one on stack, as if made
+// with fp and ra of 0, so that its ret lands on ret; returns the words
+// the frame takes
+static uint64_t vm_frame_enter(Word *stack, Word *reg, const Addr label,
+                               const Word *args, const uint64_t arity,
+                               const Addr ret) {
+  stack[0].as_u64 = 0;
+  stack[1].as_u64 = 0;
+  memcpy(&stack[2], args, arity * sizeof(Word));
+
+  reg[REG_IP].as_u64 = label;
+  reg[REG_FP].as_u64 = 2;
+  reg[REG_CPSR].as_u64 = 2;
+  reg[REG_SP].as_u64 = arity + 2;
+  reg[REG_RA].as_u64 = ret;
+  return arity + 2;
+}
+
+// Starts label on its own stack with the top arity words as args. Its ret
+// lands on the program's final eof, which ends it. The top level becomes
+// task 0 on the first spawn.
+static Err vm_task_spawn(Vm *vm, const Addr label, const uint64_t arity,
+                         Word *handle) {
+  if (vm->tasks_count == 0) {
+    Task *top = (Task *)calloc(1, sizeof(Task));
+    if (top == NULL)
+      return VM_OUT_OF_MEMORY;
+
+    vm->tasks[vm->tasks_count++] = top;
+    vm->task = 0;
+    vm->slice = VM_TASK_SLICE;
+  }
+
+  if (vm->tasks_count == VM_TASKS_CAP)
+    return VM_OUT_OF_MEMORY;
+
+  Task *task = (Task *)calloc(1, sizeof(Task));
+  if (task == NULL || vm_stack_map(VM_TASK_STACK_LIMIT, &task->stack,
+                                   &task->stack_cap,
+                                   &task->stack_limit) != VM_OK) {
+    free(task);
+    return VM_OUT_OF_MEMORY;
+  }
+
+  task->stack_count =
+      vm_frame_enter(task->stack, task->reg, label,
+                     &vm->stack[vm->stack_count - arity], arity,
+                     vm->program_size - 1);
+
+  handle->as_u64 = vm->tasks_count;
+  vm->tasks[vm->tasks_count++] = task;
+  vm->tasks_live++;
+  return VM_OK;
+}
+
+// The running task reached eof: its result is rax, and its stack goes
+// once another task runs
+static Err vm_task_finish(Vm *vm) {
+  Task *task = vm->tasks[vm->task];
+  task->result = vm->reg[REG_RAX];
+  task->done = 1;
+  vm->tasks_live--;
+
+  Err err = vm_task_block(vm, vm->reg[REG_IP].as_u64);
+  if (err != VM_OK)
+    return err;
+
+  vm_stack_unmap(task->stack, task->stack_limit);
+  task->stack = NULL;
+  return VM_OK;
+}
+
+static Err vm_run_guarded(Vm *vm);
+
+// parallel_map and parallel_reduce run a Fn over chunks of an array, each
+// worker on a vm of its own with copies of the caller's program and
+// globals; stores to globals stay in the copy. The caller's arrays, bar the
+// map's results, are shared for reading only
+typedef struct {
+  const Vm *caller;
+  Addr label;
+  const Array *array;
+  uint64_t arrays_count;
+
+  // Results of a map, NULL for a reduce
+  Array *mapped;
+  // Fold of each chunk of a reduce; the first one starts from init, the
+  // others from their first element
+  Word init;
+  Word *partials;
+
+  Vm **workers;
+  Err *errs;
+} Vm_parallel;
+
+static Vm *vm_worker_new(const Vm *caller, const uint64_t arrays_count) {
+  Vm *vm = (Vm *)calloc(1, sizeof(Vm));
+  if (vm == NULL || vm_stack_new(vm, VM_STACK_LIMIT) != VM_OK) {
+    free(vm);
+    return NULL;
+  }
+
+  memcpy(vm->program, caller->program, caller->program_size * sizeof(Inst));
+  vm->program_size = caller->program_size;
+  // The ranges pass proves bounds, not ownership
+  for (size_t i = 0; i < vm->program_size; i++) {
+    if (vm->program[i].type == INST_UNCHECKED(INST_ASTORE))
+      vm->program[i].type = INST_ASTORE;
+  }
+
+  memcpy(vm->arrays, caller->arrays, arrays_count * sizeof(Array *));
+  vm->arrays_count = arrays_count;
+  vm->arrays_borrowed = arrays_count;
+  vm->env = hash_table_clone(&caller->env);
+  vm->fuel = caller->fuel;
+  vm->out = caller->out;
+  vm->slice = UINT64_MAX;
+  return vm;
+}
+
+// Runs label with args to completion, its ret landing on the final eof
+static Err vm_call(Vm *vm, const Addr label, const Word *args,
+                   const uint64_t arity, Word *result) {
+  vm->stack_count = vm_frame_enter(vm->stack, vm->reg, label, args, arity,
+                                   vm->program_size - 1);
+
+  Err err = vm_run_guarded(vm);
+  vm_tasks_free(vm);
+  *result = vm->reg[REG_RAX];
+  return err;
+}
+
+// Elements are packed 64-bit lanes whose bits pass through as words
+static void vm_parallel_job(void *ctx, size_t worker, size_t job) {
+  Vm_parallel *par = (Vm_parallel *)ctx;
+
+  if (par->workers[worker] == NULL)
+    par->workers[worker] = vm_worker_new(par->caller, par->arrays_count);
+  Vm *vm = par->workers[worker];
+  if (vm == NULL) {
+    par->errs[job] = VM_OUT_OF_MEMORY;
+    return;
+  }
+
+  const int64_t *data = (const int64_t *)par->array->data;
+  size_t start = job * VM_PARALLEL_CHUNK;
+  size_t end = start + VM_PARALLEL_CHUNK < par->array->len
+                   ? start + VM_PARALLEL_CHUNK
+                   : par->array->len;
+
+  Word args[2];
+  Word acc = par->init;
+  if (par->mapped == NULL && job > 0)
+    acc.as_i64 = data[start++];
+
+  // A map goes LANES_WIDTH elements a dispatch until the Fn turns out to
+  // need more than lanes interpret
+  Lanes *lanes = par->mapped != NULL ? (Lanes *)malloc(sizeof(Lanes)) : NULL;
+  while (lanes != NULL && start < end) {
+    size_t lanes_count = end - start < LANES_WIDTH ? end - start : LANES_WIDTH;
+    Word lane_args[1][LANES_WIDTH];
+    Word results[LANES_WIDTH];
+    for (size_t l = 0; l < lanes_count; l++)
+      lane_args[0][l].as_i64 = data[start + l];
+
+    if (!lanes_call(lanes, vm->program, vm->program_size, vm->memos,
+                    par->label, lane_args, 1, lanes_count, vm->fuel,
+                    results))
+      break;
+
+    for (size_t l = 0; l < lanes_count; l++)
+      ((int64_t *)par->mapped->data)[start + l] = results[l].as_i64;
+    start += lanes_count;
+  }
+  free(lanes);
+
+  for (size_t i = start; i < end; i++) {
+    Err err;
+    if (par->mapped != NULL) {
+      args[0].as_i64 = data[i];
+      err = vm_call(vm, par->label, args, 1, &acc);
+      ((int64_t *)par->mapped->data)[i] = acc.as_i64;
+    } else {
+      args[0] = acc;
+      args[1].as_i64 = data[i];
+      err = vm_call(vm, par->label, args, 2, &acc);
+    }
+
+    if (err != VM_OK) {
+      par->errs[job] = err;
+      return;
+    }
+  }
+
+  if (par->mapped == NULL)
+    par->partials[job] = acc;
+}
+
+// A map's result is the handle of a new array of the same element type,
+// a reduce's the chunks' results folded in order on the calling thread.
+// Fails with the error of the earliest chunk that failed; a worker out of
+// fuel suspends the caller so as to run the whole inst again on resuming.
+static Err vm_parallel_run(Vm *vm, const Addr label, const Array *array,
+                           const int map, const Word init, Word *result) {
+  Array *mapped = NULL;
+  *result = init;
+  if (map) {
+    Err err = vm_array_new(vm, array->type, array->len, result);
+    if (err != VM_OK)
+      return err;
+    mapped = vm->arrays[result->as_u64 - 1];
+  }
+
+  size_t jobs_count =
+      (array->len + VM_PARALLEL_CHUNK - 1) / VM_PARALLEL_CHUNK;
+  if (jobs_count == 0)
+    return VM_OK;
+
+  size_t workers_count = pool_workers_default();
+  workers_count = workers_count < jobs_count ? workers_count : jobs_count;
+
+  Vm_parallel par = {
+      .caller = vm,
+      .label = label,
+      .array = array,
+      .arrays_count = vm->arrays_count - (mapped != NULL),
+      .mapped = mapped,
+      .init = init,
+      .partials = (Word *)calloc(jobs_count, sizeof(Word)),
+      .workers = (Vm **)calloc(workers_count, sizeof(Vm *)),
+      .errs = (Err *)calloc(jobs_count, sizeof(Err)),
+  };
+
+  Err err = VM_OUT_OF_MEMORY;
+  if (par.partials != NULL && par.workers != NULL && par.errs != NULL &&
+      pool_run(workers_count, jobs_count, vm_parallel_job, &par) == 0) {
+    err = VM_OK;
+    for (size_t i = 0; i < jobs_count && err == VM_OK; i++)
+      err = par.errs[i];
+  }
+
+  if (err == VM_OK && mapped == NULL) {
+    if (par.workers[0] == NULL)
+      par.workers[0] = vm_worker_new(vm, par.arrays_count);
+    if (par.workers[0] == NULL)
+      err = VM_OUT_OF_MEMORY;
+
+    *result = par.partials[0];
+    for (size_t i = 1; i < jobs_count && err == VM_OK; i++) {
+      Word args[2] = {*result, par.partials[i]};
+      err = vm_call(par.workers[0], label, args, 2, result);
+    }
+  }
+
+  // The workers ran side by side, so the caller pays what the busiest burnt
+  uint64_t burnt = 0;
+  for (size_t i = 0; par.workers != NULL && i < workers_count; i++) {
+    if (par.workers[i] == NULL)
+      continue;
+    if (vm->fuel - par.workers[i]->fuel > burnt)
+      burnt = vm->fuel - par.workers[i]->fuel;
+    vm_destruct(par.workers[i]);
+    free(par.workers[i]);
+  }
+  free(par.partials);
+  free(par.workers);
+  free(par.errs);
+
+  if (err != VM_OK && map) {
+    vm->arrays_count--;
+    free(mapped->data);
+    free(mapped);
+    vm->arrays[vm->arrays_count] = NULL;
+  }
+  vm->fuel -= burnt < vm->fuel ? burnt : vm->fuel;
+  if (err == VM_OUT_OF_FUEL) {
+    vm->fuel = 0;
+    vm->reg[REG_IP].as_u64--;
+  }
+  return err;
+}
+
+#ifndef DEBUG
+#define SP_INCREMENT vm->reg[REG_SP].as_u64++;
+#define SP_DECREMENT vm->reg[REG_SP].as_u64--;
+#else
+#define SP_INCREMENT                                                           \
+  do {                                                                         \
+    vm->reg[REG_SP].as_u64++;                                                  \
+    printf("IP    : %lld\n", vm->ip);                                          \
+    printf("RA    : %lld\n", vm->reg[REG_RA].as_u64);                          \
+    printf("CPSR  : %lld\n", vm->reg[REG_CPSR].as_u64);                        \
+    printf("FP    : %lld\n", vm->reg[REG_FP].as_u64);                          \
+    printf("SP++  : %lld\n", vm->reg[REG_SP].as_u64);                          \
+  } while (0)
+#define SP_DECREMENT                                                           \
+  do {                                                                         \
+    vm->reg[REG_SP].as_u64--;                                                  \
+    printf("IP    : %lld\n", vm->ip);                                          \
+    printf("RA    : %lld\n", vm->reg[REG_RA].as_u64);                          \
+    printf("CPSR  : %lld\n", vm->reg[REG_CPSR].as_u64);                        \
+    printf("FP    : %lld\n", vm->reg[REG_FP].as_u64);                          \
+    printf("SP--  : %lld\n", vm->reg[REG_SP].as_u64);                          \
+  } while (0)
+#endif
+
+// Fuel burns on backward jumps only, i.e. once per loop iteration or call.
+// Running out suspends the vm with the jump taken, so that vm_execute
+// resumes at its target once given more fuel. Backward jumps are also
+// where a task whose slice ran out gives way, resuming at the target
+// later, hence no do-while: the continue must reach the loop.
+#define VM_FUEL_BURN(target)                                                   \
+  if ((target) < vm->reg[REG_IP].as_u64) {                                     \
+    if (--vm->fuel == 0) {                                                     \
+      vm->reg[REG_IP].as_u64 = (target);                                       \
+      return VM_OUT_OF_FUEL;                                                   \
+    }                                                                          \
+    if (--vm->slice == 0 && vm_task_preempt(vm, (target)))                     \
+      continue;                                                                \
+  }
+#define VM_CHECK(cond, err)                                                    \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      return err;                                                              \
+  } while (0)
+
+static Err vm_run(Vm *vm) {
+  int n = 1;
+#ifdef DEBUG
+  n = 100;
+#endif
+
+  while (n) {
+    const Inst inst = vm->program[vm->reg[REG_IP].as_u64++];
+    Word word_one;
+    Word word_two;
+    uint64_t reg_no;
+    uint64_t jmp_offset;
+    uint64_t fp;
+    Array *array;
+    Chan *chan;
+    uint64_t index;
+
+#ifdef DEBUG
+    n--;
+    vm_stack_dump(vm);
+    vm_inst_dump(vm->out, &inst);
+#endif
+
+    // Unchecked twins lie past the end of the enum
+    switch ((int)inst.type) {
+    // Pushes need no overflow check: past stack_limit lies the guard page
+    case INST_PUSH:
+    case INST_UNCHECKED(INST_PUSH):
+      vm->stack[vm->stack_count++] = inst.operand;
+      SP_INCREMENT;
+      continue;
+
+    case INST_POP:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_POP):
+      vm->stack_count--;
+      SP_DECREMENT;
+      continue;
+
+    case INST_DUP:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_DUP):
+      vm->stack[vm->stack_count] = vm->stack[vm->stack_count - 1];
+      vm->stack_count++;
+      SP_INCREMENT;
+      continue;
+
+    case INST_PICK:
+      // `pick 0` is `dup`
+      VM_CHECK(inst.operand.as_u64 < vm->stack_count, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_PICK):
+      vm->stack[vm->stack_count] =
+          vm->stack[vm->stack_count - 1 - inst.operand.as_u64];
+      vm->stack_count++;
+      SP_INCREMENT;
+      continue;
+
+    case INST_PLUS:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_PLUS):
+      word_one = vm->stack[vm->stack_count - 1];
+      vm->stack[--vm->stack_count - 1].as_u64 += word_one.as_u64;
       SP_DECREMENT;
+      continue;
 
+    case INST_PLUSF:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_PLUSF):
+      word_one = vm->stack[vm->stack_count - 1];
+      vm->stack[--vm->stack_count - 1].as_f64 += word_one.as_f64;
+      SP_DECREMENT;
       continue;
 
-    case INST_GT:
-      assert(vm.stack_count > 1 && "Stack underflow");
+    case INST_MINUS:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_MINUS):
+      word_one = vm->stack[vm->stack_count - 1];
+      vm->stack[--vm->stack_count - 1].as_u64 -= word_one.as_u64;
+      SP_DECREMENT;
+      continue;
+
+    case INST_MULT:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_MULT):
+      word_one = vm->stack[vm->stack_count - 1];
+      vm->stack[--vm->stack_count - 1].as_u64 *= word_one.as_u64;
+      SP_DECREMENT;
+      continue;
+
+    case INST_DIV:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_DIV):
+      word_one = vm->stack[vm->stack_count - 1];
+      VM_CHECK(word_one.as_u64 != 0, VM_DIV_BY_ZERO);
+      vm->stack[--vm->stack_count - 1].as_u64 /= word_one.as_u64;
+      SP_DECREMENT;
+      continue;
+
+    case INST_SHL:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_SHL):
+      vm->stack[vm->stack_count - 1].as_u64 <<= inst.operand.as_u64;
+      continue;
+
+    case INST_SHR:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_SHR):
+      vm->stack[vm->stack_count - 1].as_u64 >>= inst.operand.as_u64;
+      continue;
+
+    case INST_EQ:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_EQ):
+      word_two = vm->stack[vm->stack_count - 2];
+      word_one = vm->stack[vm->stack_count - 1];
+
+      uint64_t eq = 0;
+      if (word_one.as_u64 == word_two.as_u64)
+        eq = 1;
 
-      word_two = vm.stack[vm.stack_count - 2];
-      word_one = vm.stack[vm.stack_count - 1];
+      vm->stack[vm->stack_count - 2] = (Word){.as_u64 = eq};
+
+      vm->stack_count -= 1;
+      SP_DECREMENT;
+
+      continue;
+
+    case INST_NE:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_NE):
+      word_two = vm->stack[vm->stack_count - 2];
+      word_one = vm->stack[vm->stack_count - 1];
+
+      uint64_t ne = 0;
+      if (word_one.as_u64 != word_two.as_u64)
+        ne = 1;
+
+      vm->stack[vm->stack_count - 2] = (Word){.as_u64 = ne};
+
+      vm->stack_count -= 1;
+      SP_DECREMENT;
+
+      continue;
+
+    case INST_GT:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_GT):
+      word_two = vm->stack[vm->stack_count - 2];
+      word_one = vm->stack[vm->stack_count - 1];
 
       uint64_t gt = 0;
       if (word_two.as_u64 > word_one.as_u64)
         gt = 1;
 
-      vm.stack[vm.stack_count - 2] = (Word){.as_u64 = gt};
+      vm->stack[vm->stack_count - 2] = (Word){.as_u64 = gt};
 
-      vm.stack_count -= 1;
+      vm->stack_count -= 1;
       SP_DECREMENT;
 
       continue;
 
     case INST_LT:
-      assert(vm.stack_count > 1 && "Stack underflow");
-
-      word_two = vm.stack[vm.stack_count - 2];
-      word_one = vm.stack[vm.stack_count - 1];
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_LT):
+      word_two = vm->stack[vm->stack_count - 2];
+      word_one = vm->stack[vm->stack_count - 1];
 
       uint64_t lt = 0;
       if (word_two.as_u64 < word_one.as_u64)
         lt = 1;
 
-      vm.stack[vm.stack_count - 2] = (Word){.as_u64 = lt};
+      vm->stack[vm->stack_count - 2] = (Word){.as_u64 = lt};
 
-      vm.stack_count -= 1;
+      vm->stack_count -= 1;
       SP_DECREMENT;
 
       continue;
 
     case INST_PRINT:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      word_one = vm.stack[vm.stack_count - 1];
-      printf("%lld\n", word_one.as_u64);
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_PRINT):
+      word_one = vm->stack[vm->stack_count - 1];
+      fprintf(vm->out, "%lld\n", word_one.as_u64);
       continue;
 
     case INST_PRINTS:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      word_one = vm.stack[vm.stack_count - 1];
-      printf("%.*s\n", word_one.as_sv.len, word_one.as_sv.str);
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_PRINTS):
+      word_one = vm->stack[vm->stack_count - 1];
+      fprintf(vm->out, "%.*s\n", word_one.as_sv.len, word_one.as_sv.str);
       continue;
 
     case INST_NEG:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      vm.stack[vm.stack_count - 1].as_u64 =
-          -vm.stack[vm.stack_count - 1].as_u64;
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_NEG):
+      vm->stack[vm->stack_count - 1].as_u64 =
+          -vm->stack[vm->stack_count - 1].as_u64;
       continue;
 
     case INST_DEFG:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_DEFG):;
       Sv assign_name = inst.operand.as_sv;
 
-      Word value = vm.stack[vm.stack_count - 1];
+      Word value = vm->stack[vm->stack_count - 1];
 
-      hash_table_insert(&vm.env, assign_name, value);
+      hash_table_insert(&vm->env, assign_name, value);
       continue;
 
-    case INST_DEFL:
-      assert(vm.stack_count > 0 && "Stack underflow");
+    case INST_INCG:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_INCG):;
+      Word *inc_var = hash_table_get(&vm->env, inst.operand.as_sv);
+      VM_CHECK(inc_var != NULL, VM_UNDEFINED_GLOBAL);
 
-      uint64_t def_offset = inst.operand.as_u64;
-      assert(def_offset < vm.stack_count && "Stack illegal access");
+      inc_var->as_u64 += vm->stack[--vm->stack_count].as_u64;
+      SP_DECREMENT;
+      continue;
 
-      Word word = vm.stack[def_offset];
-      vm.stack[vm.stack_count++] = word;
+    case INST_DEFL:
+      VM_CHECK(inst.operand.as_u64 < vm->stack_count, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_DEFL):
+      vm->stack[vm->stack_count] = vm->stack[inst.operand.as_u64];
+      vm->stack_count++;
       SP_INCREMENT;
 
       continue;
 
     case INST_VARG:
-      assert(vm.stack_count + 1 < VM_STACK_CAP && "Stack overflow");
-
+    case INST_UNCHECKED(INST_VARG):;
       Sv var_name = inst.operand.as_sv;
-      assert(hash_table_keys_contains(&vm.env, var_name) == 1 &&
-             "Undefined var");
+      VM_CHECK(hash_table_keys_contains(&vm->env, var_name) == 1,
+               VM_UNDEFINED_GLOBAL);
 
-      vm.stack[vm.stack_count++] = vm_env_resolve(var_name);
+      vm->stack[vm->stack_count++] = vm_env_resolve(vm, var_name);
       SP_INCREMENT;
       continue;
 
     case INST_VARL:
-      assert(vm.stack_count + 1 < VM_STACK_CAP && "Stack overflow");
-
-      uint64_t var_offset = inst.operand.as_u64;
-      fp = vm.reg[REG_FP].as_u64;
-      assert(var_offset < vm.stack_count && "Stack illegal access");
-
-      assert(var_offset < vm.stack_count && "Program illegal access");
-      vm.stack[vm.stack_count++] = vm.stack[fp + var_offset];
+      VM_CHECK(vm->reg[REG_FP].as_u64 + inst.operand.as_u64 < vm->stack_count,
+               VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_VARL):
+      fp = vm->reg[REG_FP].as_u64;
+      vm->stack[vm->stack_count++] = vm->stack[fp + inst.operand.as_u64];
       SP_INCREMENT;
       continue;
 
-    case INST_JMPA:;
+    case INST_JMPA:
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_JMPA):
       jmp_offset = inst.operand.as_u64;
-      assert(jmp_offset < vm.program_size && "Program illegal access");
+      VM_FUEL_BURN(jmp_offset);
 
-      vm.reg[REG_IP].as_u64 = jmp_offset;
+      vm->reg[REG_IP].as_u64 = jmp_offset;
       continue;
 
-    case INST_JMPT:;
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      eq = vm.stack[vm.stack_count-- - 1].as_u64;
+    case INST_JMPT:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_JMPT):
+      eq = vm->stack[vm->stack_count-- - 1].as_u64;
       SP_DECREMENT;
 
       jmp_offset = inst.operand.as_u64;
-      assert(jmp_offset < vm.program_size && "Program illegal access");
-
-      if (eq)
-        vm.reg[REG_IP].as_u64 = jmp_offset;
+      if (eq) {
+        VM_FUEL_BURN(jmp_offset);
+        vm->reg[REG_IP].as_u64 = jmp_offset;
+      }
 
       continue;
 
-    case INST_JMPNT:;
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      eq = vm.stack[vm.stack_count-- - 1].as_u64;
+    case INST_JMPNT:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_JMPNT):
+      eq = vm->stack[vm->stack_count-- - 1].as_u64;
       SP_DECREMENT;
 
       jmp_offset = inst.operand.as_u64;
-      assert(jmp_offset < vm.program_size && "Program illegal access");
+      if (!eq) {
+        VM_FUEL_BURN(jmp_offset);
+        vm->reg[REG_IP].as_u64 = jmp_offset;
+      }
+
+      continue;
+
+    case INST_FORLOOP:
+      // counter, limit, step on top; step the counter, loop while below
+      VM_CHECK(vm->stack_count > 2, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_FORLOOP):
+      jmp_offset = inst.operand.as_u64;
+      Word *counter = &vm->stack[vm->stack_count - 3];
+      counter->as_u64 += vm->stack[vm->stack_count - 1].as_u64;
 
-      if (!eq)
-        vm.reg[REG_IP].as_u64 = jmp_offset;
+      if (counter->as_u64 < vm->stack[vm->stack_count - 2].as_u64) {
+        VM_FUEL_BURN(jmp_offset);
+        vm->reg[REG_IP].as_u64 = jmp_offset;
+      }
 
       continue;
 
     case INST_RET:
-      vm.reg[REG_IP].as_u64 = vm.reg[REG_RA].as_u64;
+      vm->reg[REG_IP].as_u64 = vm->reg[REG_RA].as_u64;
 
       continue;
 
     case INST_STR:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < VM_REGS_CAP, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_STR):
       reg_no = inst.operand.as_u64;
 
-      value = vm.stack[vm.stack_count-- - 1];
+      value = vm->stack[vm->stack_count-- - 1];
       SP_DECREMENT;
-      vm.reg[reg_no] = value;
+      vm->reg[reg_no] = value;
 
       continue;
 
     case INST_LDR:
-      assert(vm.stack_count + 1 < VM_STACK_CAP && "Stack overflow");
-
+      VM_CHECK(inst.operand.as_u64 < VM_REGS_CAP, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_LDR):
       reg_no = inst.operand.as_u64;
 
-      vm.stack[vm.stack_count++] = vm.reg[reg_no];
+      vm->stack[vm->stack_count++] = vm->reg[reg_no];
       SP_INCREMENT;
 
       continue;
 
+    case INST_TAILCALL:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      fp = vm->reg[REG_FP].as_u64;
+      VM_CHECK(fp + vm->stack[vm->stack_count - 1].as_u64 < vm->stack_count,
+               VM_STACK_UNDERFLOW);
+      // fallthrough
+    case INST_UNCHECKED(INST_TAILCALL):;
+      uint64_t arity = vm->stack[vm->stack_count-- - 1].as_u64;
+      SP_DECREMENT;
+
+      fp = vm->reg[REG_FP].as_u64;
+
+      // Reuse the frame: new args replace the current ones, fp and ra stay
+      for (size_t i = 0; i < arity; i++) {
+        vm->stack[fp + i] = vm->stack[vm->stack_count - arity + i];
+      }
+      vm->reg[REG_SP].as_u64 -= vm->stack_count - (fp + arity);
+      vm->stack_count = fp + arity;
+
+      jmp_offset = inst.operand.as_u64;
+      VM_FUEL_BURN(jmp_offset);
+
+      vm->reg[REG_IP].as_u64 = jmp_offset;
+      continue;
+
+    case INST_MEMOCALL:
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_MEMOCALL):
+      jmp_offset = inst.operand.as_u64;
+
+      // Frame and args are in place: a hit returns to ra without entering
+      fp = vm->reg[REG_FP].as_u64;
+      Word *memoized = vm_memo_lookup(vm->memos, jmp_offset, &vm->stack[fp],
+                                      vm->stack_count - fp);
+      if (memoized != NULL) {
+        vm->reg[REG_RAX] = *memoized;
+        vm->reg[REG_IP].as_u64 = vm->reg[REG_RA].as_u64;
+        continue;
+      }
+
+      VM_FUEL_BURN(jmp_offset);
+      vm->reg[REG_IP].as_u64 = jmp_offset;
+      continue;
+
+    case INST_MEMORET:
+      fp = vm->reg[REG_FP].as_u64;
+      vm_memo_store(vm->memos, inst.operand.as_u64, &vm->stack[fp],
+                    vm->stack_count - fp, vm->reg[REG_RAX]);
+      vm->reg[REG_IP].as_u64 = vm->reg[REG_RA].as_u64;
+
+      continue;
+
+    case INST_ANEW:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+
+      word_one = vm->stack[vm->stack_count - 1];
+      Err array_err = vm_array_new(vm, (Word_t)inst.operand.as_u64,
+                                   word_one.as_u64,
+                                   &vm->stack[vm->stack_count - 1]);
+      VM_CHECK(array_err == VM_OK, array_err);
+      continue;
+
+    case INST_ALOAD:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 2]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(vm->stack[vm->stack_count - 1].as_u64 < array->len,
+               VM_OUT_OF_BOUNDS);
+      // fallthrough
+    case INST_UNCHECKED(INST_ALOAD):
+      array = vm->arrays[vm->stack[vm->stack_count - 2].as_u64 - 1];
+      index = vm->stack[vm->stack_count - 1].as_u64;
+
+      // Elements are packed 64-bit lanes, not Words, for the kernels
+      word_one = (Word){0};
+      if (array->type == WORD_F64)
+        word_one.as_f64 = ((double *)array->data)[index];
+      else
+        word_one.as_i64 = ((int64_t *)array->data)[index];
+
+      vm->stack[--vm->stack_count - 1] = word_one;
+      SP_DECREMENT;
+      continue;
+
+    case INST_ASTORE:
+      VM_CHECK(vm->stack_count > 2, VM_STACK_UNDERFLOW);
+
+      array = vm_array_resolve_mut(vm, vm->stack[vm->stack_count - 3]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(vm->stack[vm->stack_count - 2].as_u64 < array->len,
+               VM_OUT_OF_BOUNDS);
+      // fallthrough
+    case INST_UNCHECKED(INST_ASTORE):
+      array = vm->arrays[vm->stack[vm->stack_count - 3].as_u64 - 1];
+      index = vm->stack[vm->stack_count - 2].as_u64;
+
+      word_one = vm->stack[vm->stack_count - 1];
+      if (array->type == WORD_F64)
+        ((double *)array->data)[index] = word_one.as_f64;
+      else
+        ((int64_t *)array->data)[index] = word_one.as_i64;
+
+      vm->stack_count -= 3;
+      vm->reg[REG_SP].as_u64 -= 3;
+      continue;
+
+    case INST_ALEN:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+
+      vm->stack[vm->stack_count - 1].as_u64 = array->len;
+      continue;
+
+    case INST_ASUM:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+
+      word_one = (Word){0};
+      if (array->type == WORD_F64)
+        word_one.as_f64 = simd_kernels()->sum_f64(array->data, array->len);
+      else
+        word_one.as_i64 = simd_kernels()->sum_i64(array->data, array->len);
+
+      vm->stack[vm->stack_count - 1] = word_one;
+      continue;
+
+    case INST_ADOT:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 2]);
+      Array *rhs = vm_array_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(array != NULL && rhs != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(array->type == rhs->type, VM_ILLEGAL_ACCESS);
+      VM_CHECK(array->len == rhs->len, VM_OUT_OF_BOUNDS);
+
+      word_one = (Word){0};
+      if (array->type == WORD_F64)
+        word_one.as_f64 =
+            simd_kernels()->dot_f64(array->data, rhs->data, array->len);
+      else
+        word_one.as_i64 =
+            simd_kernels()->dot_i64(array->data, rhs->data, array->len);
+
+      vm->stack[--vm->stack_count - 1] = word_one;
+      SP_DECREMENT;
+      continue;
+
+    case INST_AADD:
+    case INST_AMASK:
+      // dst, a, b on top; dst stays as the result
+      VM_CHECK(vm->stack_count > 2, VM_STACK_UNDERFLOW);
+
+      Array *dst =
+          vm_array_resolve_mut(vm, vm->stack[vm->stack_count - 3]);
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 2]);
+      rhs = vm_array_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(dst != NULL && array != NULL && rhs != NULL,
+               VM_ILLEGAL_ACCESS);
+      VM_CHECK(dst->type == array->type && array->type == rhs->type,
+               VM_ILLEGAL_ACCESS);
+      VM_CHECK(dst->len == array->len && array->len == rhs->len,
+               VM_OUT_OF_BOUNDS);
+
+      const Simd_kernels *kernels = simd_kernels();
+      if (inst.type == INST_AADD && dst->type == WORD_F64)
+        kernels->add_f64(dst->data, array->data, rhs->data, dst->len);
+      else if (inst.type == INST_AADD)
+        kernels->add_i64(dst->data, array->data, rhs->data, dst->len);
+      else if (dst->type == WORD_F64)
+        kernels->mask_f64(dst->data, array->data, rhs->data, dst->len);
+      else
+        kernels->mask_i64(dst->data, array->data, rhs->data, dst->len);
+
+      vm->stack_count -= 2;
+      vm->reg[REG_SP].as_u64 -= 2;
+      continue;
+
+    case INST_ASCALE:
+      // dst, a, k on top; dst stays as the result
+      VM_CHECK(vm->stack_count > 2, VM_STACK_UNDERFLOW);
+
+      dst = vm_array_resolve_mut(vm, vm->stack[vm->stack_count - 3]);
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 2]);
+      VM_CHECK(dst != NULL && array != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(dst->type == array->type, VM_ILLEGAL_ACCESS);
+      VM_CHECK(dst->len == array->len, VM_OUT_OF_BOUNDS);
+
+      word_one = vm->stack[vm->stack_count - 1];
+      if (dst->type == WORD_F64)
+        simd_kernels()->scale_f64(dst->data, array->data, word_one.as_f64,
+                                  dst->len);
+      else
+        simd_kernels()->scale_i64(dst->data, array->data, word_one.as_i64,
+                                  dst->len);
+
+      vm->stack_count -= 2;
+      vm->reg[REG_SP].as_u64 -= 2;
+      continue;
+
+    case INST_VEXPR:;
+      Err vexpr_err = vm_vexpr_run(vm, inst.operand.as_u64);
+      if (vexpr_err == VM_OUT_OF_FUEL)
+        vm->reg[REG_IP].as_u64--;
+      VM_CHECK(vexpr_err == VM_OK, vexpr_err);
+      continue;
+
+    case INST_SPAWN:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(vm->stack[vm->stack_count - 1].as_u64 < vm->stack_count,
+               VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+
+      // The handle comes back in rax, the caller pops the args
+      word_one = vm->stack[vm->stack_count-- - 1];
+      SP_DECREMENT;
+      Err spawn_err = vm_task_spawn(vm, inst.operand.as_u64, word_one.as_u64,
+                                    &vm->reg[REG_RAX]);
+      VM_CHECK(spawn_err == VM_OK, spawn_err);
+      continue;
+
+    case INST_YIELD:
+      vm->stack[vm->stack_count++].as_u64 = 0;
+      SP_INCREMENT;
+      vm_task_preempt(vm, vm->reg[REG_IP].as_u64);
+      continue;
+
+    case INST_JOIN:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      word_one = vm->stack[vm->stack_count - 1];
+      VM_CHECK(word_one.as_u64 > 0 && word_one.as_u64 < vm->tasks_count,
+               VM_ILLEGAL_ACCESS);
+
+      if (vm->tasks[word_one.as_u64]->done) {
+        vm->tasks[vm->task]->joining = 0;
+        vm->stack[vm->stack_count - 1] = vm->tasks[word_one.as_u64]->result;
+        continue;
+      }
+
+      // Block, and run the join again once the task is done
+      vm->tasks[vm->task]->joining = word_one.as_u64;
+      Err join_err = vm_task_block(vm, vm->reg[REG_IP].as_u64 - 1);
+      VM_CHECK(join_err == VM_OK, join_err);
+      continue;
+
+    case INST_CHAN:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+
+      Err chan_err = vm_chan_new(vm, vm->stack[vm->stack_count - 1].as_u64,
+                                 &vm->stack[vm->stack_count - 1]);
+      VM_CHECK(chan_err == VM_OK, chan_err);
+      continue;
+
+    case INST_SEND:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+
+      chan = vm_chan_resolve(vm, vm->stack[vm->stack_count - 2]);
+      VM_CHECK(chan != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(vm_chan_claim(&chan->sender, vm), VM_ILLEGAL_ACCESS);
+
+      // Evaluates to 0 like yield
+      if (vm_chan_send(chan, vm->stack[vm->stack_count - 1])) {
+        if (vm->tasks_count > 0)
+          vm->tasks[vm->task]->parked = NULL;
+        vm->stack[--vm->stack_count - 1].as_u64 = 0;
+        SP_DECREMENT;
+        continue;
+      }
+
+      Err send_err = vm_task_park(vm, chan, 1);
+      VM_CHECK(send_err == VM_OK, send_err);
+      continue;
+
+    case INST_RECV:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+
+      chan = vm_chan_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(chan != NULL, VM_ILLEGAL_ACCESS);
+      VM_CHECK(vm_chan_claim(&chan->receiver, vm), VM_ILLEGAL_ACCESS);
+
+      if (vm_chan_recv(chan, &vm->stack[vm->stack_count - 1])) {
+        if (vm->tasks_count > 0)
+          vm->tasks[vm->task]->parked = NULL;
+        continue;
+      }
+
+      Err recv_err = vm_task_park(vm, chan, 0);
+      VM_CHECK(recv_err == VM_OK, recv_err);
+      continue;
+
+    case INST_PMAP:
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 1]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+
+      Err pmap_err = vm_parallel_run(vm, inst.operand.as_u64, array, 1,
+                                     (Word){0}, &word_one);
+      VM_CHECK(pmap_err == VM_OK, pmap_err);
+
+      vm->stack[vm->stack_count - 1] = word_one;
+      continue;
+
+    case INST_PREDUCE:
+      VM_CHECK(vm->stack_count > 1, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < vm->program_size, VM_ILLEGAL_ACCESS);
+
+      array = vm_array_resolve(vm, vm->stack[vm->stack_count - 2]);
+      VM_CHECK(array != NULL, VM_ILLEGAL_ACCESS);
+
+      Err preduce_err =
+          vm_parallel_run(vm, inst.operand.as_u64, array, 0,
+                          vm->stack[vm->stack_count - 1], &word_one);
+      VM_CHECK(preduce_err == VM_OK, preduce_err);
+
+      vm->stack[--vm->stack_count - 1] = word_one;
+      SP_DECREMENT;
+      continue;
+
     case INST_LABEL:
       continue;
 
     case INST_MOV:
-      assert(vm.stack_count > 0 && "Stack underflow");
-
-      uint64_t reg_dst = inst.operand.as_u64;
-      uint64_t reg_src = vm.stack[vm.stack_count-- - 1].as_u64;
+      VM_CHECK(vm->stack_count > 0, VM_STACK_UNDERFLOW);
+      VM_CHECK(inst.operand.as_u64 < VM_REGS_CAP, VM_ILLEGAL_ACCESS);
+      VM_CHECK(vm->stack[vm->stack_count - 1].as_u64 < VM_REGS_CAP,
+               VM_ILLEGAL_ACCESS);
+      // fallthrough
+    case INST_UNCHECKED(INST_MOV):
+      reg_no = vm->stack[vm->stack_count-- - 1].as_u64;
       SP_DECREMENT;
 
-      vm.reg[reg_dst] = vm.reg[reg_src];
+      vm->reg[inst.operand.as_u64] = vm->reg[reg_no];
 
       continue;
 
-    case INST_EOF:
-      return;
+    case INST_EOF:;
+      // Spawned tasks end here, and the top level waits for them to
+      Err eof_err;
+      if (vm->task != 0) {
+        eof_err = vm_task_finish(vm);
+      } else if (vm->tasks_live > 0) {
+        vm->tasks[0]->draining = 1;
+        eof_err = vm_task_block(vm, vm->reg[REG_IP].as_u64 - 1);
+      } else {
+        return VM_OK;
+      }
+
+      VM_CHECK(eof_err == VM_OK, eof_err);
+      continue;
 
     default:
       __builtin_unreachable();
     }
   }
+
+  return VM_OK;
+}
+
+#undef VM_FUEL_BURN
+#undef VM_CHECK
+
+// The vm running on this thread, and where its stack overflow lands
+static _Thread_local Vm *vm_guarded = NULL;
+static _Thread_local sigjmp_buf vm_overflow_jmp;
+
+// What the host had installed for SIGSEGV and SIGBUS before the vm
+static struct sigaction vm_fault_prev[2];
+static pthread_once_t vm_fault_once = PTHREAD_ONCE_INIT;
+
+// Hands a fault that is not the vm's to the host's handler. A default or
+// ignored disposition is put back, so the fault recurs and crashes as if
+// the vm had never installed its own.
+static void vm_fault_forward(int sig, siginfo_t *info, void *context) {
+  const struct sigaction *prev = &vm_fault_prev[sig == SIGBUS];
+
+  if (prev->sa_flags & SA_SIGINFO) {
+    prev->sa_sigaction(sig, info, context);
+  } else if (prev->sa_handler == SIG_DFL || prev->sa_handler == SIG_IGN) {
+    sigaction(sig, prev, NULL);
+  } else {
+    prev->sa_handler(sig);
+  }
+}
+
+// A fault on the reserved stack commits more of it, up to stack_limit;
+// one on the guard page is an overflow. Other faults go to the host.
+static void vm_fault_handle(int sig, siginfo_t *info, void *context) {
+  Vm *vm = vm_guarded;
+  char *addr = (char *)info->si_addr;
+  char *stack = vm != NULL ? (char *)vm->stack : NULL;
+
+  if (vm == NULL || addr < stack ||
+      addr >= stack + vm_stack_bytes(vm->stack_limit) + vm_page_size) {
+    vm_fault_forward(sig, info, context);
+    return;
+  }
+
+  uint64_t word = (uint64_t)(addr - stack) / sizeof(Word);
+  if (word < vm->stack_limit) {
+    uint64_t cap = vm->stack_cap * 2 > word ? vm->stack_cap * 2 : word + 1;
+    cap = cap < vm->stack_limit ? cap : vm->stack_limit;
+
+    if (mprotect(stack, vm_stack_bytes(cap), PROT_READ | PROT_WRITE) == 0) {
+      vm->stack_cap = vm_stack_bytes(cap) / sizeof(Word);
+      return;
+    }
+  }
+
+  siglongjmp(vm_overflow_jmp, 1);
+}
+
+static void vm_fault_install(void) {
+  struct sigaction action = {0};
+  action.sa_sigaction = vm_fault_handle;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+
+  // Some systems report PROT_NONE accesses as SIGBUS
+  sigaction(SIGSEGV, &action, &vm_fault_prev[0]);
+  sigaction(SIGBUS, &action, &vm_fault_prev[1]);
+}
+
+static Err vm_run_guarded(Vm *vm) {
+  pthread_once(&vm_fault_once, vm_fault_install);
+
+  Vm *outer = vm_guarded;
+  sigjmp_buf outer_jmp;
+  memcpy(outer_jmp, vm_overflow_jmp, sizeof(sigjmp_buf));
+
+  Err err = VM_STACK_OVERFLOW;
+  vm_guarded = vm;
+  if (sigsetjmp(vm_overflow_jmp, 1) == 0)
+    err = vm_run(vm);
+
+  vm_guarded = outer;
+  memcpy(vm_overflow_jmp, outer_jmp, sizeof(sigjmp_buf));
+  return err;
+}
+
+Err vm_execute(Vm *vm) { return vm_run_guarded(vm); }
+
+Err vm_sandbox_eval(const Inst *insts, const size_t insts_count,
+                    const Addr entry, const uint64_t fuel, Word *result) {
+  if (insts_count + 1 >= INSTS_CAP)
+    return VM_ILLEGAL_ACCESS;
+
+  Vm *sandbox = (Vm *)calloc(1, sizeof(Vm));
+  if (sandbox == NULL || vm_stack_new(sandbox, VM_STACK_CAP) != VM_OK) {
+    free(sandbox);
+    return VM_OUT_OF_MEMORY;
+  }
+  sandbox->env = hash_table_new();
+  sandbox->fuel = fuel;
+  sandbox->out = stdout;
+  sandbox->slice = UINT64_MAX;
+
+  for (size_t i = 0; i < insts_count; i++) {
+    sandbox->program[i] = insts[i];
+  }
+  sandbox->program[insts_count] = MAKE_EOF;
+  sandbox->program_size = insts_count + 1;
+  sandbox->reg[REG_IP].as_u64 = entry;
+
+  Err err = vm_run_guarded(sandbox);
+  if (err == VM_OK && sandbox->stack_count == 0)
+    err = VM_STACK_UNDERFLOW;
+  if (err == VM_OK)
+    *result = sandbox->stack[sandbox->stack_count - 1];
+
+  hash_table_destruct(&sandbox->env);
+  vm_tasks_free(sandbox);
+  vm_memos_free(sandbox);
+  vm_arrays_free(sandbox);
+  vm_chans_free(sandbox);
+  vm_stack_free(sandbox);
+  free(sandbox);
+
+  return err;
+}
+
+// An image is this header, then the program, the names its insts refer
+// to, the stack, the globals, the memos and the arrays, each padded to a
+// whole word. In the image a name's str is its offset among the names.
+#define VM_IMAGE_MAGIC 0x31474d4948414f4eULL // "NOAHIMG1"
+
+typedef struct {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t program_size;
+  uint64_t names_size;
+  uint64_t stack_count;
+  uint64_t stack_limit;
+  uint64_t globals_count;
+  uint64_t memos_count;
+  uint64_t arrays_count;
+  Word reg[VM_REGS_CAP];
+} Vm_image;
+
+typedef struct {
+  HashKey key;
+  Word data;
+} Vm_image_global;
+
+typedef struct {
+  uint64_t label;
+  Memo memo;
+} Vm_image_memo;
+
+// Followed by the len elements
+typedef struct {
+  uint64_t type;
+  uint64_t len;
+} Vm_image_array;
+
+static size_t vm_image_padded(const size_t size) {
+  return size + (sizeof(uint64_t) - size % sizeof(uint64_t)) %
+                    sizeof(uint64_t);
+}
+
+static int vm_image_write(FILE *file, const void *data, const size_t size) {
+  static const char padding[sizeof(uint64_t)] = {0};
+  size_t pad = vm_image_padded(size) - size;
+  return fwrite(data, 1, size, file) == size &&
+         fwrite(padding, 1, pad, file) == pad;
+}
+
+static int vm_inst_names(const Inst *inst) {
+  Inst_Context context = INST_CONTEXTS[INST_BASE(inst->type)];
+  return context.has_operand && context.operand_type == WORD_SV;
+}
+
+Err vm_image_save(const Vm *vm, FILE *file) {
+  if (vm->tasks_count > 0 || vm->chans_count > 0)
+    return VM_ILLEGAL_ACCESS;
+
+  Vm_image header = {
+      .magic = VM_IMAGE_MAGIC,
+      .program_size = vm->program_size,
+      .stack_count = vm->stack_count,
+      .stack_limit = vm->stack_limit,
+      .globals_count = vm->env.keys_count,
+      .arrays_count = vm->arrays_count,
+  };
+  memcpy(header.reg, vm->reg, sizeof(header.reg));
+
+  // Names are written as often as they occur; programs are small
+  Inst *insts = (Inst *)calloc(vm->program_size + 1, sizeof(Inst));
+  if (insts == NULL)
+    return VM_OUT_OF_MEMORY;
+  // Base opcodes only: the loader decides again what may run unchecked
+  for (size_t i = 0; i < vm->program_size; i++) {
+    insts[i].type = INST_BASE(vm->program[i].type);
+    if (!vm_inst_names(&vm->program[i])) {
+      insts[i].operand.as_u64 = vm->program[i].operand.as_u64;
+      continue;
+    }
+    insts[i].operand.as_sv.len = vm->program[i].operand.as_sv.len;
+    insts[i].operand.as_sv.str = (char *)(uintptr_t)header.names_size;
+    header.names_size += (uint64_t)vm->program[i].operand.as_sv.len;
+  }
+
+  char *names = (char *)malloc(header.names_size + 1);
+  if (names == NULL) {
+    free(insts);
+    return VM_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < vm->program_size; i++) {
+    const Sv name = vm->program[i].operand.as_sv;
+    if (vm_inst_names(&vm->program[i]))
+      memcpy(names + (uintptr_t)insts[i].operand.as_sv.str, name.str,
+             (size_t)name.len);
+  }
+
+  for (size_t i = 0; i < INSTS_CAP; i++) {
+    header.memos_count += vm->memos[i] != NULL;
+  }
+
+  header.size = sizeof(Vm_image) + header.program_size * sizeof(Inst) +
+                vm_image_padded(header.names_size) +
+                header.stack_count * sizeof(Word) +
+                header.globals_count * sizeof(Vm_image_global) +
+                header.memos_count * sizeof(Vm_image_memo);
+  for (size_t i = 0; i < vm->arrays_count; i++) {
+    header.size +=
+        sizeof(Vm_image_array) + vm->arrays[i]->len * sizeof(int64_t);
+  }
+
+  int ok = vm_image_write(file, &header, sizeof(header)) &&
+           vm_image_write(file, insts, vm->program_size * sizeof(Inst)) &&
+           vm_image_write(file, names, header.names_size);
+  free(insts);
+  free(names);
+
+  ok = ok && vm_image_write(file, vm->stack, vm->stack_count * sizeof(Word));
+
+  Hash_Table *env = (Hash_Table *)&vm->env;
+  for (size_t i = 0; ok && i < env->keys_count; i++) {
+    Vm_image_global global = {.key = env->keys[i]};
+    global.data = *hash_table_get_hashed(env, env->keys[i]);
+    ok = vm_image_write(file, &global, sizeof(global));
+  }
+
+  for (size_t i = 0; ok && i < INSTS_CAP; i++) {
+    if (vm->memos[i] == NULL)
+      continue;
+    ok = fwrite(&(uint64_t){i}, sizeof(uint64_t), 1, file) == 1 &&
+         vm_image_write(file, vm->memos[i], sizeof(Memo));
+  }
+
+  for (size_t i = 0; ok && i < vm->arrays_count; i++) {
+    const Array *array = vm->arrays[i];
+    Vm_image_array entry = {.type = array->type, .len = array->len};
+    ok = vm_image_write(file, &entry, sizeof(entry)) &&
+         vm_image_write(file, array->data, array->len * sizeof(int64_t));
+  }
+
+  return ok ? VM_OK : VM_BAD_IMAGE;
+}
+
+// The next size bytes of the image, NULL if it ends before them
+static const void *vm_image_take(const char *image, const size_t image_size,
+                                 size_t *at, const size_t size) {
+  if (size > image_size - *at)
+    return NULL;
+
+  const void *data = image + *at;
+  *at += vm_image_padded(size);
+  *at = *at < image_size ? *at : image_size;
+  return data;
+}
+
+// Every section is checked before any is restored
+static Err vm_image_restore(Vm *vm, const char *image,
+                            const size_t image_size) {
+  size_t at = 0;
+  const Vm_image *header =
+      (const Vm_image *)vm_image_take(image, image_size, &at,
+                                      sizeof(Vm_image));
+  if (header == NULL || header->magic != VM_IMAGE_MAGIC ||
+      header->size != image_size || header->program_size >= INSTS_CAP ||
+      header->reg[REG_IP].as_u64 > header->program_size ||
+      header->stack_limit == 0 || header->stack_limit > VM_STACK_LIMIT ||
+      header->stack_count > header->stack_limit ||
+      header->globals_count > HASH_TABLE_CAP ||
+      header->memos_count > INSTS_CAP ||
+      header->arrays_count > VM_ARRAYS_CAP)
+    return VM_BAD_IMAGE;
+
+  const Inst *insts = (const Inst *)vm_image_take(
+      image, image_size, &at, header->program_size * sizeof(Inst));
+  const char *names =
+      (const char *)vm_image_take(image, image_size, &at, header->names_size);
+  const Word *stack = (const Word *)vm_image_take(
+      image, image_size, &at, header->stack_count * sizeof(Word));
+  const Vm_image_global *globals = (const Vm_image_global *)vm_image_take(
+      image, image_size, &at, header->globals_count * sizeof(Vm_image_global));
+  const Vm_image_memo *memos = (const Vm_image_memo *)vm_image_take(
+      image, image_size, &at, header->memos_count * sizeof(Vm_image_memo));
+  if (insts == NULL || names == NULL || stack == NULL || globals == NULL ||
+      memos == NULL)
+    return VM_BAD_IMAGE;
+
+  for (size_t i = 0; i < header->program_size; i++) {
+    if (insts[i].type > INST_EOF)
+      return VM_BAD_IMAGE;
+    const Sv name = insts[i].operand.as_sv;
+    if (vm_inst_names(&insts[i]) &&
+        (name.len < 0 ||
+         (uintptr_t)name.str + (size_t)name.len > header->names_size))
+      return VM_BAD_IMAGE;
+  }
+  for (size_t i = 0; i < header->memos_count; i++) {
+    if (memos[i].label >= INSTS_CAP)
+      return VM_BAD_IMAGE;
+  }
+  size_t arrays_at = at;
+  for (size_t i = 0; i < header->arrays_count; i++) {
+    const Vm_image_array *entry = (const Vm_image_array *)vm_image_take(
+        image, image_size, &at, sizeof(Vm_image_array));
+    if (entry == NULL || entry->len > VM_ARRAY_LEN_CAP ||
+        vm_image_take(image, image_size, &at,
+                      entry->len * sizeof(int64_t)) == NULL)
+      return VM_BAD_IMAGE;
+  }
+
+  if (header->stack_limit != vm->stack_limit) {
+    Vm sized = {0};
+    if (vm_stack_new(&sized, header->stack_limit) != VM_OK)
+      return VM_OUT_OF_MEMORY;
+    vm_stack_free(vm);
+    vm->stack = sized.stack;
+    vm->stack_cap = sized.stack_cap;
+    vm->stack_limit = sized.stack_limit;
+  }
+  if (header->stack_count > vm->stack_cap) {
+    size_t committed = vm_stack_bytes(header->stack_count);
+    if (mprotect(vm->stack, committed, PROT_READ | PROT_WRITE) != 0)
+      return VM_OUT_OF_MEMORY;
+    vm->stack_cap = committed / sizeof(Word);
+  }
+  memcpy(vm->stack, stack, header->stack_count * sizeof(Word));
+  vm->stack_count = header->stack_count;
+
+  at = arrays_at;
+  for (size_t i = 0; i < header->arrays_count; i++) {
+    const Vm_image_array *entry = (const Vm_image_array *)vm_image_take(
+        image, image_size, &at, sizeof(Vm_image_array));
+    const void *data =
+        vm_image_take(image, image_size, &at, entry->len * sizeof(int64_t));
+    Word handle;
+    Err err = vm_array_new(vm, (Word_t)entry->type, entry->len, &handle);
+    if (err != VM_OK)
+      return err;
+    memcpy(vm->arrays[handle.as_u64 - 1]->data, data,
+           entry->len * sizeof(int64_t));
+  }
+
+  for (size_t i = 0; i < header->memos_count; i++) {
+    Memo *memo = (Memo *)malloc(sizeof(Memo));
+    if (memo == NULL)
+      return VM_OUT_OF_MEMORY;
+    memcpy(memo, &memos[i].memo, sizeof(Memo));
+    free(vm->memos[memos[i].label]);
+    vm->memos[memos[i].label] = memo;
+  }
+
+  for (size_t i = 0; i < header->globals_count; i++) {
+    hash_table_insert_hashed(&vm->env, globals[i].key, globals[i].data);
+  }
+
+  for (size_t i = 0; i < header->program_size; i++) {
+    vm->program[i] = insts[i];
+    if (vm_inst_names(&insts[i]))
+      vm->program[i].operand.as_sv.str =
+          (char *)names + (uintptr_t)insts[i].operand.as_sv.str;
+  }
+  vm->program_size = header->program_size;
+  memcpy(vm->reg, header->reg, sizeof(vm->reg));
+
+  // The verifier proves runs from the entry on an empty stack. A saved
+  // stack holds return addresses and frame pointers it cannot vouch for,
+  // so an image resuming mid-run keeps every check.
+  Verdict verdict;
+  if (vm->reg[REG_IP].as_u64 == 0 && vm->stack_count == 0)
+    vm_program_uncheck(vm, 0, &verdict);
+  return VM_OK;
+}
+
+Err vm_image_load(Vm *vm, const char *path) {
+  if (vm->program_size > 0 || vm->stack_count > 0 || vm->image != NULL)
+    return VM_ILLEGAL_ACCESS;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return VM_BAD_IMAGE;
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Vm_image))
+    image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return VM_BAD_IMAGE;
+
+  Err err = vm_image_restore(vm, (const char *)image, (size_t)st.st_size);
+  if (err != VM_OK) {
+    munmap(image, (size_t)st.st_size);
+    return err;
+  }
+
+  vm->image = image;
+  vm->image_size = (size_t)st.st_size;
+  return VM_OK;
 }
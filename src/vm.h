@@ -2,23 +2,39 @@
 #define VM_H
 
 #include "table.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
-// TODO: Err handle
 typedef enum {
+  VM_OK,
   VM_STACK_OVERFLOW,
   VM_STACK_UNDERFLOW,
+  VM_ILLEGAL_ACCESS,
+  VM_DIV_BY_ZERO,
+  VM_UNDEFINED_GLOBAL,
+  VM_OUT_OF_FUEL,
+  VM_OUT_OF_BOUNDS,
+  VM_OUT_OF_MEMORY,
+  VM_DEADLOCK,
+  VM_BAD_IMAGE,
+  VM_COMPILE_ERROR,
 } Err;
 
 typedef enum {
   INST_PUSH,
   INST_POP,
+  INST_DUP,
+  INST_PICK,
   INST_PLUS,
   INST_PLUSF,
   INST_MINUS,
   INST_MULT,
   INST_DIV,
+  INST_SHL,
+  INST_SHR,
   INST_EQ,
   INST_NE,
   INST_GT,
@@ -27,20 +43,49 @@ typedef enum {
   INST_PRINTS,
   INST_NEG,
   INST_DEFG,
+  INST_INCG,
   INST_DEFL,
   INST_VARG,
   INST_VARL,
   INST_JMPA,
   INST_JMPT,
   INST_JMPNT,
+  INST_FORLOOP,
   INST_RET,
   INST_LDR,
   INST_STR,
   INST_MOV,
+  INST_TAILCALL,
+  INST_MEMOCALL,
+  INST_MEMORET,
+  INST_ANEW,
+  INST_ALOAD,
+  INST_ASTORE,
+  INST_ALEN,
+  INST_ASUM,
+  INST_ADOT,
+  INST_AADD,
+  INST_ASCALE,
+  INST_AMASK,
+  INST_VEXPR,
+  INST_SPAWN,
+  INST_YIELD,
+  INST_JOIN,
+  INST_CHAN,
+  INST_SEND,
+  INST_RECV,
+  INST_PMAP,
+  INST_PREDUCE,
   INST_LABEL,
   INST_EOF,
 } Inst_t;
 
+// Every inst has an unchecked twin past INST_EOF, which skips the stack,
+// jump and bounds checks the analyzer or the verifier proved to hold
+#define INST_UNCHECKED(type) ((Inst_t)((type) + INST_EOF + 1))
+#define INST_BASE(type)                                                        \
+  ((Inst_t)((type) > INST_EOF ? (type) - INST_EOF - 1 : (type)))
+
 typedef struct {
   Inst_t type;
   Word operand;
@@ -51,33 +96,201 @@ typedef struct {
   Word_t operand_type;
 } Inst_Context;
 
+// Words of stack committed up front; it grows on demand up to the limit,
+// past which a guard page turns pushes into VM_STACK_OVERFLOW
 #define VM_STACK_CAP 512
+#ifndef VM_STACK_LIMIT
+#define VM_STACK_LIMIT (1 << 20)
+#endif
 #define INSTS_CAP 256
 
 typedef uint64_t Addr;
 
+// Result cache of a pure Fn, 2-way set associative with LRU eviction
+#define MEMO_ARITY_CAP 4
+#define MEMO_SETS_CAP 128
+#define MEMO_ARG_LIMIT 65536
+
+typedef struct {
+  uint64_t args[MEMO_ARITY_CAP];
+  Word result;
+  uint8_t used;
+} Memo_entry;
+
+typedef struct {
+  Memo_entry ways[MEMO_SETS_CAP][2];
+  uint8_t lru[MEMO_SETS_CAP];
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} Memo;
+
+// Arrays are referred to by handle, their index in the registry plus one
+#define VM_ARRAYS_CAP 256
+#define VM_ARRAY_LEN_CAP (1 << 24)
+#define VM_ARRAY_ALIGN 32
+
+typedef struct {
+  Word_t type;
+  uint64_t len;
+  void *data;
+} Array;
+
+// An element-wise loop body as a postfix program of 4-bit ops packed in
+// the operand, lowest nibble first, evaluated a block of lanes at a time
+#define VEXPR_OPS_CAP 16
+#define VEXPR_DEPTH_CAP 8
+#define VEXPR_BLOCK 256
+
+typedef enum {
+  VEXPR_END,
+  // a[i], the handle being the next operand
+  VEXPR_ELEM,
+  // The next operand, the same in every lane
+  VEXPR_SCALAR,
+  // i itself
+  VEXPR_INDEX,
+  VEXPR_PLUS,
+  VEXPR_MINUS,
+  VEXPR_MULT,
+  VEXPR_NEG,
+} Vexpr_op;
+
+// Coroutines are referred to by handle, their index in the vm's tasks;
+// task 0 is the top level, registered by the first spawn
+#define VM_TASKS_CAP 4096
+// Back-edges a task runs before the next ready one gets its turn
+#define VM_TASK_SLICE 1024
+// Words of stack each spawned task may grow to
+#ifndef VM_TASK_STACK_LIMIT
+#define VM_TASK_STACK_LIMIT (1 << 16)
+#endif
+
+// Channels are referred to by handle like arrays: a bounded ring of
+// words whose head and tail only ever grow, so a single sender and a
+// single receiver never contend on the same counter. vm_chan_share hands
+// one to another vm, and each end belongs to the first vm to use it.
+#define VM_CHANS_CAP 256
+#define VM_CHAN_LEN_CAP (1 << 16)
+// Longest a thread waits on one shared channel before it looks again at
+// the others its tasks are parked on
+#define VM_CHAN_WAIT_NS 1000000
+
 typedef struct {
+  Word *ring;
+  uint64_t mask;
+
+  // Vms holding it, the last of which frees it
+  _Atomic uint64_t refs;
+  // Threads waiting for another vm to move head or tail
+  _Atomic uint64_t waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t moved;
+
+  // Next slot recv reads and send writes, and the vms that do so
+  _Alignas(64) _Atomic uint64_t head;
+  _Atomic(const struct Vm *) receiver;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Atomic(const struct Vm *) sender;
+} Chan;
+
+// Elements per job of parallel_map and parallel_reduce; fixed so that
+// how a reduce associates does not depend on the number of workers
+#ifndef VM_PARALLEL_CHUNK
+#define VM_PARALLEL_CHUNK 1024
+#endif
+
+typedef struct Task Task;
+
+typedef struct Vm {
   Inst program[INSTS_CAP];
   uint64_t program_size;
 
-  Word stack[VM_STACK_CAP];
+  // mmap'd: stack_cap words are committed and stack_limit reserved, the
+  // latter being what the verifier proves the program needs if it can
+  Word *stack;
+  uint64_t stack_cap;
+  uint64_t stack_limit;
   uint64_t stack_count;
 
   Hash_Table env;
 
+  // Indexed by Fn label_pos, allocated on first use
+  Memo *memos[INSTS_CAP];
+
+  // Backward jumps left before the vm suspends with VM_OUT_OF_FUEL; it
+  // resumes where it stopped once the host gives it more
+  uint64_t fuel;
+
+  Array *arrays[VM_ARRAYS_CAP];
+  uint64_t arrays_count;
+  // A parallel worker's first arrays are its caller's, which it reads but
+  // neither writes nor frees
+  uint64_t arrays_borrowed;
+
+  Chan *chans[VM_CHANS_CAP];
+  uint64_t chans_count;
+
+  // Where print and the stack and memo dumps write
+  FILE *out;
+
+  // The image the vm was restored from, if any; the program's names point
+  // into it
+  void *image;
+  size_t image_size;
+
+  // The running task lives in stack and reg below, the others in their
+  // Task; none exist until the first spawn
+  Task *tasks[VM_TASKS_CAP];
+  uint64_t tasks_count;
+  uint64_t task;
+  // Spawned tasks not done yet
+  uint64_t tasks_live;
+  // Back-edges left before the running task is switched out
+  uint64_t slice;
+
 #define REG_IP 10
 #define REG_FP 11
 #define REG_SP 12
 #define REG_RA 13
 #define REG_RAX 14
 #define REG_CPSR 15
-  Word reg[16];
+#define VM_REGS_CAP 16
+  Word reg[VM_REGS_CAP];
 } Vm;
 
+// A task's own operand stack, which holds its frames, and register file
+// while another one runs
+struct Task {
+  Word *stack;
+  uint64_t stack_cap;
+  uint64_t stack_limit;
+  uint64_t stack_count;
+  Word reg[VM_REGS_CAP];
+
+  // Handle of the task it is blocked joining, 0 if none
+  uint64_t joining;
+  // Channel it is parked on until there is room to send or a value to
+  // recv, NULL if none
+  Chan *parked;
+  uint8_t parked_sending;
+  // Set once the top level reached eof with spawned tasks still live
+  uint8_t draining;
+  uint8_t done;
+  Word result;
+};
+
 #define MAKE_PUSH(word)                                                        \
   (Inst) { .type = INST_PUSH, .operand = word }
 #define MAKE_POP                                                               \
   (Inst) { .type = INST_POP }
+#define MAKE_DUP                                                               \
+  (Inst) { .type = INST_DUP }
+#define MAKE_PICK(depth)                                                       \
+  (Inst) {                                                                     \
+    .type = INST_PICK, .operand = {.as_u64 = depth }                           \
+  }
 #define MAKE_PLUS                                                              \
   (Inst) { .type = INST_PLUS }
 #define MAKE_PLUSF                                                             \
@@ -88,6 +301,14 @@ typedef struct {
   (Inst) { .type = INST_MULT }
 #define MAKE_DIV                                                               \
   (Inst) { .type = INST_DIV }
+#define MAKE_SHL(shift)                                                        \
+  (Inst) {                                                                     \
+    .type = INST_SHL, .operand = {.as_u64 = shift }                            \
+  }
+#define MAKE_SHR(shift)                                                        \
+  (Inst) {                                                                     \
+    .type = INST_SHR, .operand = {.as_u64 = shift }                            \
+  }
 #define MAKE_EQ                                                                \
   (Inst) { .type = INST_EQ }
 #define MAKE_NE                                                                \
@@ -102,6 +323,10 @@ typedef struct {
   (Inst) {                                                                     \
     .type = INST_DEFG, .operand = {.as_sv = label }                            \
   }
+#define MAKE_INCG(label)                                                       \
+  (Inst) {                                                                     \
+    .type = INST_INCG, .operand = {.as_sv = label }                            \
+  }
 #define MAKE_DEFL(offset)                                                      \
   (Inst) {                                                                     \
     .type = INST_DEFL, .operand = {.as_u64 = offset }                          \
@@ -130,6 +355,10 @@ typedef struct {
   (Inst) {                                                                     \
     .type = INST_JMPNT, .operand = {.as_u64 = offset }                         \
   }
+#define MAKE_FORLOOP(offset)                                                   \
+  (Inst) {                                                                     \
+    .type = INST_FORLOOP, .operand = {.as_u64 = offset }                       \
+  }
 #define MAKE_RET                                                               \
   (Inst) { .type = INST_RET }
 #define MAKE_LDR(reg_no)                                                       \
@@ -144,6 +373,64 @@ typedef struct {
   (Inst) {                                                                     \
     .type = INST_MOV, .operand = {.as_u64 = reg_no }                           \
   }
+#define MAKE_TAILCALL(label_pos)                                               \
+  (Inst) {                                                                     \
+    .type = INST_TAILCALL, .operand = {.as_u64 = label_pos }                   \
+  }
+#define MAKE_MEMOCALL(label_pos)                                               \
+  (Inst) {                                                                     \
+    .type = INST_MEMOCALL, .operand = {.as_u64 = label_pos }                   \
+  }
+#define MAKE_MEMORET(label_pos)                                                \
+  (Inst) {                                                                     \
+    .type = INST_MEMORET, .operand = {.as_u64 = label_pos }                    \
+  }
+#define MAKE_ANEW(word_type)                                                   \
+  (Inst) {                                                                     \
+    .type = INST_ANEW, .operand = {.as_u64 = word_type }                       \
+  }
+#define MAKE_ALOAD                                                             \
+  (Inst) { .type = INST_ALOAD }
+#define MAKE_ASTORE                                                            \
+  (Inst) { .type = INST_ASTORE }
+#define MAKE_ALEN                                                              \
+  (Inst) { .type = INST_ALEN }
+#define MAKE_ASUM                                                              \
+  (Inst) { .type = INST_ASUM }
+#define MAKE_ADOT                                                              \
+  (Inst) { .type = INST_ADOT }
+#define MAKE_AADD                                                              \
+  (Inst) { .type = INST_AADD }
+#define MAKE_ASCALE                                                            \
+  (Inst) { .type = INST_ASCALE }
+#define MAKE_AMASK                                                             \
+  (Inst) { .type = INST_AMASK }
+#define MAKE_VEXPR(prog)                                                       \
+  (Inst) {                                                                     \
+    .type = INST_VEXPR, .operand = {.as_u64 = prog }                           \
+  }
+#define MAKE_SPAWN(label_pos)                                                  \
+  (Inst) {                                                                     \
+    .type = INST_SPAWN, .operand = {.as_u64 = label_pos }                      \
+  }
+#define MAKE_YIELD                                                             \
+  (Inst) { .type = INST_YIELD }
+#define MAKE_JOIN                                                              \
+  (Inst) { .type = INST_JOIN }
+#define MAKE_CHAN                                                              \
+  (Inst) { .type = INST_CHAN }
+#define MAKE_SEND                                                              \
+  (Inst) { .type = INST_SEND }
+#define MAKE_RECV                                                              \
+  (Inst) { .type = INST_RECV }
+#define MAKE_PMAP(label_pos)                                                   \
+  (Inst) {                                                                     \
+    .type = INST_PMAP, .operand = {.as_u64 = label_pos }                       \
+  }
+#define MAKE_PREDUCE(label_pos)                                                \
+  (Inst) {                                                                     \
+    .type = INST_PREDUCE, .operand = {.as_u64 = label_pos }                    \
+  }
 #define MAKE_LABEL(label)                                                      \
   (Inst) {                                                                     \
     .type = INST_LABEL, .operand = {.as_sv = label }                           \
@@ -151,14 +438,45 @@ typedef struct {
 #define MAKE_EOF                                                               \
   (Inst) { .type = INST_EOF }
 
-void vm_init(void);
-void vm_destruct(void);
-void vm_program_load_from_memory(Inst *insts, size_t insts_count);
-void vm_execute(void);
+void vm_init(Vm *vm);
+void vm_destruct(Vm *vm);
+void vm_program_load_from_memory(Vm *vm, Inst *insts, size_t insts_count);
+// Puts insts in place of the program's eof, and the vm at the first of
+// them, with the globals, arrays and memos of what ran before. The whole
+// program is verified again from there, running unchecked where it passes
+// and with every check where it does not.
+void vm_program_append(Vm *vm, const Inst *insts, size_t insts_count);
+Err vm_execute(Vm *vm);
+// A pure Fn's cached result for args, NULL on a miss; memos is indexed
+// by Fn label_pos and a missing cache is allocated on lookup
+Word *vm_memo_lookup(Memo **memos, Addr label, const Word *args,
+                     uint64_t arity);
+void vm_memo_store(Memo **memos, Addr label, const Word *args,
+                   uint64_t arity, Word result);
+Err vm_sandbox_eval(const Inst *insts, const size_t insts_count,
+                    const Addr entry, const uint64_t fuel, Word *result);
+// Writes a suspended or finished vm's program, globals, stack, registers,
+// arrays and memos to file as an image that holds no pointers. Tasks and
+// channels are not saved; a vm with any fails with VM_ILLEGAL_ACCESS.
+Err vm_image_save(const Vm *vm, FILE *file);
+// Restores a freshly initialized vm from the image at path, which stays
+// mapped until vm_destruct; run it to resume where the saved one stopped.
+// Images hold base opcodes only, and a resumed run keeps every check.
+Err vm_image_load(Vm *vm, const char *path);
+// Registers vm's channel handle with to as well, its handle there in
+// shared. A vm sending or receiving on an end another vm already used
+// fails with VM_ILLEGAL_ACCESS. The two may run on separate threads: once
+// none of a vm's tasks can go on, its thread waits for another vm to move
+// a channel they are parked on, and fails with VM_DEADLOCK only once no
+// other vm holds it.
+Err vm_chan_share(Vm *vm, Word handle, Vm *to, Word *shared);
+char *vm_err_to_str(Err err);
+uint64_t vm_call_depth(const Vm *vm);
 char *vm_inst_t_to_str(Inst_t type);
 
-void vm_inst_dump(const Inst *inst);
-void vm_stack_dump(void);
-void vm_program_dump(void);
+void vm_inst_dump(FILE *out, const Inst *inst);
+void vm_stack_dump(const Vm *vm);
+void vm_program_dump(const Vm *vm);
+void vm_memo_dump(const Vm *vm);
 
 #endif
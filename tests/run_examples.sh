@@ -0,0 +1,75 @@
+#!/bin/sh
+# Runs every example with all optimizations, with none, and with all but
+# one for each pass in turn, and diffs what it prints against
+# tests/expected/<example>. Each is also suspended into an image and
+# resumed from it, and fed to the REPL, where those can run it.
+#
+# Usage: tests/run_examples.sh [<main>]
+
+cd "$(dirname "$0")/.." || exit 1
+main=${1:-./main}
+passes="tail fold inline memo vectorize unroll loops cse dse ranges"
+# Images hold no tasks or channels, and every REPL piece runs to its end
+# on its own, without imports
+no_image="chan task"
+no_repl="chan task import"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+runs=0
+failed=0
+
+# What the program printed, without the analyzer's and the vm's dumps
+strip() {
+  grep -v '^[[:space:]]' | grep -v '^B[0-9]*$' |
+    grep -v '^Basic blocks\|^Remove\|^Stack:\|^Memo:\|^-----\|^$'
+}
+
+resume() {
+  rm -f "$tmp/image"
+  "$main" --fuel 50 --save "$tmp/image" "$1"
+  if [ -f "$tmp/image" ]; then
+    "$main" --load "$tmp/image"
+  fi
+}
+
+repl() {
+  "$main" --repl < "$1"
+}
+
+# check <example> <what> <command>...
+check() {
+  name=$1
+  what=$2
+  shift 2
+  runs=$((runs + 1))
+  "$@" 2>&1 | strip > "$tmp/out"
+  if ! diff -u "tests/expected/$name" "$tmp/out" > "$tmp/diff" 2>&1; then
+    echo "FAIL $name ($what)"
+    cat "$tmp/diff"
+    failed=$((failed + 1))
+  fi
+}
+
+for example in examples/*; do
+  [ -f "$example" ] || continue
+  name=$(basename "$example")
+
+  check "$name" "all passes" "$main" --passes all "$example"
+  check "$name" "no passes" "$main" --passes none "$example"
+  for pass in $passes; do
+    check "$name" "without $pass" "$main" --passes "-$pass" "$example"
+  done
+
+  case " $no_image " in
+  *" $name "*) ;;
+  *) check "$name" "resumed from an image" resume "$example" ;;
+  esac
+  case " $no_repl " in
+  *" $name "*) ;;
+  *) check "$name" "in the REPL" repl "$example" ;;
+  esac
+done
+
+echo "$runs runs, $failed failed"
+[ "$failed" -eq 0 ]